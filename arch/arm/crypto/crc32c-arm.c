@@ -0,0 +1,178 @@
+/*
+ * CRC32C (Castagnoli) using the slicing-by-8 method.
+ * CRC32C polynomial: 0x1EDC6F41(BE)/0x82F63B78(LE)
+ *
+ * The generic driver walks its table a byte at a time, so every byte
+ * costs a dependent load. Here eight bytes are folded per step through
+ * eight independent tables, which the Cortex-A8 can overlap.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#include <crypto/internal/hash.h>
+
+#define CHKSUM_BLOCK_SIZE	1
+#define CHKSUM_DIGEST_SIZE	4
+
+#define CRC32C_POLY_LE		0x82F63B78
+
+static u32 crc32c_table[8][256] __read_mostly;
+
+static void __init crc32c_arm_init_tables(void)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY_LE : 0);
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+static u32 crc32c_arm(u32 crc, const u8 *data, unsigned int length)
+{
+	const u32 (*t)[256] = crc32c_table;
+	u32 a, b;
+
+	while (length && ((unsigned long)data & 3)) {
+		crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		length--;
+	}
+
+	while (length >= 8) {
+		a = le32_to_cpup((const __le32 *)data) ^ crc;
+		b = le32_to_cpup((const __le32 *)(data + 4));
+		crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^
+		      t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+		      t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^
+		      t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static int crc32c_arm_setkey(struct crypto_shash *hash, const u8 *key,
+			     unsigned int keylen)
+{
+	u32 *mctx = crypto_shash_ctx(hash);
+
+	if (keylen != sizeof(u32)) {
+		crypto_shash_set_flags(hash, CRYPTO_TFM_RES_BAD_KEY_LEN);
+		return -EINVAL;
+	}
+	*mctx = le32_to_cpup((__le32 *)key);
+	return 0;
+}
+
+static int crc32c_arm_init(struct shash_desc *desc)
+{
+	u32 *mctx = crypto_shash_ctx(desc->tfm);
+	u32 *crcp = shash_desc_ctx(desc);
+
+	*crcp = *mctx;
+
+	return 0;
+}
+
+static int crc32c_arm_update(struct shash_desc *desc, const u8 *data,
+			     unsigned int len)
+{
+	u32 *crcp = shash_desc_ctx(desc);
+
+	*crcp = crc32c_arm(*crcp, data, len);
+	return 0;
+}
+
+static int __crc32c_arm_finup(u32 *crcp, const u8 *data, unsigned int len,
+			      u8 *out)
+{
+	*(__le32 *)out = ~cpu_to_le32(crc32c_arm(*crcp, data, len));
+	return 0;
+}
+
+static int crc32c_arm_finup(struct shash_desc *desc, const u8 *data,
+			    unsigned int len, u8 *out)
+{
+	return __crc32c_arm_finup(shash_desc_ctx(desc), data, len, out);
+}
+
+static int crc32c_arm_final(struct shash_desc *desc, u8 *out)
+{
+	u32 *crcp = shash_desc_ctx(desc);
+
+	*(__le32 *)out = ~cpu_to_le32p(crcp);
+	return 0;
+}
+
+static int crc32c_arm_digest(struct shash_desc *desc, const u8 *data,
+			     unsigned int len, u8 *out)
+{
+	return __crc32c_arm_finup(crypto_shash_ctx(desc->tfm), data, len,
+				  out);
+}
+
+static int crc32c_arm_cra_init(struct crypto_tfm *tfm)
+{
+	u32 *key = crypto_tfm_ctx(tfm);
+
+	*key = ~0;
+
+	return 0;
+}
+
+static struct shash_alg alg = {
+	.setkey			=	crc32c_arm_setkey,
+	.init			=	crc32c_arm_init,
+	.update			=	crc32c_arm_update,
+	.final			=	crc32c_arm_final,
+	.finup			=	crc32c_arm_finup,
+	.digest			=	crc32c_arm_digest,
+	.descsize		=	sizeof(u32),
+	.digestsize		=	CHKSUM_DIGEST_SIZE,
+	.base			=	{
+		.cra_name		=	"crc32c",
+		.cra_driver_name	=	"crc32c-arm",
+		.cra_priority		=	200,
+		.cra_blocksize		=	CHKSUM_BLOCK_SIZE,
+		.cra_ctxsize		=	sizeof(u32),
+		.cra_module		=	THIS_MODULE,
+		.cra_init		=	crc32c_arm_cra_init,
+	}
+};
+
+static int __init crc32c_arm_mod_init(void)
+{
+	crc32c_arm_init_tables();
+	return crypto_register_shash(&alg);
+}
+
+static void __exit crc32c_arm_mod_fini(void)
+{
+	crypto_unregister_shash(&alg);
+}
+
+module_init(crc32c_arm_mod_init);
+module_exit(crc32c_arm_mod_fini);
+
+MODULE_DESCRIPTION("CRC32c (Castagnoli) using slicing-by-8 tables");
+MODULE_LICENSE("GPL");
+
+MODULE_ALIAS("crc32c");
+MODULE_ALIAS("crc32c-arm");
@@ -0,0 +1,85 @@
+/*
+ * SHA-256 message schedule using NEON.
+ *
+ * Four message words are expanded per step. Only the two
+ * sigma1(W[t-2]) terms that depend on words of the same step are
+ * computed in halves. This file is built with -mfpu=neon and must
+ * only be called between kernel_neon_begin() and kernel_neon_end().
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <arm_neon.h>
+#include "sha256_neon.h"
+
+const u32 sha256_neon_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* ror(x, 7) ^ ror(x, 18) ^ (x >> 3) */
+static inline uint32x4_t s0(uint32x4_t x)
+{
+	return veorq_u32(veorq_u32(vsliq_n_u32(vshrq_n_u32(x, 7), x, 25),
+				   vsliq_n_u32(vshrq_n_u32(x, 18), x, 14)),
+			 vshrq_n_u32(x, 3));
+}
+
+/* ror(x, 17) ^ ror(x, 19) ^ (x >> 10) */
+static inline uint32x2_t s1(uint32x2_t x)
+{
+	return veor_u32(veor_u32(vsli_n_u32(vshr_n_u32(x, 17), x, 15),
+				 vsli_n_u32(vshr_n_u32(x, 19), x, 13)),
+			vshr_n_u32(x, 10));
+}
+
+void sha256_neon_schedule(u32 *wk, const u8 *data)
+{
+	uint32x4_t x0, x1, x2, x3, t, w;
+	uint32x2_t lo, hi;
+	int i;
+
+	x0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+	x1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+	x2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+	x3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+	vst1q_u32(wk + 0, vaddq_u32(x0, vld1q_u32(sha256_neon_k + 0)));
+	vst1q_u32(wk + 4, vaddq_u32(x1, vld1q_u32(sha256_neon_k + 4)));
+	vst1q_u32(wk + 8, vaddq_u32(x2, vld1q_u32(sha256_neon_k + 8)));
+	vst1q_u32(wk + 12, vaddq_u32(x3, vld1q_u32(sha256_neon_k + 12)));
+
+	for (i = 16; i < 64; i += 4) {
+		/* W[t-16] + s0(W[t-15]) + W[t-7] */
+		t = vaddq_u32(vaddq_u32(x0, s0(vextq_u32(x0, x1, 1))),
+			      vextq_u32(x2, x3, 1));
+
+		/* + s1(W[t-2]): W[t-2], W[t-1], then the new W[t], W[t+1] */
+		lo = vadd_u32(vget_low_u32(t), s1(vget_high_u32(x3)));
+		hi = vadd_u32(vget_high_u32(t), s1(lo));
+		w = vcombine_u32(lo, hi);
+
+		vst1q_u32(wk + i, vaddq_u32(w, vld1q_u32(sha256_neon_k + i)));
+
+		x0 = x1;
+		x1 = x2;
+		x2 = x3;
+		x3 = w;
+	}
+}
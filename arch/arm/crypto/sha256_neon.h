@@ -0,0 +1,11 @@
+#ifndef _SHA256_NEON_H
+#define _SHA256_NEON_H
+
+#include <linux/types.h>
+
+extern const u32 sha256_neon_k[64];
+
+/* wk[i] = W[i] + K[i] for the 64 rounds of one block; NEON only */
+void sha256_neon_schedule(u32 *wk, const u8 *data);
+
+#endif
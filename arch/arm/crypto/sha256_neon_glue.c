@@ -0,0 +1,322 @@
+/*
+ * Cryptographic API.
+ *
+ * Glue code for the SHA-224/SHA-256 Secure Hash Algorithm, with the
+ * message schedule computed by NEON (sha256-neon.c) and the rounds in
+ * ARM integer registers, so the two units' work is split.
+ *
+ * Derived from crypto/sha256_generic.c.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ */
+#include <crypto/internal/hash.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/types.h>
+#include <linux/hardirq.h>
+#include <crypto/sha.h>
+#include <asm/byteorder.h>
+#include <asm/neon.h>
+
+#include "sha256_neon.h"
+
+/*
+ * Saving the user's VFP context in kernel_neon_begin() is not worth it
+ * for a block or two; those take the integer schedule below.
+ */
+#define SHA256_NEON_MIN_BLOCKS	4
+
+/*
+ * kernel_neon_begin() disables preemption, so a large update drops out
+ * of NEON mode this often to let the scheduler in.
+ */
+#define SHA256_NEON_MAX_BLOCKS	16
+
+static inline u32 Ch(u32 x, u32 y, u32 z)
+{
+	return z ^ (x & (y ^ z));
+}
+
+static inline u32 Maj(u32 x, u32 y, u32 z)
+{
+	return (x & y) | (z & (x | y));
+}
+
+#define e0(x)       (ror32(x, 2) ^ ror32(x,13) ^ ror32(x,22))
+#define e1(x)       (ror32(x, 6) ^ ror32(x,11) ^ ror32(x,25))
+#define s0(x)       (ror32(x, 7) ^ ror32(x,18) ^ (x >> 3))
+#define s1(x)       (ror32(x,17) ^ ror32(x,19) ^ (x >> 10))
+
+static void sha256_schedule(u32 *wk, const u8 *input)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		wk[i] = __be32_to_cpu(((__be32 *)input)[i]);
+
+	for (; i < 64; i++)
+		wk[i] = s1(wk[i-2]) + wk[i-7] + s0(wk[i-15]) + wk[i-16];
+
+	for (i = 0; i < 64; i++)
+		wk[i] += sha256_neon_k[i];
+}
+
+#define ROUND(a, b, c, d, e, f, g, h, i)			\
+	do {							\
+		t1 = h + e1(e) + Ch(e, f, g) + wk[i];		\
+		t2 = e0(a) + Maj(a, b, c);			\
+		d += t1;					\
+		h = t1 + t2;					\
+	} while (0)
+
+static void sha256_rounds(u32 *state, const u32 *wk)
+{
+	u32 a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i += 8) {
+		ROUND(a, b, c, d, e, f, g, h, i + 0);
+		ROUND(h, a, b, c, d, e, f, g, i + 1);
+		ROUND(g, h, a, b, c, d, e, f, i + 2);
+		ROUND(f, g, h, a, b, c, d, e, i + 3);
+		ROUND(e, f, g, h, a, b, c, d, i + 4);
+		ROUND(d, e, f, g, h, a, b, c, i + 5);
+		ROUND(c, d, e, f, g, h, a, b, i + 6);
+		ROUND(b, c, d, e, f, g, h, a, i + 7);
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_blocks(u32 *state, const u8 *data, unsigned int blocks)
+{
+	u32 wk[64];
+	bool neon = blocks >= SHA256_NEON_MIN_BLOCKS && !in_interrupt();
+	unsigned int n = 0;
+
+	if (neon)
+		kernel_neon_begin();
+
+	while (blocks--) {
+		if (neon)
+			sha256_neon_schedule(wk, data);
+		else
+			sha256_schedule(wk, data);
+		sha256_rounds(state, wk);
+		data += SHA256_BLOCK_SIZE;
+
+		if (neon && blocks && ++n == SHA256_NEON_MAX_BLOCKS) {
+			kernel_neon_end();
+			kernel_neon_begin();
+			n = 0;
+		}
+	}
+
+	if (neon)
+		kernel_neon_end();
+
+	/* clear any sensitive info... */
+	memset(wk, 0, sizeof(wk));
+}
+
+static int sha224_neon_init(struct shash_desc *desc)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	sctx->state[0] = SHA224_H0;
+	sctx->state[1] = SHA224_H1;
+	sctx->state[2] = SHA224_H2;
+	sctx->state[3] = SHA224_H3;
+	sctx->state[4] = SHA224_H4;
+	sctx->state[5] = SHA224_H5;
+	sctx->state[6] = SHA224_H6;
+	sctx->state[7] = SHA224_H7;
+	sctx->count = 0;
+
+	return 0;
+}
+
+static int sha256_neon_init(struct shash_desc *desc)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	sctx->state[0] = SHA256_H0;
+	sctx->state[1] = SHA256_H1;
+	sctx->state[2] = SHA256_H2;
+	sctx->state[3] = SHA256_H3;
+	sctx->state[4] = SHA256_H4;
+	sctx->state[5] = SHA256_H5;
+	sctx->state[6] = SHA256_H6;
+	sctx->state[7] = SHA256_H7;
+	sctx->count = 0;
+
+	return 0;
+}
+
+static int sha256_neon_update(struct shash_desc *desc, const u8 *data,
+			      unsigned int len)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	unsigned int partial, blocks;
+
+	partial = sctx->count & 0x3f;
+	sctx->count += len;
+
+	if ((partial + len) > 63) {
+		if (partial) {
+			unsigned int fill = 64 - partial;
+
+			memcpy(sctx->buf + partial, data, fill);
+			sha256_blocks(sctx->state, sctx->buf, 1);
+			data += fill;
+			len -= fill;
+		}
+
+		blocks = len / 64;
+		if (blocks) {
+			sha256_blocks(sctx->state, data, blocks);
+			data += blocks * 64;
+			len -= blocks * 64;
+		}
+
+		partial = 0;
+	}
+	memcpy(sctx->buf + partial, data, len);
+
+	return 0;
+}
+
+static int sha256_neon_final(struct shash_desc *desc, u8 *out)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+	__be32 *dst = (__be32 *)out;
+	__be64 bits;
+	unsigned int index, pad_len;
+	int i;
+	static const u8 padding[64] = { 0x80, };
+
+	/* Save number of bits */
+	bits = cpu_to_be64(sctx->count << 3);
+
+	/* Pad out to 56 mod 64. */
+	index = sctx->count & 0x3f;
+	pad_len = (index < 56) ? (56 - index) : ((64+56) - index);
+	sha256_neon_update(desc, padding, pad_len);
+
+	/* Append length (before padding) */
+	sha256_neon_update(desc, (const u8 *)&bits, sizeof(bits));
+
+	/* Store state in digest */
+	for (i = 0; i < 8; i++)
+		dst[i] = cpu_to_be32(sctx->state[i]);
+
+	/* Zeroize sensitive information. */
+	memset(sctx, 0, sizeof(*sctx));
+
+	return 0;
+}
+
+static int sha224_neon_final(struct shash_desc *desc, u8 *hash)
+{
+	u8 D[SHA256_DIGEST_SIZE];
+
+	sha256_neon_final(desc, D);
+
+	memcpy(hash, D, SHA224_DIGEST_SIZE);
+	memset(D, 0, SHA256_DIGEST_SIZE);
+
+	return 0;
+}
+
+static int sha256_neon_export(struct shash_desc *desc, void *out)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+
+	memcpy(out, sctx, sizeof(*sctx));
+	return 0;
+}
+
+static int sha256_neon_import(struct shash_desc *desc, const void *in)
+{
+	struct sha256_state *sctx = shash_desc_ctx(desc);
+
+	memcpy(sctx, in, sizeof(*sctx));
+	return 0;
+}
+
+static struct shash_alg sha256 = {
+	.digestsize	=	SHA256_DIGEST_SIZE,
+	.init		=	sha256_neon_init,
+	.update		=	sha256_neon_update,
+	.final		=	sha256_neon_final,
+	.export		=	sha256_neon_export,
+	.import		=	sha256_neon_import,
+	.descsize	=	sizeof(struct sha256_state),
+	.statesize	=	sizeof(struct sha256_state),
+	.base		=	{
+		.cra_name	=	"sha256",
+		.cra_driver_name=	"sha256-neon",
+		.cra_priority	=	150,
+		.cra_flags	=	CRYPTO_ALG_TYPE_SHASH,
+		.cra_blocksize	=	SHA256_BLOCK_SIZE,
+		.cra_module	=	THIS_MODULE,
+	}
+};
+
+static struct shash_alg sha224 = {
+	.digestsize	=	SHA224_DIGEST_SIZE,
+	.init		=	sha224_neon_init,
+	.update		=	sha256_neon_update,
+	.final		=	sha224_neon_final,
+	.descsize	=	sizeof(struct sha256_state),
+	.base		=	{
+		.cra_name	=	"sha224",
+		.cra_driver_name=	"sha224-neon",
+		.cra_priority	=	150,
+		.cra_flags	=	CRYPTO_ALG_TYPE_SHASH,
+		.cra_blocksize	=	SHA224_BLOCK_SIZE,
+		.cra_module	=	THIS_MODULE,
+	}
+};
+
+static int __init sha256_neon_mod_init(void)
+{
+	int ret = 0;
+
+	if (!cpu_has_neon())
+		return -ENODEV;
+
+	ret = crypto_register_shash(&sha224);
+
+	if (ret < 0)
+		return ret;
+
+	ret = crypto_register_shash(&sha256);
+
+	if (ret < 0)
+		crypto_unregister_shash(&sha224);
+
+	return ret;
+}
+
+static void __exit sha256_neon_mod_fini(void)
+{
+	crypto_unregister_shash(&sha224);
+	crypto_unregister_shash(&sha256);
+}
+
+module_init(sha256_neon_mod_init);
+module_exit(sha256_neon_mod_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("SHA-224 and SHA-256 Secure Hash Algorithm, NEON accelerated");
+
+MODULE_ALIAS("sha224");
+MODULE_ALIAS("sha256");
@@ -24,10 +24,14 @@
 #include <linux/io.h>
 #include <linux/crypto.h>
 #include <linux/interrupt.h>
+#include <linux/slab.h>
 
 #include <crypto/algapi.h>
 #include <crypto/aes.h>
+#include <crypto/b128ops.h>
 #include <crypto/ctr.h>
+#include <crypto/gf128mul.h>
+#include <crypto/scatterwalk.h>
 
 #include <plat/cpu.h>
 #include <plat/dma.h>
@@ -141,12 +145,21 @@
 #define FLAGS_AES_MODE_MASK             _SBF(1, 0x03)
 #define FLAGS_AES_CBC                   _SBF(1, 0x01)
 #define FLAGS_AES_CTR                   _SBF(1, 0x02)
+#define FLAGS_AES_XTS                   _SBF(1, 0x03)
 
 #define AES_KEY_LEN         16
-#define CRYPTO_QUEUE_LEN    1
+#define CRYPTO_QUEUE_LEN    32
+
+/*
+ * Requests whose scatterlists the feed DMA can't walk directly are
+ * copied through this buffer; bigger ones get a buffer of their own.
+ */
+#define S5P_AES_BOUNCE_ORDER	1
+#define S5P_AES_BOUNCE_SIZE	(PAGE_SIZE << S5P_AES_BOUNCE_ORDER)
 
 struct s5p_aes_reqctx {
 	unsigned long mode;
+	uint8_t       iv[AES_BLOCK_SIZE];
 };
 
 struct s5p_aes_ctx {
@@ -155,6 +168,9 @@ struct s5p_aes_ctx {
 	uint8_t                     aes_key[AES_MAX_KEY_SIZE];
 	uint8_t                     nonce[CTR_RFC3686_NONCE_SIZE];
 	int                         keylen;
+
+	/* XTS: tweak cipher, keyed with the second half of the key */
+	struct crypto_cipher       *tweak;
 };
 
 struct s5p_aes_dev {
@@ -169,6 +185,18 @@ struct s5p_aes_dev {
 	struct scatterlist         *sg_src;
 	struct scatterlist         *sg_dst;
 
+	/* the request as mapped for the feed DMA */
+	struct scatterlist         *src_list;
+	struct scatterlist         *dst_list;
+	int                         src_nents;
+	int                         dst_nents;
+	unsigned int                src_bytes;
+	unsigned int                dst_bytes;
+
+	void                       *bounce;
+	void                       *xfer_buf;
+	struct scatterlist          xfer_sg[2];
+
 	struct tasklet_struct       tasklet;
 	struct crypto_queue         queue;
 	bool                        busy;
@@ -179,116 +207,158 @@ static struct s5p_aes_dev *s5p_dev;
 
 static void s5p_set_dma_indata(struct s5p_aes_dev *dev, struct scatterlist *sg)
 {
+	unsigned int len = min_t(unsigned int, sg_dma_len(sg), dev->src_bytes);
+
+	dev->src_bytes -= len;
 	SSS_WRITE(dev, FCBRDMAS, sg_dma_address(sg));
-	SSS_WRITE(dev, FCBRDMAL, sg_dma_len(sg));
+	SSS_WRITE(dev, FCBRDMAL, len);
 }
 
 static void s5p_set_dma_outdata(struct s5p_aes_dev *dev, struct scatterlist *sg)
 {
+	unsigned int len = min_t(unsigned int, sg_dma_len(sg), dev->dst_bytes);
+
+	dev->dst_bytes -= len;
 	SSS_WRITE(dev, FCBTDMAS, sg_dma_address(sg));
-	SSS_WRITE(dev, FCBTDMAL, sg_dma_len(sg));
+	SSS_WRITE(dev, FCBTDMAL, len);
 }
 
 static void s5p_aes_complete(struct s5p_aes_dev *dev, int err)
 {
-	/* holding a lock outside */
 	dev->req->base.complete(&dev->req->base, err);
-	dev->busy = false;
+	dev->req = NULL;
 }
 
-static void s5p_unset_outdata(struct s5p_aes_dev *dev)
+/*
+ * Number of entries of @sg covering @nbytes, or 0 if one of them can't
+ * be handed to the feed DMA as it is.
+ */
+static int s5p_sg_count(struct scatterlist *sg, unsigned int nbytes)
 {
-	dma_unmap_sg(dev->dev, dev->sg_dst, 1, DMA_FROM_DEVICE);
-}
+	int nents = 0;
 
-static void s5p_unset_indata(struct s5p_aes_dev *dev)
-{
-	dma_unmap_sg(dev->dev, dev->sg_src, 1, DMA_TO_DEVICE);
+	while (nbytes) {
+		if (!sg || !sg->length ||
+		    !IS_ALIGNED(sg->offset, sizeof(uint32_t)) ||
+		    !IS_ALIGNED(sg->length, AES_BLOCK_SIZE))
+			return 0;
+
+		nbytes -= min(sg->length, nbytes);
+		nents++;
+		sg = sg_next(sg);
+	}
+
+	return nents;
 }
 
-static int s5p_set_outdata(struct s5p_aes_dev *dev, struct scatterlist *sg)
+static int s5p_aes_bounce(struct s5p_aes_dev *dev, unsigned int len)
 {
-	int err;
+	struct ablkcipher_request *req = dev->req;
+	void *buf = dev->bounce;
 
-	if (!IS_ALIGNED(sg_dma_len(sg), AES_BLOCK_SIZE)) {
-		err = -EINVAL;
-		goto exit;
-	}
-	if (!sg_dma_len(sg)) {
-		err = -EINVAL;
-		goto exit;
+	if (len > S5P_AES_BOUNCE_SIZE) {
+		buf = kmalloc(len, GFP_ATOMIC);
+		if (!buf)
+			return -ENOMEM;
 	}
 
-	err = dma_map_sg(dev->dev, sg, 1, DMA_FROM_DEVICE);
-	if (!err) {
-		err = -ENOMEM;
-		goto exit;
-	}
+	scatterwalk_map_and_copy(buf, req->src, 0, req->nbytes, 0);
+	memset(buf + req->nbytes, 0, len - req->nbytes);
 
-	dev->sg_dst = sg;
-	err = 0;
+	sg_init_one(&dev->xfer_sg[0], buf, len);
+	sg_init_one(&dev->xfer_sg[1], buf, len);
+	dev->xfer_buf = buf;
 
- exit:
-	return err;
+	return 0;
 }
 
-static int s5p_set_indata(struct s5p_aes_dev *dev, struct scatterlist *sg)
+static void s5p_aes_unbounce(struct s5p_aes_dev *dev)
 {
-	int err;
+	if (dev->xfer_buf != dev->bounce)
+		kfree(dev->xfer_buf);
+	dev->xfer_buf = NULL;
+}
 
-	if (!IS_ALIGNED(sg_dma_len(sg), AES_BLOCK_SIZE)) {
-		err = -EINVAL;
-		goto exit;
-	}
-	if (!sg_dma_len(sg)) {
-		err = -EINVAL;
-		goto exit;
-	}
+/*
+ * The engine has no XTS mode: run it in ECB over a copy of the data
+ * that is xored with the tweaks before and after.
+ */
+static void s5p_xts_xor(struct s5p_aes_ctx *ctx, const uint8_t *iv,
+			uint8_t *buf, unsigned int len)
+{
+	be128 t;
 
-	err = dma_map_sg(dev->dev, sg, 1, DMA_TO_DEVICE);
-	if (!err) {
-		err = -ENOMEM;
-		goto exit;
+	crypto_cipher_encrypt_one(ctx->tweak, (uint8_t *)&t, iv);
+
+	for (; len; len -= AES_BLOCK_SIZE, buf += AES_BLOCK_SIZE) {
+		be128_xor((be128 *)buf, &t, (be128 *)buf);
+		gf128mul_x_ble(&t, &t);
 	}
+}
 
-	dev->sg_src = sg;
-	err = 0;
+static void s5p_ctr_add(uint8_t *ctr, unsigned int n)
+{
+	int i;
 
- exit:
-	return err;
+	for (i = AES_BLOCK_SIZE - 1; i >= 0 && n; i--) {
+		n += ctr[i];
+		ctr[i] = n;
+		n >>= 8;
+	}
 }
 
-static void s5p_aes_tx(struct s5p_aes_dev *dev)
+static void s5p_aes_unmap(struct s5p_aes_dev *dev)
 {
-	int err = 0;
+	dma_unmap_sg(dev->dev, dev->dst_list, dev->dst_nents, DMA_FROM_DEVICE);
+	dma_unmap_sg(dev->dev, dev->src_list, dev->src_nents, DMA_TO_DEVICE);
+}
 
-	s5p_unset_outdata(dev);
+/* Copy back bounced data and hand the chaining value to the caller */
+static void s5p_aes_done(struct s5p_aes_dev *dev)
+{
+	struct ablkcipher_request *req    = dev->req;
+	struct s5p_aes_reqctx     *reqctx = ablkcipher_request_ctx(req);
+	unsigned long              mode   = reqctx->mode;
+
+	if (dev->xfer_buf) {
+		if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_XTS)
+			s5p_xts_xor(dev->ctx, req->info, dev->xfer_buf,
+				    req->nbytes);
+		scatterwalk_map_and_copy(dev->xfer_buf, req->dst, 0,
+					 req->nbytes, 1);
+		s5p_aes_unbounce(dev);
+	}
 
-	if (!sg_is_last(dev->sg_dst)) {
-		err = s5p_set_outdata(dev, sg_next(dev->sg_dst));
-		if (err) {
-			s5p_aes_complete(dev, err);
-			return;
-		}
+	switch (mode & FLAGS_AES_MODE_MASK) {
+	case FLAGS_AES_CBC:
+		if (mode & FLAGS_AES_DECRYPT)
+			memcpy(req->info, reqctx->iv, AES_BLOCK_SIZE);
+		else
+			scatterwalk_map_and_copy(req->info, req->dst,
+						 req->nbytes - AES_BLOCK_SIZE,
+						 AES_BLOCK_SIZE, 0);
+		break;
+	case FLAGS_AES_CTR:
+		/* A trailing partial block uses up a counter value too */
+		s5p_ctr_add(req->info,
+			    DIV_ROUND_UP(req->nbytes, AES_BLOCK_SIZE));
+		break;
+	}
+}
 
+static void s5p_aes_tx(struct s5p_aes_dev *dev)
+{
+	if (dev->dst_bytes) {
+		dev->sg_dst = sg_next(dev->sg_dst);
 		s5p_set_dma_outdata(dev, dev->sg_dst);
 	} else
-		s5p_aes_complete(dev, err);
+		tasklet_schedule(&dev->tasklet);
 }
 
 static void s5p_aes_rx(struct s5p_aes_dev *dev)
 {
-	int err;
-
-	s5p_unset_indata(dev);
-
-	if (!sg_is_last(dev->sg_src)) {
-		err = s5p_set_indata(dev, sg_next(dev->sg_src));
-		if (err) {
-			s5p_aes_complete(dev, err);
-			return;
-		}
-
+	if (dev->src_bytes) {
+		dev->sg_src = sg_next(dev->sg_src);
 		s5p_set_dma_indata(dev, dev->sg_src);
 	}
 }
@@ -317,12 +387,15 @@ static irqreturn_t s5p_aes_interrupt(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
-static void s5p_set_aes(struct s5p_aes_dev *dev,
-			uint8_t *key, uint8_t *iv, unsigned int keylen)
+static void s5p_set_aes(struct s5p_aes_dev *dev, uint8_t *key,
+			uint8_t *iv, unsigned int keylen, unsigned long mode)
 {
 	void __iomem *keystart;
 
-	memcpy(dev->ioaddr + SSS_REG_AES_IV_DATA(0), iv, 0x10);
+	if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_CBC)
+		memcpy(dev->ioaddr + SSS_REG_AES_IV_DATA(0), iv, 0x10);
+	else if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_CTR)
+		memcpy(dev->ioaddr + SSS_REG_AES_CNT_DATA(0), iv, 0x10);
 
 	if (keylen == AES_KEYSIZE_256)
 		keystart = dev->ioaddr + SSS_REG_AES_KEY_DATA(0);
@@ -334,9 +407,13 @@ static void s5p_set_aes(struct s5p_aes_dev *dev,
 	memcpy(keystart, key, keylen);
 }
 
-static void s5p_aes_crypt_start(struct s5p_aes_dev *dev, unsigned long mode)
+static int s5p_aes_crypt_start(struct s5p_aes_dev *dev, unsigned long mode)
 {
-	struct ablkcipher_request  *req = dev->req;
+	struct ablkcipher_request  *req    = dev->req;
+	struct s5p_aes_reqctx      *reqctx = ablkcipher_request_ctx(req);
+	struct scatterlist         *src    = req->src;
+	struct scatterlist         *dst    = req->dst;
+	unsigned int                len    = ALIGN(req->nbytes, AES_BLOCK_SIZE);
 
 	uint32_t                    aes_control;
 	int                         err;
@@ -365,39 +442,71 @@ static void s5p_aes_crypt_start(struct s5p_aes_dev *dev, unsigned long mode)
 		    |  SSS_AES_BYTESWAP_KEY
 		    |  SSS_AES_BYTESWAP_CNT;
 
+	/* the next IV is the last ciphertext block, which may be overwritten */
+	if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_CBC &&
+	    (mode & FLAGS_AES_DECRYPT))
+		scatterwalk_map_and_copy(reqctx->iv, src,
+					 req->nbytes - AES_BLOCK_SIZE,
+					 AES_BLOCK_SIZE, 0);
+
+	dev->src_nents = s5p_sg_count(src, len);
+	dev->dst_nents = s5p_sg_count(dst, len);
+
+	if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_XTS ||
+	    len != req->nbytes || !dev->src_nents || !dev->dst_nents) {
+		err = s5p_aes_bounce(dev, len);
+		if (err)
+			return err;
+
+		if ((mode & FLAGS_AES_MODE_MASK) == FLAGS_AES_XTS)
+			s5p_xts_xor(dev->ctx, req->info, dev->xfer_buf, len);
+
+		src = &dev->xfer_sg[0];
+		dst = &dev->xfer_sg[1];
+		dev->src_nents = 1;
+		dev->dst_nents = 1;
+	}
+
+	err = -ENOMEM;
+	if (!dma_map_sg(dev->dev, src, dev->src_nents, DMA_TO_DEVICE))
+		goto indata_error;
+	if (!dma_map_sg(dev->dev, dst, dev->dst_nents, DMA_FROM_DEVICE))
+		goto outdata_error;
+
+	dev->src_list  = src;
+	dev->dst_list  = dst;
+	dev->sg_src    = src;
+	dev->sg_dst    = dst;
+	dev->src_bytes = len;
+	dev->dst_bytes = len;
+
 	spin_lock_irqsave(&dev->lock, flags);
 
 	SSS_WRITE(dev, FCINTENCLR,
 		  SSS_FCINTENCLR_BTDMAINTENCLR | SSS_FCINTENCLR_BRDMAINTENCLR);
 	SSS_WRITE(dev, FCFIFOCTRL, 0x00);
 
-	err = s5p_set_indata(dev, req->src);
-	if (err)
-		goto indata_error;
-
-	err = s5p_set_outdata(dev, req->dst);
-	if (err)
-		goto outdata_error;
-
 	SSS_WRITE(dev, AES_CONTROL, aes_control);
-	s5p_set_aes(dev, dev->ctx->aes_key, req->info, dev->ctx->keylen);
+	s5p_set_aes(dev, dev->ctx->aes_key, req->info, dev->ctx->keylen, mode);
 
-	s5p_set_dma_indata(dev,  req->src);
-	s5p_set_dma_outdata(dev, req->dst);
+	s5p_set_dma_indata(dev,  src);
+	s5p_set_dma_outdata(dev, dst);
 
 	SSS_WRITE(dev, FCINTENSET,
 		  SSS_FCINTENSET_BTDMAINTENSET | SSS_FCINTENSET_BRDMAINTENSET);
 
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	return;
+	return 0;
 
  outdata_error:
-	s5p_unset_indata(dev);
+	dma_unmap_sg(dev->dev, src, dev->src_nents, DMA_TO_DEVICE);
 
  indata_error:
-	s5p_aes_complete(dev, err);
-	spin_unlock_irqrestore(&dev->lock, flags);
+	if (dev->xfer_buf)
+		s5p_aes_unbounce(dev);
+
+	return err;
 }
 
 static void s5p_tasklet_cb(unsigned long data)
@@ -406,23 +515,37 @@ static void s5p_tasklet_cb(unsigned long data)
 	struct crypto_async_request *async_req, *backlog;
 	struct s5p_aes_reqctx *reqctx;
 	unsigned long flags;
+	int err;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	backlog   = crypto_get_backlog(&dev->queue);
-	async_req = crypto_dequeue_request(&dev->queue);
-	spin_unlock_irqrestore(&dev->lock, flags);
+	/* scheduled by the interrupt handler: the engine is done */
+	if (dev->req) {
+		s5p_aes_unmap(dev);
+		s5p_aes_done(dev);
+		s5p_aes_complete(dev, 0);
+	}
 
-	if (!async_req)
-		return;
+	do {
+		spin_lock_irqsave(&dev->lock, flags);
+		backlog   = crypto_get_backlog(&dev->queue);
+		async_req = crypto_dequeue_request(&dev->queue);
+		if (!async_req)
+			dev->busy = false;
+		spin_unlock_irqrestore(&dev->lock, flags);
 
-	if (backlog)
-		backlog->complete(backlog, -EINPROGRESS);
+		if (!async_req)
+			return;
 
-	dev->req = ablkcipher_request_cast(async_req);
-	dev->ctx = crypto_tfm_ctx(dev->req->base.tfm);
-	reqctx   = ablkcipher_request_ctx(dev->req);
+		if (backlog)
+			backlog->complete(backlog, -EINPROGRESS);
 
-	s5p_aes_crypt_start(dev, reqctx->mode);
+		dev->req = ablkcipher_request_cast(async_req);
+		dev->ctx = crypto_tfm_ctx(dev->req->base.tfm);
+		reqctx   = ablkcipher_request_ctx(dev->req);
+
+		err = s5p_aes_crypt_start(dev, reqctx->mode);
+		if (err)
+			s5p_aes_complete(dev, err);
+	} while (err);
 }
 
 static int s5p_aes_handle_req(struct s5p_aes_dev *dev,
@@ -432,14 +555,12 @@ static int s5p_aes_handle_req(struct s5p_aes_dev *dev,
 	int err;
 
 	spin_lock_irqsave(&dev->lock, flags);
+	err = ablkcipher_enqueue_request(&dev->queue, req);
 	if (dev->busy) {
-		err = -EAGAIN;
 		spin_unlock_irqrestore(&dev->lock, flags);
 		goto exit;
 	}
 	dev->busy = true;
-
-	err = ablkcipher_enqueue_request(&dev->queue, req);
 	spin_unlock_irqrestore(&dev->lock, flags);
 
 	tasklet_schedule(&dev->tasklet);
@@ -455,11 +576,15 @@ static int s5p_aes_crypt(struct ablkcipher_request *req, unsigned long mode)
 	struct s5p_aes_reqctx      *reqctx = ablkcipher_request_ctx(req);
 	struct s5p_aes_dev         *dev    = ctx->dev;
 
-	if (!IS_ALIGNED(req->nbytes, AES_BLOCK_SIZE)) {
+	if (!IS_ALIGNED(req->nbytes, AES_BLOCK_SIZE) &&
+	    (mode & FLAGS_AES_MODE_MASK) != FLAGS_AES_CTR) {
 		pr_err("request size is not exact amount of AES blocks\n");
 		return -EINVAL;
 	}
 
+	if (!req->nbytes)
+		return 0;
+
 	reqctx->mode = mode;
 
 	return s5p_aes_handle_req(dev, req);
@@ -482,6 +607,24 @@ static int s5p_aes_setkey(struct crypto_ablkcipher *cipher,
 	return 0;
 }
 
+static int s5p_aes_xts_setkey(struct crypto_ablkcipher *cipher,
+			      const uint8_t *key, unsigned int keylen)
+{
+	struct crypto_tfm  *tfm = crypto_ablkcipher_tfm(cipher);
+	struct s5p_aes_ctx *ctx = crypto_tfm_ctx(tfm);
+	int                 err;
+
+	if (keylen % 2)
+		return -EINVAL;
+	keylen /= 2;
+
+	err = s5p_aes_setkey(cipher, key, keylen);
+	if (err)
+		return err;
+
+	return crypto_cipher_setkey(ctx->tweak, key + keylen, keylen);
+}
+
 static int s5p_aes_ecb_encrypt(struct ablkcipher_request *req)
 {
 	return s5p_aes_crypt(req, 0);
@@ -502,6 +645,21 @@ static int s5p_aes_cbc_decrypt(struct ablkcipher_request *req)
 	return s5p_aes_crypt(req, FLAGS_AES_DECRYPT | FLAGS_AES_CBC);
 }
 
+static int s5p_aes_ctr_crypt(struct ablkcipher_request *req)
+{
+	return s5p_aes_crypt(req, FLAGS_AES_CTR);
+}
+
+static int s5p_aes_xts_encrypt(struct ablkcipher_request *req)
+{
+	return s5p_aes_crypt(req, FLAGS_AES_XTS);
+}
+
+static int s5p_aes_xts_decrypt(struct ablkcipher_request *req)
+{
+	return s5p_aes_crypt(req, FLAGS_AES_DECRYPT | FLAGS_AES_XTS);
+}
+
 static int s5p_aes_cra_init(struct crypto_tfm *tfm)
 {
 	struct s5p_aes_ctx  *ctx = crypto_tfm_ctx(tfm);
@@ -512,6 +670,24 @@ static int s5p_aes_cra_init(struct crypto_tfm *tfm)
 	return 0;
 }
 
+static int s5p_aes_xts_cra_init(struct crypto_tfm *tfm)
+{
+	struct s5p_aes_ctx  *ctx = crypto_tfm_ctx(tfm);
+
+	ctx->tweak = crypto_alloc_cipher("aes", 0, 0);
+	if (IS_ERR(ctx->tweak))
+		return PTR_ERR(ctx->tweak);
+
+	return s5p_aes_cra_init(tfm);
+}
+
+static void s5p_aes_xts_cra_exit(struct crypto_tfm *tfm)
+{
+	struct s5p_aes_ctx  *ctx = crypto_tfm_ctx(tfm);
+
+	crypto_free_cipher(ctx->tweak);
+}
+
 static struct crypto_alg algs[] = {
 	{
 		.cra_name		= "ecb(aes)",
@@ -554,6 +730,49 @@ static struct crypto_alg algs[] = {
 			.decrypt	= s5p_aes_cbc_decrypt,
 		}
 	},
+	{
+		.cra_name		= "ctr(aes)",
+		.cra_driver_name	= "ctr-aes-s5p",
+		.cra_priority		= 100,
+		.cra_flags		= CRYPTO_ALG_TYPE_ABLKCIPHER |
+					  CRYPTO_ALG_ASYNC,
+		.cra_blocksize		= 1,
+		.cra_ctxsize		= sizeof(struct s5p_aes_ctx),
+		.cra_alignmask		= 0x0f,
+		.cra_type		= &crypto_ablkcipher_type,
+		.cra_module		= THIS_MODULE,
+		.cra_init		= s5p_aes_cra_init,
+		.cra_u.ablkcipher = {
+			.min_keysize	= AES_MIN_KEY_SIZE,
+			.max_keysize	= AES_MAX_KEY_SIZE,
+			.ivsize		= AES_BLOCK_SIZE,
+			.setkey		= s5p_aes_setkey,
+			.encrypt	= s5p_aes_ctr_crypt,
+			.decrypt	= s5p_aes_ctr_crypt,
+		}
+	},
+	{
+		.cra_name		= "xts(aes)",
+		.cra_driver_name	= "xts-aes-s5p",
+		.cra_priority		= 100,
+		.cra_flags		= CRYPTO_ALG_TYPE_ABLKCIPHER |
+					  CRYPTO_ALG_ASYNC,
+		.cra_blocksize		= AES_BLOCK_SIZE,
+		.cra_ctxsize		= sizeof(struct s5p_aes_ctx),
+		.cra_alignmask		= 0x0f,
+		.cra_type		= &crypto_ablkcipher_type,
+		.cra_module		= THIS_MODULE,
+		.cra_init		= s5p_aes_xts_cra_init,
+		.cra_exit		= s5p_aes_xts_cra_exit,
+		.cra_u.ablkcipher = {
+			.min_keysize	= 2 * AES_MIN_KEY_SIZE,
+			.max_keysize	= 2 * AES_MAX_KEY_SIZE,
+			.ivsize		= AES_BLOCK_SIZE,
+			.setkey		= s5p_aes_xts_setkey,
+			.encrypt	= s5p_aes_xts_encrypt,
+			.decrypt	= s5p_aes_xts_decrypt,
+		}
+	},
 };
 
 static int s5p_aes_probe(struct platform_device *pdev)
@@ -586,6 +805,13 @@ static int s5p_aes_probe(struct platform_device *pdev)
 
 	clk_enable(pdata->clk);
 
+	pdata->bounce = (void *)__get_free_pages(GFP_KERNEL,
+						 S5P_AES_BOUNCE_ORDER);
+	if (!pdata->bounce) {
+		err = -ENOMEM;
+		goto err_irq;
+	}
+
 	spin_lock_init(&pdata->lock);
 	pdata->ioaddr = devm_ioremap(dev, res->start,
 				     resource_size(res));
@@ -643,6 +869,9 @@ static int s5p_aes_probe(struct platform_device *pdev)
 	tasklet_kill(&pdata->tasklet);
 
  err_irq:
+	if (pdata->bounce)
+		free_pages((unsigned long)pdata->bounce, S5P_AES_BOUNCE_ORDER);
+
 	clk_disable(pdata->clk);
 	clk_put(pdata->clk);
 
@@ -665,6 +894,8 @@ static int s5p_aes_remove(struct platform_device *pdev)
 
 	tasklet_kill(&pdata->tasklet);
 
+	free_pages((unsigned long)pdata->bounce, S5P_AES_BOUNCE_ORDER);
+
 	clk_disable(pdata->clk);
 	clk_put(pdata->clk);
 
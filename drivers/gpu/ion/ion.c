@@ -475,6 +475,9 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 	} else {
 		sglist = buffer->sglist;
 	}
+	/* The cpu may have written to the buffer since the first map_dma */
+	if (!IS_ERR_OR_NULL(sglist) && buffer->heap->ops->sync_for_device)
+		buffer->heap->ops->sync_for_device(buffer->heap, buffer);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
 	return sglist;
@@ -1097,6 +1100,8 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+	if (heap->debug_show)
+		heap->debug_show(heap, s, unused);
 	return 0;
 }
 
@@ -0,0 +1,100 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include "ion_priv.h"
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	BUG_ON(!pool->count);
+	page = list_first_entry(&pool->items, struct page, lru);
+	list_del(&page->lru);
+	pool->count--;
+	return page;
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+
+	mutex_lock(&pool->mutex);
+	if (pool->count) {
+		page = ion_page_pool_remove(pool);
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!page)
+		page = alloc_pages(pool->gfp_mask, pool->order);
+	return page;
+}
+
+/*
+ * The page goes back on the pool as is: pages are only ever handed out
+ * zeroed, so the caller has to clear anything it wrote to them.
+ */
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->mutex);
+	list_add(&page->lru, &pool->items);
+	pool->count++;
+	mutex_unlock(&pool->mutex);
+}
+
+/* Returns the number of order-0 pages left in the pool after shrinking */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	int freed = 0;
+	int count;
+
+	mutex_lock(&pool->mutex);
+	while (freed < nr_to_scan && pool->count) {
+		struct page *page = ion_page_pool_remove(pool);
+
+		__free_pages(page, pool->order);
+		freed += 1 << pool->order;
+	}
+	count = pool->count << pool->order;
+	mutex_unlock(&pool->mutex);
+
+	return count;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->items);
+	mutex_init(&pool->mutex);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
@@ -24,6 +24,7 @@
 #include <linux/ion.h>
 
 struct ion_mapping;
+struct seq_file;
 
 struct ion_dma_mapping {
 	struct kref ref;
@@ -81,6 +82,8 @@ struct ion_buffer {
  *			physically contiguous heaps)
  * @map_dma		map the memory for dma to a scatterlist
  * @unmap_dma		unmap the memory for dma
+ * @sync_for_device	hand the memory over to the device, called on every
+ *			map_dma (optional)
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
@@ -95,6 +98,8 @@ struct ion_heap_ops {
 	struct scatterlist *(*map_dma) (struct ion_heap *heap,
 					struct ion_buffer *buffer);
 	void (*unmap_dma) (struct ion_heap *heap, struct ion_buffer *buffer);
+	void (*sync_for_device) (struct ion_heap *heap,
+				 struct ion_buffer *buffer);
 	void * (*map_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
@@ -111,6 +116,8 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @debug_show:		called when the heap debug file is read, to add
+ *			heap specific debug info (optional)
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -124,6 +131,7 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	int (*debug_show)(struct ion_heap *heap, struct seq_file *, void *);
 };
 
 /**
@@ -175,6 +183,40 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap, unsigned long size,
 				      unsigned long align);
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of items in the pool
+ * @items:		list of pages, linked through page->lru
+ * @mutex:		lock protecting this struct and especially the count
+ *			item list
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @hits:		allocations served from the pool
+ * @misses:		allocations that fell through to the page allocator
+ *
+ * Allows you to keep a pool of pre allocated pages to use from your heap.
+ * High order pages are hard to get back once they have been split up, so
+ * holding on to them between allocations saves both the trip to the page
+ * allocator and the fragmentation.  Pages are kept zeroed while they sit
+ * in the pool.  The owning heap is expected to register a shrinker that
+ * calls ion_page_pool_shrink().
+ */
+struct ion_page_pool {
+	int count;
+	struct list_head items;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+
 /**
  * The carveout heap returns physical addresses, since 0 may be a valid
  * physical address, this is used to indicate allocation failed
@@ -14,108 +14,439 @@
  *
  */
 
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
+#include <linux/hrtimer.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * Buffers are built from the largest of these orders that still fits, so
+ * big buffers end up in few sg entries.  Higher orders are only tried
+ * opportunistically, without direct reclaim or warnings.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+static const gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_ZERO |
+					   __GFP_NOWARN | __GFP_NORETRY) &
+					  ~__GFP_WAIT;
+static const gfp_t low_order_gfp_flags  = GFP_HIGHUSER | __GFP_ZERO |
+					  __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct shrinker shrinker;
+
+	/* allocation latency, protected by stats_lock */
+	spinlock_t stats_lock;
+	unsigned long allocs;
+	unsigned long alloc_failures;
+	u64 alloc_ns_total;
+	u64 alloc_ns_max;
+};
+
+/*
+ * The scatterlist is built once at allocation time; map_dma hands out
+ * the same one for the life of the buffer.
+ */
+struct ion_system_buffer {
+	int nents;
+	struct scatterlist *sglist;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct page *alloc_largest_available(struct ion_system_heap *heap,
+					    unsigned long size,
+					    unsigned int max_order)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+		/* Remember the order until the page makes it to the sglist */
+		set_page_private(page, orders[i]);
+		return page;
+	}
+	return NULL;
+}
+
+static void free_buffer_page(struct ion_system_heap *heap, struct page *page,
+			     unsigned int order, bool zero)
+{
+	int i;
+
+	/* Nothing else may see what the previous owner left in the pages */
+	if (zero)
+		for (i = 0; i < (1 << order); i++)
+			clear_highpage(page + i);
+	ion_page_pool_free(heap->pools[order_to_index(order)], page);
+}
+
+static struct scatterlist *ion_system_sglist_alloc(int nents)
+{
+	size_t size = nents * sizeof(struct scatterlist);
+
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void ion_system_sglist_free(struct scatterlist *sglist)
+{
+	if (is_vmalloc_addr(sglist))
+		vfree(sglist);
+	else
+		kfree(sglist);
+}
+
+static void ion_system_heap_account(struct ion_system_heap *heap,
+				    ktime_t start, bool failed)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&heap->stats_lock);
+	if (failed) {
+		heap->alloc_failures++;
+	} else {
+		heap->allocs++;
+		heap->alloc_ns_total += ns;
+		if (ns > heap->alloc_ns_max)
+			heap->alloc_ns_max = ns;
+	}
+	spin_unlock(&heap->stats_lock);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
-	buffer->priv_virt = vmalloc_user(size);
-	if (!buffer->priv_virt)
-		return -ENOMEM;
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer *sysbuf;
+	struct scatterlist *sg;
+	struct list_head pages;
+	struct page *page, *tmp_page;
+	unsigned long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+	ktime_t start = ktime_get();
+	int nents = 0;
+
+	if (!size_remaining)
+		return -EINVAL;
+
+	INIT_LIST_HEAD(&pages);
+	while (size_remaining > 0) {
+		page = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!page)
+			goto err;
+		list_add_tail(&page->lru, &pages);
+		/* No point trying bigger orders again once one has failed */
+		max_order = page_private(page);
+		size_remaining -= PAGE_SIZE << max_order;
+		nents++;
+	}
+
+	sysbuf = kmalloc(sizeof(struct ion_system_buffer), GFP_KERNEL);
+	if (!sysbuf)
+		goto err;
+	sysbuf->sglist = ion_system_sglist_alloc(nents);
+	if (!sysbuf->sglist)
+		goto err_free_sysbuf;
+	sysbuf->nents = nents;
+
+	sg_init_table(sysbuf->sglist, nents);
+	sg = sysbuf->sglist;
+	list_for_each_entry_safe(page, tmp_page, &pages, lru) {
+		unsigned int order = page_private(page);
+
+		set_page_private(page, 0);
+		list_del(&page->lru);
+		sg_set_page(sg, page, PAGE_SIZE << order, 0);
+		sg_dma_address(sg) = sg_phys(sg);
+		sg = sg_next(sg);
+	}
+
+	buffer->priv_virt = sysbuf;
+	ion_system_heap_account(sys_heap, start, false);
 	return 0;
+
+err_free_sysbuf:
+	kfree(sysbuf);
+err:
+	/* These were never handed out, so they are still zeroed */
+	list_for_each_entry_safe(page, tmp_page, &pages, lru) {
+		unsigned int order = page_private(page);
+
+		set_page_private(page, 0);
+		list_del(&page->lru);
+		free_buffer_page(sys_heap, page, order, false);
+	}
+	ion_system_heap_account(sys_heap, start, true);
+	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	vfree(buffer->priv_virt);
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer *sysbuf = buffer->priv_virt;
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(sysbuf->sglist, sg, sysbuf->nents, i)
+		free_buffer_page(sys_heap, sg_page(sg), get_order(sg->length),
+				 true);
+	ion_system_sglist_free(sysbuf->sglist);
+	kfree(sysbuf);
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page *page;
-	int i;
-	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	void *vaddr = buffer->priv_virt;
+	struct ion_system_buffer *sysbuf = buffer->priv_virt;
 
-	sglist = vmalloc(npages * sizeof(struct scatterlist));
-	if (!sglist)
-		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, npages * sizeof(struct scatterlist));
-	sg_init_table(sglist, npages);
-	for (i = 0; i < npages; i++) {
-		page = vmalloc_to_page(vaddr);
-		if (!page)
-			goto end;
-		sg_set_page(&sglist[i], page, PAGE_SIZE, 0);
-		vaddr += PAGE_SIZE;
-	}
-	/* XXX do cache maintenance for dma? */
-	return sglist;
-end:
-	vfree(sglist);
-	return NULL;
+	return sysbuf->sglist;
 }
 
 void ion_system_heap_unmap_dma(struct ion_heap *heap,
 			       struct ion_buffer *buffer)
 {
-	/* XXX undo cache maintenance for dma? */
-	if (buffer->sglist)
-		vfree(buffer->sglist);
+	/*
+	 * Nothing to do: invalidating here would throw away anything the
+	 * cpu wrote through its cached mappings while the device had it.
+	 */
+}
+
+void ion_system_heap_sync_for_device(struct ion_heap *heap,
+				     struct ion_buffer *buffer)
+{
+	struct ion_system_buffer *sysbuf = buffer->priv_virt;
+
+	/*
+	 * The kernel and user mappings are cached: write back whatever the
+	 * cpu left in the caches, one pass over the (mostly high order)
+	 * chunks rather than page by page.
+	 */
+	dma_sync_sg_for_device(NULL, sysbuf->sglist, sysbuf->nents,
+			       DMA_BIDIRECTIONAL);
 }
 
 void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
-	return buffer->priv_virt;
+	struct ion_system_buffer *sysbuf = buffer->priv_virt;
+	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct page **pages, **tmp;
+	struct scatterlist *sg;
+	void *vaddr;
+	int i, j;
+
+	pages = vmalloc(sizeof(struct page *) * npages);
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+
+	tmp = pages;
+	for_each_sg(sysbuf->sglist, sg, sysbuf->nents, i) {
+		for (j = 0; j < sg->length / PAGE_SIZE; j++)
+			*(tmp++) = sg_page(sg) + j;
+	}
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	vfree(pages);
+
+	return vaddr ? vaddr : ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 				  struct ion_buffer *buffer)
 {
+	vunmap(buffer->vaddr);
 }
 
 int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma)
 {
-	return remap_vmalloc_range(vma, buffer->priv_virt, vma->vm_pgoff);
+	struct ion_system_buffer *sysbuf = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
+	struct scatterlist *sg;
+	int i;
+	int ret;
+
+	for_each_sg(sysbuf->sglist, sg, sysbuf->nents, i) {
+		struct page *page = sg_page(sg);
+		unsigned long remainder = vma->vm_end - addr;
+		unsigned long len = sg->length;
+
+		if (offset >= sg->length) {
+			offset -= sg->length;
+			continue;
+		} else if (offset) {
+			page += offset / PAGE_SIZE;
+			len = sg->length - offset;
+			offset = 0;
+		}
+		len = min(len, remainder);
+		ret = remap_pfn_range(vma, addr, page_to_pfn(page), len,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+		addr += len;
+		if (addr >= vma->vm_end)
+			return 0;
+	}
+	return 0;
 }
 
-static struct ion_heap_ops vmalloc_ops = {
+static struct ion_heap_ops system_heap_ops = {
 	.allocate = ion_system_heap_allocate,
 	.free = ion_system_heap_free,
 	.map_dma = ion_system_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
+	.sync_for_device = ion_system_heap_sync_for_device,
 	.map_kernel = ion_system_heap_map_kernel,
 	.unmap_kernel = ion_system_heap_unmap_kernel,
 	.map_user = ion_system_heap_map_user,
 };
 
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_total = 0;
+	int i;
+
+	/* Give back the high order pages last, they are the hard ones */
+	for (i = NUM_ORDERS - 1; i >= 0; i--) {
+		struct ion_page_pool *pool = sys_heap->pools[i];
+		int before = ion_page_pool_shrink(pool, 0);
+		int after = ion_page_pool_shrink(pool, nr_to_scan);
+
+		nr_to_scan = max(0, nr_to_scan - (before - after));
+		nr_total += after;
+	}
+	return nr_total;
+}
+
+static int ion_system_heap_debug_show(struct ion_heap *heap,
+				      struct seq_file *s, void *unused)
+{
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	unsigned long allocs, alloc_failures;
+	u64 ns_total, ns_max;
+	int i;
+
+	spin_lock(&sys_heap->stats_lock);
+	allocs = sys_heap->allocs;
+	alloc_failures = sys_heap->alloc_failures;
+	ns_total = sys_heap->alloc_ns_total;
+	ns_max = sys_heap->alloc_ns_max;
+	spin_unlock(&sys_heap->stats_lock);
+
+	if (allocs)
+		do_div(ns_total, allocs);
+	seq_printf(s, "\nallocations: %lu failed: %lu "
+		   "latency avg: %llu us max: %llu us\n",
+		   allocs, alloc_failures,
+		   div_u64(ns_total, NSEC_PER_USEC),
+		   div_u64(ns_max, NSEC_PER_USEC));
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool = sys_heap->pools[i];
+
+		mutex_lock(&pool->mutex);
+		seq_printf(s, "pool order %2u: %6d pages (%8lu bytes) "
+			   "hits %lu misses %lu\n",
+			   pool->order, pool->count,
+			   (PAGE_SIZE << pool->order) * pool->count,
+			   pool->hits, pool->misses);
+		mutex_unlock(&pool->mutex);
+	}
+	return 0;
+}
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *heap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	heap->heap.ops = &system_heap_ops;
+	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.debug_show = ion_system_heap_debug_show;
+	spin_lock_init(&heap->stats_lock);
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i] > 0)
+			gfp_flags = high_order_gfp_flags;
+		heap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!heap->pools[i])
+			goto err_create_pool;
+	}
+
+	heap->shrinker.shrink = ion_system_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+	return &heap->heap;
+
+err_create_pool:
+	while (--i >= 0)
+		ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	unregister_shrinker(&sys_heap->shrinker);
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -157,6 +488,24 @@ struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+void ion_system_contig_heap_unmap_dma(struct ion_heap *heap,
+				      struct ion_buffer *buffer)
+{
+	if (buffer->sglist)
+		vfree(buffer->sglist);
+}
+
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -173,9 +522,9 @@ static struct ion_heap_ops kmalloc_ops = {
 	.free = ion_system_contig_heap_free,
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
-	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.unmap_dma = ion_system_contig_heap_unmap_dma,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 };
 
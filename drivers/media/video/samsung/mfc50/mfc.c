@@ -532,6 +532,20 @@ static void mfc_firmware_request_complete_handler(const struct firmware *fw,
 	}
 }
 
+static ssize_t mfc_show_mem_stats(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	int len;
+
+	mutex_lock(&mfc_mutex);
+	len = mfc_print_mem_stats(buf, PAGE_SIZE);
+	mutex_unlock(&mfc_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR(mem_stats, S_IRUGO, mfc_show_mem_stats, NULL);
+
 static int mfc_probe(struct platform_device *pdev)
 {
 	struct s3c_platform_mfc *pdata;
@@ -657,6 +671,9 @@ static int mfc_probe(struct platform_device *pdev)
 		goto err_misc_reg;
 	}
 
+	if (device_create_file(&pdev->dev, &dev_attr_mem_stats))
+		mfc_warn("failed to create mem_stats attribute\n");
+
 	/*
 	 * MFC FW downloading
 	 */
@@ -676,6 +693,7 @@ static int mfc_probe(struct platform_device *pdev)
 	return 0;
 
 err_req_fw:
+	device_remove_file(&pdev->dev, &dev_attr_mem_stats);
 	misc_deregister(&mfc_miscdev);
 err_misc_reg:
 	clk_put(mfc_sclk);
@@ -710,6 +728,8 @@ static int mfc_remove(struct platform_device *pdev)
 
 	free_irq(IRQ_MFC, pdev);
 
+	device_remove_file(&pdev->dev, &dev_attr_mem_stats);
+
 	mutex_destroy(&mfc_mutex);
 
 	clk_put(mfc_sclk);
@@ -813,6 +833,10 @@ static int __init mfc_init(void)
 {
 	mfc_info("%s\n", banner);
 
+#ifdef CONFIG_VIDEO_MFC50_MEM_SELFTEST
+	mfc_mem_selftest();
+#endif
+
 	if (platform_driver_register(&mfc_driver) != 0) {
 		mfc_err(KERN_ERR "platform device registration failed..\n");
 		return -1;
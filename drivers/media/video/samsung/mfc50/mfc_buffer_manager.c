@@ -23,6 +23,7 @@
 #include <linux/fs.h>
 #include <linux/mm.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
 #include <linux/miscdevice.h>
 #include <linux/platform_device.h>
 #include <linux/wait.h>
@@ -41,12 +42,257 @@
 #include "mfc_logmsg.h"
 #include "mfc_memory.h"
 
+/*
+ * Free chunks of a port are kept in two rbtrees: by address, to find the
+ * neighbours to coalesce with on free, and by (size, address), to find
+ * the best fit on alloc. Neither operation walks the whole free list.
+ */
+struct mfc_mem_pool {
+	struct rb_root addr_root;
+	struct rb_root size_root;
+	unsigned int base;
+	unsigned int size;
+
+	/* statistics */
+	unsigned int free_bytes;
+	unsigned int free_chunks;
+	unsigned int peak_used;
+	unsigned int alloc_fails;
+};
+
 static struct list_head mfc_alloc_mem_head[MFC_MAX_PORT_NUM];
-static struct list_head mfc_free_mem_head[MFC_MAX_PORT_NUM];
+static struct mfc_mem_pool mfc_mem_pool[MFC_MAX_PORT_NUM];
+
+static void mfc_pool_link(struct mfc_mem_pool *pool, struct mfc_free_mem *chunk)
+{
+	struct rb_node **p = &pool->addr_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct mfc_free_mem *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct mfc_free_mem, addr_node);
+		if (chunk->start_addr < entry->start_addr)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&chunk->addr_node, parent, p);
+	rb_insert_color(&chunk->addr_node, &pool->addr_root);
+
+	pool->free_bytes += chunk->size;
+	pool->free_chunks++;
+}
+
+static void mfc_pool_unlink(struct mfc_mem_pool *pool, struct mfc_free_mem *chunk)
+{
+	rb_erase(&chunk->addr_node, &pool->addr_root);
+	pool->free_bytes -= chunk->size;
+	pool->free_chunks--;
+}
+
+static void mfc_pool_size_insert(struct mfc_mem_pool *pool, struct mfc_free_mem *chunk)
+{
+	struct rb_node **p = &pool->size_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct mfc_free_mem *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct mfc_free_mem, size_node);
+		if (chunk->size < entry->size ||
+		    (chunk->size == entry->size &&
+		     chunk->start_addr < entry->start_addr))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&chunk->size_node, parent, p);
+	rb_insert_color(&chunk->size_node, &pool->size_root);
+}
+
+static void mfc_pool_size_erase(struct mfc_mem_pool *pool, struct mfc_free_mem *chunk)
+{
+	rb_erase(&chunk->size_node, &pool->size_root);
+}
+
+static int mfc_pool_init(struct mfc_mem_pool *pool, unsigned int base, unsigned int size)
+{
+	struct mfc_free_mem *chunk;
+
+	memset(pool, 0x00, sizeof(struct mfc_mem_pool));
+	pool->addr_root = RB_ROOT;
+	pool->size_root = RB_ROOT;
+	pool->base = base;
+	pool->size = size;
+
+	if (!size)
+		return 0;
+
+	chunk = kzalloc(sizeof(struct mfc_free_mem), GFP_KERNEL);
+	if (!chunk)
+		return -ENOMEM;
+	chunk->start_addr = base;
+	chunk->size = size;
+	mfc_pool_link(pool, chunk);
+	mfc_pool_size_insert(pool, chunk);
+
+	return 0;
+}
+
+static void mfc_pool_destroy(struct mfc_mem_pool *pool)
+{
+	struct rb_node *node;
+	struct mfc_free_mem *chunk;
+
+	while ((node = rb_first(&pool->addr_root)) != NULL) {
+		chunk = rb_entry(node, struct mfc_free_mem, addr_node);
+		mfc_pool_unlink(pool, chunk);
+		mfc_pool_size_erase(pool, chunk);
+		kfree(chunk);
+	}
+}
+
+/* Smallest free chunk of at least alloc_size bytes, lowest address first */
+static struct mfc_free_mem *mfc_pool_best_fit(struct mfc_mem_pool *pool,
+		unsigned int alloc_size)
+{
+	struct rb_node *node = pool->size_root.rb_node;
+	struct mfc_free_mem *entry, *match = NULL;
+
+	while (node) {
+		entry = rb_entry(node, struct mfc_free_mem, size_node);
+		if (entry->size >= alloc_size) {
+			match = entry;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return match;
+}
+
+static unsigned int mfc_pool_alloc(struct mfc_mem_pool *pool, unsigned int alloc_size)
+{
+	struct mfc_free_mem *match_node;
+	unsigned int alloc_addr;
+
+	if (!alloc_size)
+		return 0;
+
+	match_node = mfc_pool_best_fit(pool, alloc_size);
+	if (match_node == NULL) {
+		pool->alloc_fails++;
+		return 0;
+	}
+
+	mfc_debug("match : startAddr(0x%08x) size(%d)\n", match_node->start_addr, match_node->size);
+
+	alloc_addr = match_node->start_addr;
+	mfc_pool_size_erase(pool, match_node);
+
+	if (match_node->size == alloc_size) {
+		mfc_pool_unlink(pool, match_node);
+		kfree(match_node);
+	} else {
+		/* Carve from the front; the address order doesn't change. */
+		match_node->start_addr += alloc_size;
+		match_node->size -= alloc_size;
+		pool->free_bytes -= alloc_size;
+		mfc_pool_size_insert(pool, match_node);
+	}
+
+	if (pool->size - pool->free_bytes > pool->peak_used)
+		pool->peak_used = pool->size - pool->free_bytes;
+
+	return alloc_addr;
+}
+
+/*
+ * Give [addr, addr + size) back and coalesce it with its free neighbours,
+ * so the pool never holds two adjacent free chunks.
+ */
+static int mfc_pool_free(struct mfc_mem_pool *pool, unsigned int addr, unsigned int size)
+{
+	struct rb_node *node = pool->addr_root.rb_node;
+	struct mfc_free_mem *entry, *prev = NULL, *next = NULL;
+
+	if (!size)
+		return 0;
+
+	if (addr < pool->base || addr + size > pool->base + pool->size ||
+	    addr + size < addr) {
+		mfc_err("free out of range: 0x%08x size(%d)\n", addr, size);
+		return -EINVAL;
+	}
+
+	while (node) {
+		entry = rb_entry(node, struct mfc_free_mem, addr_node);
+		if (addr < entry->start_addr) {
+			next = entry;
+			node = node->rb_left;
+		} else {
+			prev = entry;
+			node = node->rb_right;
+		}
+	}
+
+	if ((prev && prev->start_addr + prev->size > addr) ||
+	    (next && addr + size > next->start_addr)) {
+		mfc_err("double free: 0x%08x size(%d)\n", addr, size);
+		return -EINVAL;
+	}
+
+	if (prev && prev->start_addr + prev->size == addr) {
+		mfc_pool_size_erase(pool, prev);
+		prev->size += size;
+		pool->free_bytes += size;
+
+		if (next && addr + size == next->start_addr) {
+			mfc_pool_size_erase(pool, next);
+			mfc_pool_unlink(pool, next);
+			prev->size += next->size;
+			pool->free_bytes += next->size;
+			kfree(next);
+		}
+		mfc_pool_size_insert(pool, prev);
+	} else if (next && addr + size == next->start_addr) {
+		/* Growing downwards keeps next's place in the address order */
+		mfc_pool_size_erase(pool, next);
+		next->start_addr = addr;
+		next->size += size;
+		pool->free_bytes += size;
+		mfc_pool_size_insert(pool, next);
+	} else {
+		entry = kzalloc(sizeof(struct mfc_free_mem), GFP_KERNEL);
+		if (!entry) {
+			mfc_err("There is no more kernel memory, leaking 0x%08x size(%d)\n",
+					addr, size);
+			return -ENOMEM;
+		}
+		entry->start_addr = addr;
+		entry->size = size;
+		mfc_pool_link(pool, entry);
+		mfc_pool_size_insert(pool, entry);
+	}
+
+	return 0;
+}
+
+static unsigned int mfc_pool_largest_free(struct mfc_mem_pool *pool)
+{
+	struct rb_node *node = rb_last(&pool->size_root);
+
+	if (!node)
+		return 0;
+	return rb_entry(node, struct mfc_free_mem, size_node)->size;
+}
 
 void mfc_print_mem_list(void)
 {
 	struct list_head *pos;
+	struct rb_node *node;
 	struct mfc_alloc_mem *alloc_node;
 	struct mfc_free_mem *free_node;
 	int port_no;
@@ -64,111 +310,93 @@ void mfc_print_mem_list(void)
 					alloc_node->size);
 		}
 
-		list_for_each(pos, &mfc_free_mem_head[port_no])
-		{
-			free_node = list_entry(pos, struct mfc_free_mem, list);
+		for (node = rb_first(&mfc_mem_pool[port_no].addr_root); node;
+				node = rb_next(node)) {
+			free_node = rb_entry(node, struct mfc_free_mem, addr_node);
 			mfc_info("[free_list] start_addr: 0x%08x size:%d\n",
 					free_node->start_addr , free_node->size);
 		}
 	}
 }
 
-void mfc_merge_fragment(int inst_no)
+/*
+ * Per port usage and fragmentation report, for the mem_stats attribute.
+ * frag is the share of the free memory that is not in the largest chunk,
+ * i.e. 0% means that all of it can still be handed out in one piece.
+ */
+int mfc_print_mem_stats(char *buf, int len)
 {
-	struct list_head *pos, *n;
-	struct mfc_free_mem *node1, *node2;
-	int port_no;
+	struct mfc_mem_pool *pool;
+	unsigned int largest;
+	int port_no, n = 0;
 
 	for (port_no = 0; port_no < MFC_MAX_PORT_NUM; port_no++) {
-		list_for_each_safe(pos, n, &mfc_free_mem_head[port_no])
-		{
-			node1 = list_entry(pos, struct mfc_free_mem, list);
-			node2 = list_entry(n, struct mfc_free_mem, list);
-			if ((node1->start_addr + node1->size) == node2->start_addr) {
-				node2->start_addr = node1->start_addr;
-				node2->size += node1->size;
-				list_del(&(node1->list));
-				kfree(node1);
-			}
-		}
+		pool = &mfc_mem_pool[port_no];
+		largest = mfc_pool_largest_free(pool);
+
+		n += scnprintf(buf + n, len - n,
+			"port%d: size %u used %u peak %u free %u "
+			"chunks %u largest %u frag %u%% fails %u\n",
+			port_no, pool->size, pool->size - pool->free_bytes,
+			pool->peak_used, pool->free_bytes, pool->free_chunks,
+			largest,
+			pool->free_bytes ?
+				(unsigned int)div_u64((u64)(pool->free_bytes - largest) * 100,
+						      pool->free_bytes) : 0,
+			pool->alloc_fails);
 	}
 
+	return n;
+}
+
+void mfc_merge_fragment(int inst_no)
+{
+	/* Free chunks are coalesced as they are freed, see mfc_pool_free() */
 #if defined(DEBUG)
 	mfc_print_mem_list();
 #endif
 }
 
-
-
 static unsigned int mfc_get_free_mem(int alloc_size, int inst_no, int port_no)
 {
-	struct list_head *pos;
-	struct mfc_free_mem *free_node, *match_node = NULL;
-	unsigned int alloc_addr = 0;
+	unsigned int alloc_addr;
 
 	mfc_debug("request Size : %d\n", alloc_size);
 
-	if (list_empty(&mfc_free_mem_head[port_no])) {
-		mfc_err("all memory is gone\n");
-		return alloc_addr;
-	}
-	/* find best chunk of memory */
-	list_for_each(pos, &mfc_free_mem_head[port_no])
-	{
-		free_node = list_entry(pos, struct mfc_free_mem, list);
-
-		if (match_node != NULL) {
-			if ((free_node->size >= alloc_size) &&
-				(free_node->size < match_node->size))
-				match_node = free_node;
-		} else {
-			if (free_node->size >= alloc_size)
-				match_node = free_node;
-		}
-	}
-
-
-	if (match_node != NULL) {
-		mfc_debug("match : startAddr(0x%08x) size(%d)\n", match_node->start_addr, match_node->size);
-
-		alloc_addr = match_node->start_addr;
-		match_node->start_addr += alloc_size;
-		match_node->size -= alloc_size;
-
-		if (match_node->size < 0x1)	/* delete match_node. */
-			mfc_err("there is no suitable chunk...[case 0]\n");
-	} else {
-		mfc_err("there is no suitable chunk....[case 1]\n");
+	if (alloc_size <= 0) {
+		mfc_err("invalid request size(%d)\n", alloc_size);
 		return 0;
 	}
 
+	alloc_addr = mfc_pool_alloc(&mfc_mem_pool[port_no], alloc_size);
+	if (!alloc_addr)
+		mfc_err("there is no suitable chunk (port%d, size %d)\n",
+				port_no, alloc_size);
+
 	return alloc_addr;
 }
 
 
 int mfc_init_buffer(void)
 {
-	struct mfc_free_mem *free_node;
-	int	port_no;
+	unsigned int base, size;
+	int port_no, ret;
 
 	for (port_no = 0; port_no < MFC_MAX_PORT_NUM; port_no++) {
 		INIT_LIST_HEAD(&mfc_alloc_mem_head[port_no]);
-		INIT_LIST_HEAD(&mfc_free_mem_head[port_no]);
-		/* init free head node */
-		free_node =
-			(struct mfc_free_mem *)kmalloc(sizeof(struct mfc_free_mem), GFP_KERNEL);
-		memset(free_node, 0x00, sizeof(struct mfc_free_mem));
 
 		if (port_no) {
-			free_node->start_addr = mfc_get_port1_buff_paddr();
-			free_node->size = mfc_port1_memsize;
+			base = mfc_get_port1_buff_paddr();
+			size = mfc_port1_memsize;
 		} else {
-			free_node->start_addr = mfc_get_port0_buff_paddr();
-			free_node->size = mfc_port0_memsize -
+			base = mfc_get_port0_buff_paddr();
+			size = mfc_port0_memsize -
 				(mfc_get_port0_buff_paddr() - mfc_get_fw_buff_paddr());
 		}
 
-		list_add_tail(&(free_node->list), &mfc_free_mem_head[port_no]);
+		ret = mfc_pool_init(&mfc_mem_pool[port_no], base, size);
+		if (ret)
+			return ret;
 	}
 
 #if defined(DEBUG)
@@ -228,25 +456,8 @@ void mfc_release_all_buffer(int inst_no)
 
 void mfc_free_alloc_mem(struct mfc_alloc_mem *alloc_node, int port_no)
 {
-	struct list_head *pos;
-	struct mfc_free_mem *free_node;
-	struct mfc_free_mem *target_node;
-
-	free_node = (struct mfc_free_mem *)kmalloc(sizeof(struct mfc_free_mem), GFP_KERNEL);
-	free_node->start_addr = alloc_node->p_addr;
-	free_node->size = alloc_node->size;
-
-	list_for_each(pos, &mfc_free_mem_head[port_no])
-	{
-		target_node = list_entry(pos, struct mfc_free_mem, list);
-		if (alloc_node->p_addr < target_node->start_addr)
-			break;
-	}
-
-	if (pos == &mfc_free_mem_head[port_no])
-		list_add_tail(&(free_node->list), &(mfc_free_mem_head[port_no]));
-	else
-		list_add_tail(&(free_node->list), pos);
+	mfc_pool_free(&mfc_mem_pool[port_no], alloc_node->p_addr,
+			alloc_node->size);
 
 	list_del(&(alloc_node->list));
 	kfree(alloc_node);
@@ -348,3 +559,189 @@ enum mfc_error_code mfc_allocate_buffer(struct mfc_inst_ctx *mfc_ctx, union mfc_
 out_getcodecviraddr:
 	return ret;
 }
+
+#ifdef CONFIG_VIDEO_MFC50_MEM_SELFTEST
+/*
+ * Replays alloc/free traces against a scratch pool (no memory behind it is
+ * touched) and checks the free trees after every step.
+ */
+#define MFC_ST_BASE	0x40000000
+#define MFC_ST_SIZE	(32 << 20)
+#define MFC_ST_SLOTS	24
+#define MFC_ST_RANDOM_OPS	4000
+
+struct mfc_mem_trace {
+	unsigned char slot;
+	unsigned int size;	/* 0 frees the slot */
+};
+
+/*
+ * Two decoders opened back to back, the first one closed, and a third one
+ * opened in the holes: stream, context and frame buffers of each instance.
+ */
+static const struct mfc_mem_trace mfc_mem_trace_streams[] __initconst = {
+	{ 0, 0x300000 }, { 1, 0x096000 }, { 2, 0x17a000 }, { 3, 0x17a000 },
+	{ 4, 0x17a000 }, { 5, 0x17a000 }, { 6, 0x0bd000 }, { 7, 0x0bd000 },
+	{ 8, 0x300000 }, { 9, 0x096000 }, { 10, 0x0fe000 }, { 11, 0x0fe000 },
+	{ 12, 0x0fe000 }, { 13, 0x0fe000 }, { 14, 0x07f000 }, { 15, 0x07f000 },
+	{ 1, 0 }, { 3, 0 }, { 5, 0 }, { 7, 0 }, { 0, 0 }, { 2, 0 }, { 4, 0 },
+	{ 6, 0 },
+	{ 16, 0x300000 }, { 17, 0x096000 }, { 18, 0x2fd000 }, { 19, 0x2fd000 },
+	{ 20, 0x17e000 }, { 21, 0x17e000 },
+	{ 8, 0 }, { 9, 0 }, { 10, 0 }, { 11, 0 }, { 12, 0 }, { 13, 0 },
+	{ 14, 0 }, { 15, 0 },
+	{ 16, 0 }, { 17, 0 }, { 18, 0 }, { 19, 0 }, { 20, 0 }, { 21, 0 },
+};
+
+static int __init mfc_pool_check(struct mfc_mem_pool *pool,
+		const unsigned int *addr, const unsigned int *size)
+{
+	struct rb_node *node;
+	struct mfc_free_mem *chunk, *last = NULL;
+	unsigned int bytes = 0, used = 0;
+	unsigned int chunks = 0, size_chunks = 0;
+	int i, j;
+
+	for (node = rb_first(&pool->addr_root); node; node = rb_next(node)) {
+		chunk = rb_entry(node, struct mfc_free_mem, addr_node);
+		if (!chunk->size || chunk->start_addr < pool->base ||
+		    chunk->start_addr + chunk->size > pool->base + pool->size)
+			return -EINVAL;
+		/* overlapping, or adjacent chunks that weren't coalesced */
+		if (last && last->start_addr + last->size >= chunk->start_addr)
+			return -EINVAL;
+		for (i = 0; i < MFC_ST_SLOTS; i++)
+			if (size[i] && addr[i] < chunk->start_addr + chunk->size &&
+			    chunk->start_addr < addr[i] + size[i])
+				return -EINVAL;
+		bytes += chunk->size;
+		chunks++;
+		last = chunk;
+	}
+
+	for (node = rb_first(&pool->size_root); node; node = rb_next(node))
+		size_chunks++;
+
+	for (i = 0; i < MFC_ST_SLOTS; i++) {
+		if (!size[i])
+			continue;
+		used += size[i];
+		for (j = i + 1; j < MFC_ST_SLOTS; j++)
+			if (size[j] && addr[i] < addr[j] + size[j] &&
+			    addr[j] < addr[i] + size[i])
+				return -EINVAL;
+	}
+
+	if (chunks != pool->free_chunks || size_chunks != chunks ||
+	    bytes != pool->free_bytes || bytes + used != pool->size)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* What a best-fit allocator has to return, found the slow way */
+static unsigned int __init mfc_pool_expected_fit(struct mfc_mem_pool *pool,
+		unsigned int alloc_size)
+{
+	struct rb_node *node;
+	struct mfc_free_mem *chunk, *match = NULL;
+
+	for (node = rb_first(&pool->addr_root); node; node = rb_next(node)) {
+		chunk = rb_entry(node, struct mfc_free_mem, addr_node);
+		if (chunk->size >= alloc_size &&
+		    (!match || chunk->size < match->size))
+			match = chunk;
+	}
+
+	return match ? match->start_addr : 0;
+}
+
+static int __init mfc_pool_replay(struct mfc_mem_pool *pool, int slot,
+		unsigned int alloc_size, unsigned int *addr, unsigned int *size)
+{
+	unsigned int expected;
+
+	if (size[slot]) {
+		if (mfc_pool_free(pool, addr[slot], size[slot]))
+			return -EINVAL;
+		size[slot] = 0;
+	} else {
+		expected = mfc_pool_expected_fit(pool, alloc_size);
+		addr[slot] = mfc_pool_alloc(pool, alloc_size);
+		if (addr[slot] != expected)
+			return -EINVAL;
+		if (addr[slot])
+			size[slot] = alloc_size;
+	}
+
+	return mfc_pool_check(pool, addr, size);
+}
+
+int __init mfc_mem_selftest(void)
+{
+	struct mfc_mem_pool pool;
+	unsigned int addr[MFC_ST_SLOTS], size[MFC_ST_SLOTS];
+	unsigned int seed = 1;
+	int i, slot, ret;
+
+	ret = mfc_pool_init(&pool, MFC_ST_BASE, MFC_ST_SIZE);
+	if (ret)
+		return ret;
+	memset(size, 0x00, sizeof(size));
+
+	for (i = 0; i < ARRAY_SIZE(mfc_mem_trace_streams); i++) {
+		slot = mfc_mem_trace_streams[i].slot;
+		ret = mfc_pool_replay(&pool, slot,
+				mfc_mem_trace_streams[i].size, addr, size);
+		/* The trace fits, every allocation in it has to succeed */
+		if (!ret && mfc_mem_trace_streams[i].size && !size[slot])
+			ret = -ENOMEM;
+		if (ret) {
+			mfc_err("mem selftest: stream trace failed at step %d\n", i);
+			goto out;
+		}
+	}
+
+	/* Everything was freed, so it all must have coalesced again */
+	if (pool.free_chunks != 1 || pool.free_bytes != MFC_ST_SIZE) {
+		mfc_err("mem selftest: %u chunks left after stream trace\n",
+				pool.free_chunks);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Random churn of 4KB..4MB buffers, enough to run out now and then */
+	for (i = 0; i < MFC_ST_RANDOM_OPS; i++) {
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 16) % MFC_ST_SLOTS;
+		seed = seed * 1103515245 + 12345;
+		ret = mfc_pool_replay(&pool, slot,
+				(((seed >> 16) % 1024) + 1) << PAGE_SHIFT, addr, size);
+		if (ret) {
+			mfc_err("mem selftest: random trace failed at step %d\n", i);
+			goto out;
+		}
+	}
+
+	for (slot = 0; slot < MFC_ST_SLOTS; slot++) {
+		if (size[slot] && mfc_pool_replay(&pool, slot, 0, addr, size)) {
+			mfc_err("mem selftest: final free of slot %d failed\n", slot);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (pool.free_chunks != 1 || pool.free_bytes != MFC_ST_SIZE) {
+		mfc_err("mem selftest: %u chunks left after random trace\n",
+				pool.free_chunks);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mfc_info("mem selftest passed, peak %u of %u bytes, %u failed allocs\n",
+			pool.peak_used, pool.size, pool.alloc_fails);
+out:
+	mfc_pool_destroy(&pool);
+	return ret;
+}
+#endif
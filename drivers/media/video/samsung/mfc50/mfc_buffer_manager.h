@@ -20,6 +20,7 @@
 #define _MFC_BUFFER_MANAGER_H_
 
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include "mfc_interface.h"
 #include "mfc_opr.h"
 
@@ -37,7 +38,8 @@ struct mfc_alloc_mem  {
 
 
 struct mfc_free_mem  {
-	struct list_head list;     /* struct list_head for free mem         */
+	struct rb_node addr_node;  /* in port free tree, by start address   */
+	struct rb_node size_node;  /* in port free tree, by size, address   */
 	unsigned int start_addr;   /* start address of free mem             */
 	unsigned int size;         /* size of free mem                      */
 };
@@ -45,6 +47,8 @@ struct mfc_free_mem  {
 
 /* Function Prototype */
 void mfc_print_mem_list(void);
+int mfc_print_mem_stats(char *buf, int len);
+int mfc_mem_selftest(void);
 int mfc_init_buffer(void);
 void mfc_merge_fragment(int inst_no);
 void mfc_release_all_buffer(int inst_no);
@@ -167,7 +167,32 @@ struct s3c_onenand {
 	struct resource *dma_res;
 	unsigned long	phys_base;
 	struct completion	complete;
+	int		dma_irq;
+	int		dma_status;
 	struct mtd_partition *parts;
+
+	/*
+	 * S5PC110 read-while-load: a DataRAM to memory transfer left
+	 * running while the next page is loaded into the other DataRAM.
+	 */
+	struct {
+		int		busy;
+		dma_addr_t	dst;
+		int		page_dma;
+		unsigned char	*buf;
+		void __iomem	*src;
+		size_t		count;
+	} xfer;
+	int		load_pending;
+	int		(*command)(struct mtd_info *mtd, int cmd, loff_t addr,
+				   size_t len);
+	int		(*wait)(struct mtd_info *mtd, int state);
+
+	/* Pages read out of the DataRAM, by method */
+	unsigned long	dma_async;
+	unsigned long	dma_sync;
+	unsigned long	dma_errors;
+	unsigned long	cpu_copies;
 };
 
 #define CMD_MAP_00(dev, addr)		(dev->cmd_map(MAP_00, ((addr) << 1)))
@@ -610,13 +635,23 @@ static int onenand_write_bufferram(struct mtd_info *mtd, int area,
 	return 0;
 }
 
-static int (*s5pc110_dma_ops)(void *dst, void *src, size_t count, int direction);
+static int (*s5pc110_dma_wait)(void);
 
-static int s5pc110_dma_poll(void *dst, void *src, size_t count, int direction)
+static void s5pc110_dma_start(void *dst, void *src, size_t count,
+			      int direction)
 {
 	void __iomem *base = onenand->dma_addr;
 	int status;
-	unsigned long timeout;
+
+	if (onenand->dma_irq) {
+		status = readl(base + S5PC110_INTC_DMA_MASK);
+		if (status) {
+			status &= ~(S5PC110_INTC_DMA_TD | S5PC110_INTC_DMA_TE);
+			writel(status, base + S5PC110_INTC_DMA_MASK);
+		}
+		INIT_COMPLETION(onenand->complete);
+		onenand->dma_status = 0;
+	}
 
 	writel(src, base + S5PC110_DMA_SRC_ADDR);
 	writel(dst, base + S5PC110_DMA_DST_ADDR);
@@ -633,6 +668,13 @@ static int s5pc110_dma_poll(void *dst, void *src, size_t count, int direction)
 	writel(direction, base + S5PC110_DMA_TRANS_DIR);
 
 	writel(S5PC110_DMA_TRANS_CMD_TR, base + S5PC110_DMA_TRANS_CMD);
+}
+
+static int s5pc110_dma_poll(void)
+{
+	void __iomem *base = onenand->dma_addr;
+	int status;
+	unsigned long timeout;
 
 	/*
 	 * There's no exact timeout values at Spec.
@@ -651,6 +693,9 @@ static int s5pc110_dma_poll(void *dst, void *src, size_t count, int direction)
 	} while (!(status & S5PC110_DMA_TRANS_STATUS_TD) &&
 		time_before(jiffies, timeout));
 
+	if (!(status & S5PC110_DMA_TRANS_STATUS_TD))
+		return -ETIMEDOUT;
+
 	writel(S5PC110_DMA_TRANS_CMD_TDC, base + S5PC110_DMA_TRANS_CMD);
 
 	return 0;
@@ -666,8 +711,10 @@ static irqreturn_t s5pc110_onenand_irq(int irq, void *data)
 	if (likely(status & S5PC110_INTC_DMA_TD))
 		cmd = S5PC110_DMA_TRANS_CMD_TDC;
 
-	if (unlikely(status & S5PC110_INTC_DMA_TE))
+	if (unlikely(status & S5PC110_INTC_DMA_TE)) {
 		cmd = S5PC110_DMA_TRANS_CMD_TEC;
+		onenand->dma_status = -EIO;
+	}
 
 	writel(cmd, base + S5PC110_DMA_TRANS_CMD);
 	writel(status, base + S5PC110_INTC_DMA_CLR);
@@ -678,36 +725,42 @@ static irqreturn_t s5pc110_onenand_irq(int irq, void *data)
 	return IRQ_HANDLED;
 }
 
-static int s5pc110_dma_irq(void *dst, void *src, size_t count, int direction)
+static int s5pc110_dma_irq(void)
 {
-	void __iomem *base = onenand->dma_addr;
-	int status;
-
-	status = readl(base + S5PC110_INTC_DMA_MASK);
-	if (status) {
-		status &= ~(S5PC110_INTC_DMA_TD | S5PC110_INTC_DMA_TE);
-		writel(status, base + S5PC110_INTC_DMA_MASK);
-	}
+	if (!wait_for_completion_timeout(&onenand->complete,
+					 msecs_to_jiffies(20)))
+		return -ETIMEDOUT;
 
-	writel(src, base + S5PC110_DMA_SRC_ADDR);
-	writel(dst, base + S5PC110_DMA_DST_ADDR);
+	return onenand->dma_status;
+}
 
-	if (direction == S5PC110_DMA_DIR_READ) {
-		writel(S5PC110_DMA_SRC_CFG_READ, base + S5PC110_DMA_SRC_CFG);
-		writel(S5PC110_DMA_DST_CFG_READ, base + S5PC110_DMA_DST_CFG);
-	} else {
-		writel(S5PC110_DMA_SRC_CFG_WRITE, base + S5PC110_DMA_SRC_CFG);
-		writel(S5PC110_DMA_DST_CFG_WRITE, base + S5PC110_DMA_DST_CFG);
-	}
+/*
+ * Finish the transfer left running by s5pc110_read_bufferram(). If the
+ * DMA failed the page is still in its DataRAM, so copy it by hand.
+ */
+static void s5pc110_dma_sync(void)
+{
+	struct device *dev = &onenand->pdev->dev;
+	int err;
 
-	writel(count, base + S5PC110_DMA_TRANS_SIZE);
-	writel(direction, base + S5PC110_DMA_TRANS_DIR);
+	if (!onenand->xfer.busy)
+		return;
+	onenand->xfer.busy = 0;
 
-	writel(S5PC110_DMA_TRANS_CMD_TR, base + S5PC110_DMA_TRANS_CMD);
+	err = s5pc110_dma_wait();
 
-	wait_for_completion_timeout(&onenand->complete, msecs_to_jiffies(20));
+	if (onenand->xfer.page_dma)
+		dma_unmap_page(dev, onenand->xfer.dst, onenand->xfer.count,
+			       DMA_FROM_DEVICE);
+	else
+		dma_unmap_single(dev, onenand->xfer.dst, onenand->xfer.count,
+				 DMA_FROM_DEVICE);
 
-	return 0;
+	if (unlikely(err)) {
+		onenand->dma_errors++;
+		memcpy(onenand->xfer.buf, onenand->xfer.src,
+		       onenand->xfer.count);
+	}
 }
 
 static int s5pc110_read_bufferram(struct mtd_info *mtd, int area,
@@ -717,7 +770,7 @@ static int s5pc110_read_bufferram(struct mtd_info *mtd, int area,
 	void __iomem *p;
 	void *buf = (void *) buffer;
 	dma_addr_t dma_src, dma_dst;
-	int err, ofs, page_dma = 0;
+	int ofs, page_dma = 0;
 	struct device *dev = &onenand->pdev->dev;
 
 	p = this->base + area;
@@ -732,6 +785,9 @@ static int s5pc110_read_bufferram(struct mtd_info *mtd, int area,
 		!onenand->dma_addr || count != mtd->writesize)
 		goto normal;
 
+	/* There is a single DMA channel */
+	s5pc110_dma_sync();
+
 	/* Handle vmalloc address */
 	if (buf >= high_memory) {
 		struct page *page;
@@ -759,18 +815,34 @@ static int s5pc110_read_bufferram(struct mtd_info *mtd, int area,
 		dev_err(dev, "Couldn't map a %d byte buffer for DMA\n", count);
 		goto normal;
 	}
-	err = s5pc110_dma_ops((void *) dma_dst, (void *) dma_src,
+	s5pc110_dma_start((void *) dma_dst, (void *) dma_src,
 			count, S5PC110_DMA_DIR_READ);
 
-	if (page_dma)
-		dma_unmap_page(dev, dma_dst, count, DMA_FROM_DEVICE);
-	else
-		dma_unmap_single(dev, dma_dst, count, DMA_FROM_DEVICE);
+	onenand->xfer.busy = 1;
+	onenand->xfer.dst = dma_dst;
+	onenand->xfer.page_dma = page_dma;
+	onenand->xfer.buf = buffer;
+	onenand->xfer.src = p;
+	onenand->xfer.count = count;
 
-	if (!err)
+	/*
+	 * The core has already started loading the next page into the
+	 * other DataRAM: leave this transfer running, it is finished by
+	 * s5pc110_wait() together with that load.
+	 */
+	if (onenand->load_pending) {
+		onenand->dma_async++;
 		return 0;
+	}
+
+	onenand->dma_sync++;
+	s5pc110_dma_sync();
+	return 0;
 
 normal:
+	if (area == ONENAND_DATARAM)
+		onenand->cpu_copies++;
+
 	if (count != mtd->writesize) {
 		/* Copy the bufferram to memory to prevent unaligned access */
 		memcpy(this->page_buf, p, mtd->writesize);
@@ -782,6 +854,37 @@ normal:
 	return 0;
 }
 
+static int s5pc110_command(struct mtd_info *mtd, int cmd, loff_t addr,
+			   size_t len)
+{
+	/* Don't reload a DataRAM that is still being read out */
+	s5pc110_dma_sync();
+
+	onenand->load_pending = (cmd == ONENAND_CMD_READ);
+	return onenand->command(mtd, cmd, addr, len);
+}
+
+static int s5pc110_wait(struct mtd_info *mtd, int state)
+{
+	int ret;
+
+	ret = onenand->wait(mtd, state);
+	onenand->load_pending = 0;
+	s5pc110_dma_sync();
+
+	return ret;
+}
+
+static ssize_t s5pc110_dma_stats_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "async %lu\nsync %lu\nerrors %lu\ncpu %lu\n",
+		       onenand->dma_async, onenand->dma_sync,
+		       onenand->dma_errors, onenand->cpu_copies);
+}
+
+static DEVICE_ATTR(dma_stats, S_IRUGO, s5pc110_dma_stats_show, NULL);
+
 static int s5pc110_chip_probe(struct mtd_info *mtd)
 {
 	/* Now just return 0 */
@@ -1069,18 +1172,19 @@ static int s3c_onenand_probe(struct platform_device *pdev)
 
 		onenand->phys_base = onenand->base_res->start;
 
-		s5pc110_dma_ops = s5pc110_dma_poll;
+		s5pc110_dma_wait = s5pc110_dma_poll;
 		/* Interrupt support */
 		r = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
 		if (r) {
 			init_completion(&onenand->complete);
-			s5pc110_dma_ops = s5pc110_dma_irq;
+			s5pc110_dma_wait = s5pc110_dma_irq;
 			err = request_irq(r->start, s5pc110_onenand_irq,
 					IRQF_SHARED, "onenand", &onenand);
 			if (err) {
 				dev_err(&pdev->dev, "failed to get irq\n");
 				goto scan_failed;
 			}
+			onenand->dma_irq = r->start;
 		}
 	}
 
@@ -1093,6 +1197,16 @@ static int s3c_onenand_probe(struct platform_device *pdev)
 		/* S3C doesn't handle subpage write */
 		mtd->subpage_sft = 0;
 		this->subpagesize = mtd->writesize;
+	} else if (onenand->dma_irq) {
+		/*
+		 * Let the DataRAM DMA of one page overlap the array load of
+		 * the next; the core's read-while-load loop issues that load
+		 * before it reads the current DataRAM.
+		 */
+		onenand->command = this->command;
+		onenand->wait = this->wait;
+		this->command = s5pc110_command;
+		this->wait = s5pc110_wait;
 	}
 
 	if (s3c_read_reg(MEM_CFG_OFFSET) & ONENAND_SYS_CFG1_SYNC_READ)
@@ -1135,6 +1249,10 @@ static int s3c_onenand_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, mtd);
 
+	if (onenand->type == TYPE_S5PC110 &&
+	    device_create_file(&pdev->dev, &dev_attr_dma_stats))
+		dev_warn(&pdev->dev, "failed to create dma_stats\n");
+
 	clk_disable(this->clk);
 	return 0;
 
@@ -1177,6 +1295,10 @@ static int __devexit s3c_onenand_remove(struct platform_device *pdev)
 	struct mtd_info *mtd = platform_get_drvdata(pdev);
 	struct onenand_chip *this = mtd->priv;
 
+	if (onenand->type == TYPE_S5PC110)
+		device_remove_file(&pdev->dev, &dev_attr_dma_stats);
+	if (onenand->dma_irq)
+		free_irq(onenand->dma_irq, &onenand);
 	onenand_release(mtd);
 	if (onenand->ahb_addr)
 		iounmap(onenand->ahb_addr);
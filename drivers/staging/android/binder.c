@@ -28,6 +28,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -36,18 +37,59 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+#define CREATE_TRACE_POINTS
+#include <trace/events/binder.h>
+
+/*
+ * binder_procs_lock is held for reading by every ioctl and poll on a
+ * binder fd and by the debugfs dumps. It is held for writing only to
+ * add a proc to or remove it from binder_procs, to move a dying proc's
+ * nodes onto binder_dead_nodes and to take a proc's files away. A proc
+ * is freed only after it has been removed, so a reader may follow
+ * pointers into other procs without taking any of their locks.
+ *
+ * Threads may exit at any time. A dying thread is marked is_dead and
+ * unlinked from every transaction under its proc's inner_lock and the
+ * transactions' t->lock, which protects t->from, t->to_proc and
+ * t->to_thread. Anyone who finds a thread through a transaction takes a
+ * reference with binder_get_txn_from(); the last one frees the thread.
+ *
+ * Everything else is protected by per-proc locks:
+ *
+ *   proc->outer_lock	refs_by_desc, refs_by_node and the refs on them
+ *   proc->inner_lock	threads, nodes and the nodes it owns, the todo
+ *			lists, transaction stacks, looper accounting and
+ *			the is_dead flags of the proc and its threads
+ *   proc->alloc_lock	the transaction buffer allocator
+ *
+ * A node is locked by binder_node_lock(): its owner's inner_lock, or
+ * binder_dead_nodes_lock once the owner is gone. The nesting order is
+ * binder_procs_lock -> outer_lock -> node lock -> inner_lock -> t->lock;
+ * two procs' locks of the same kind are never held at once. alloc_lock
+ * nests only inside binder_procs_lock held for reading, and is never held
+ * together with another binder lock except binder_lru_lock.
+ *
+ * binder_lru_lock protects binder_lru, the pages of all procs that back
+ * no buffer but are left mapped for reuse. A page only moves on or off
+ * the list under its proc's alloc_lock; the shrinker trylocks it.
+ */
+static DECLARE_RWSEM(binder_procs_lock);
+static DEFINE_MUTEX(binder_dead_nodes_lock);
+static DEFINE_MUTEX(binder_context_mgr_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru);
+static int binder_lru_count;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -80,6 +122,9 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/* pages mapped up front by binder_mmap() to seed the page pool */
+#define BINDER_POOL_PREFILL_PAGES 4
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -102,6 +147,9 @@ static uint32_t binder_debug_mask = BINDER_DEBUG_USER_ERROR |
 	BINDER_DEBUG_FAILED_TRANSACTION | BINDER_DEBUG_DEAD_TRANSACTION;
 module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 
+static uint32_t binder_pool_max_pages = 32;
+module_param_named(pool_pages, binder_pool_max_pages, uint, S_IWUSR | S_IRUGO);
+
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
@@ -146,22 +194,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -177,17 +225,24 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
+	spinlock_t lock;
 	int next;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.lock = __SPIN_LOCK_UNLOCKED(binder_transaction_log.lock),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.lock = __SPIN_LOCK_UNLOCKED(binder_transaction_log_failed.lock),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&log->lock);
 	e = &log->entry[log->next];
 	memset(e, 0, sizeof(*e));
 	log->next++;
@@ -195,6 +250,7 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&log->lock);
 	return e;
 }
 
@@ -210,6 +266,28 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * Log2 histogram of transaction latencies in microseconds: bucket i
+ * counts latencies below 2^i us, the last one everything above.
+ */
+#define BINDER_LAT_BUCKETS 20
+
+struct binder_lat_hist {
+	u32 count;
+	u64 total_us;
+	u32 buckets[BINDER_LAT_BUCKETS];
+};
+
+static void binder_lat_record(struct binder_lat_hist *h, ktime_t delta)
+{
+	u64 us = ktime_to_us(delta);
+
+	h->count++;
+	h->total_us += us;
+	h->buckets[min_t(int, fls(min_t(u64, us, UINT_MAX)),
+			 BINDER_LAT_BUCKETS - 1)]++;
+}
+
 struct binder_node {
 	int debug_id;
 	struct binder_work work;
@@ -222,6 +300,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -232,6 +311,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_lat_hist lat;	/* send to reply, or dequeue if async */
 };
 
 struct binder_ref_death {
@@ -263,7 +343,8 @@ struct binder_buffer {
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned free_in_progress:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
@@ -273,6 +354,16 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * A page of a proc's mmap area. While it backs no buffer but is still
+ * mapped, it sits on binder_lru until reused or reclaimed.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -281,6 +372,9 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex outer_lock;
+	struct mutex inner_lock;
+	struct mutex alloc_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -299,12 +393,17 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	int pool_pages;
+	struct mm_struct *vma_vm_mm;
+	struct work_struct mmput_work;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_lat_hist dispatch_lat;	/* send to dequeue */
+	struct binder_lat_hist reply_lat;	/* send to reply, calls served */
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
@@ -312,6 +411,7 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	bool is_dead;
 };
 
 enum {
@@ -336,11 +436,14 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	bool is_dead;
 };
 
 struct binder_transaction {
 	int debug_id;
 	struct binder_work work;
+	spinlock_t lock;	/* from, to_proc and to_thread */
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
 	struct binder_proc *to_proc;
@@ -355,6 +458,7 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
 };
 
 static void
@@ -607,6 +711,52 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static struct binder_lru_page *binder_page_at(struct binder_proc *proc,
+					      void *page_addr)
+{
+	return &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+}
+
+static void binder_lru_put(struct binder_proc *proc,
+			   struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	list_add_tail(&page->lru, &binder_lru);
+	binder_lru_count++;
+	spin_unlock(&binder_lru_lock);
+	proc->pool_pages++;
+}
+
+static void binder_lru_take(struct binder_proc *proc,
+			    struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	list_del_init(&page->lru);
+	binder_lru_count--;
+	spin_unlock(&binder_lru_lock);
+	proc->pool_pages--;
+}
+
+static void binder_free_page(struct binder_proc *proc,
+			     struct binder_lru_page *page,
+			     struct vm_area_struct *vma)
+{
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+}
+
+/*
+ * Pages of freed buffers are not unmapped but parked in the proc's page
+ * pool, up to binder_pool_max_pages of them, so that the next buffer
+ * covering them needs no page table work. The shrinker unmaps them
+ * when memory gets tight.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +764,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int mm_locked = vma != NULL;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,40 +775,42 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
-
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
-	}
-
 	if (allocate == 0)
 		goto free_range;
 
-	if (vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
-		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
-	}
-
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		page = binder_page_at(proc, page_addr);
+
+		if (page->page_ptr) {
+			/* still mapped, take it back from the pool */
+			binder_lru_take(proc, page);
+			continue;
+		}
+		if (!mm_locked) {
+			mm = get_task_mm(proc->tsk);
+			if (mm) {
+				down_write(&mm->mmap_sem);
+				vma = proc->vma;
+			}
+			mm_locked = 1;
+		}
+		if (vma == NULL) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
+			       "map pages in userspace, no vma\n", proc->pid);
+			goto err_no_vma;
+		}
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,14 +820,13 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
 			       proc->pid, user_page_addr);
 			goto err_vm_insert_page_failed;
 		}
-		/* vm_insert_page does not seem to increment the refcount */
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -682,32 +834,139 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
+	/* the pages we already got stay mapped, give them back to the pool */
+	for (page_addr -= PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE)
+		binder_lru_put(proc, binder_page_at(proc, page_addr));
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
 	return -ENOMEM;
+
+free_range:
+	for (page_addr = end - PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE) {
+		page = binder_page_at(proc, page_addr);
+		if (proc->pool_pages < binder_pool_max_pages) {
+			binder_lru_put(proc, page);
+			continue;
+		}
+		if (!mm_locked) {
+			mm = get_task_mm(proc->tsk);
+			if (mm) {
+				down_write(&mm->mmap_sem);
+				vma = proc->vma;
+			}
+			mm_locked = 1;
+		}
+		binder_free_page(proc, page, vma);
+	}
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return 0;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static void binder_mmput_func(struct work_struct *work)
+{
+	struct binder_proc *proc = container_of(work, struct binder_proc,
+						mmput_work);
+
+	mmput(proc->vma_vm_mm);
+}
+
+/*
+ * Reclaim context must not end up in exit_mmap(), so the last reference
+ * to the address space is dropped from a work item instead.
+ */
+static void binder_shrink_mmput(struct binder_proc *proc)
+{
+	if (!atomic_add_unless(&proc->vma_vm_mm->mm_users, -1, 1))
+		schedule_work(&proc->mmput_work);
+}
+
+static int binder_shrink_page(struct binder_proc *proc,
+			      struct binder_lru_page *page)
+{
+	struct mm_struct *mm = proc->vma_vm_mm;
+	struct vm_area_struct *vma = NULL;
+
+	/*
+	 * Without users the address space is being torn down. The user
+	 * mapping then holds its own page reference until it is zapped,
+	 * so the page can go without touching the page tables.
+	 */
+	if (atomic_inc_not_zero(&mm->mm_users)) {
+		if (!down_write_trylock(&mm->mmap_sem)) {
+			binder_shrink_mmput(proc);
+			return -EBUSY;
+		}
+		vma = proc->vma;
+	} else
+		mm = NULL;
+
+	binder_lru_take(proc, page);
+	binder_free_page(proc, page, vma);
+
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		binder_shrink_mmput(proc);
+	}
+	return 0;
+}
+
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int nr_to_scan = sc->nr_to_scan;
+
+	while (nr_to_scan-- > 0) {
+		struct binder_lru_page *page;
+		struct binder_proc *proc;
+
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		/* holding alloc_lock keeps proc from being released */
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		spin_unlock(&binder_lru_lock);
+
+		if (binder_shrink_page(proc, page)) {
+			spin_lock(&binder_lru_lock);
+			list_move_tail(&page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+		}
+		mutex_unlock(&proc->alloc_lock);
+	}
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -799,6 +1058,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->allow_user_free = 0;
+	buffer->free_in_progress = 0;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -811,6 +1072,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -868,8 +1142,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -923,6 +1197,14 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	binder_free_buf_locked(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -968,7 +1250,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -982,8 +1264,40 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/*
+ * Lock the state of @node: its proc's inner_lock, or binder_dead_nodes_lock
+ * once the proc is gone. node->proc only changes with binder_procs_lock
+ * held for writing, so the choice is stable for anyone holding it for
+ * reading.
+ */
+static void binder_node_lock(struct binder_node *node)
+{
+	if (node->proc)
+		mutex_lock(&node->proc->inner_lock);
+	else
+		mutex_lock(&binder_dead_nodes_lock);
+}
+
+static void binder_node_unlock(struct binder_node *node)
+{
+	if (node->proc)
+		mutex_unlock(&node->proc->inner_lock);
+	else
+		mutex_unlock(&binder_dead_nodes_lock);
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+/*
+ * A non-NULL target_list must be a todo list of node->proc, which is
+ * covered by the node lock.
+ */
+static int binder_inc_node_ilocked(struct binder_node *node, int strong,
+				   int internal, struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1017,7 +1331,47 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int ret;
+
+	binder_node_lock(node);
+	ret = binder_inc_node_ilocked(node, strong, internal, target_list);
+	binder_node_unlock(node);
+	return ret;
+}
+
+/*
+ * Unlink @node if nothing refers to it any more and its proc does not
+ * hold a reference on it. Returns true if the caller has to free it with
+ * binder_free_node() after dropping the node lock.
+ */
+static bool binder_node_release_ilocked(struct binder_node *node)
+{
+	if (node->proc && (node->has_strong_ref || node->has_weak_ref))
+		return false;
+	if (!hlist_empty(&node->refs) || node->local_strong_refs ||
+	    node->local_weak_refs || node->tmp_refs)
+		return false;
+
+	list_del_init(&node->work.entry);
+	if (node->proc) {
+		rb_erase(&node->rb_node, &node->proc->nodes);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: refless node %d deleted\n",
+			     node->debug_id);
+	} else {
+		hlist_del(&node->dead_node);
+		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+			     "binder: dead node %d deleted\n",
+			     node->debug_id);
+	}
+	return true;
+}
+
+static bool binder_dec_node_ilocked(struct binder_node *node, int strong,
+				    int internal)
 {
 	if (strong) {
 		if (internal)
@@ -1025,39 +1379,56 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 		else
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
+			return false;
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
 		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
+			return false;
 	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
 			wake_up_interruptible(&node->proc->wait);
 		}
-	} else {
-		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: refless node %d deleted\n",
-					     node->debug_id);
-			} else {
-				hlist_del(&node->dead_node);
-				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-					     "binder: dead node %d deleted\n",
-					     node->debug_id);
-			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		}
+		return false;
 	}
+	return binder_node_release_ilocked(node);
+}
 
-	return 0;
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	bool free_node;
+
+	binder_node_lock(node);
+	free_node = binder_dec_node_ilocked(node, strong, internal);
+	binder_node_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+/*
+ * Temporary references keep a node alive while a transaction works on
+ * it without holding the lock of the ref it was found through.
+ */
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_lock(node);
+	node->tmp_refs++;
+	binder_node_unlock(node);
+}
+
+static void binder_dec_node_tmpref(struct binder_node *node)
+{
+	bool free_node;
+
+	binder_node_lock(node);
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	free_node = binder_node_release_ilocked(node);
+	binder_node_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 }
 
 
@@ -1103,7 +1474,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1132,7 +1503,9 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		binder_node_lock(node);
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_unlock(node);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1147,25 +1520,35 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	return new_ref;
 }
 
+/* Called with ref->proc->outer_lock held */
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	bool free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
-		     ref->desc, ref->node->debug_id);
+		     ref->desc, node->debug_id);
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	binder_node_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_ilocked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_ilocked(node, 0, 1);
+	binder_node_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		mutex_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		mutex_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1173,6 +1556,7 @@ static void binder_delete_ref(struct binder_ref *ref)
 	binder_stats_deleted(BINDER_STAT_REF);
 }
 
+/* Called with ref->proc->outer_lock held */
 static int binder_inc_ref(struct binder_ref *ref, int strong,
 			  struct list_head *target_list)
 {
@@ -1196,6 +1580,7 @@ static int binder_inc_ref(struct binder_ref *ref, int strong,
 }
 
 
+/* Called with ref->proc->outer_lock held */
 static int binder_dec_ref(struct binder_ref *ref, int strong)
 {
 	if (strong) {
@@ -1207,12 +1592,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1228,19 +1609,58 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	if (atomic_dec_and_test(&thread->tmp_ref)) {
+		kfree(thread);
+		binder_stats_deleted(BINDER_STAT_THREAD);
+	}
+}
+
+/*
+ * Returns the thread waiting for the reply to @t with a temporary
+ * reference held, or NULL if it has exited. Drop the reference with
+ * binder_thread_dec_tmpref().
+ */
+static struct binder_thread *binder_get_txn_from(struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/* Called with target_thread->proc->inner_lock held */
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+}
+
+/*
+ * The link between a transaction and its buffer is protected by the
+ * inner_lock of the proc the buffer belongs to, which is t->to_proc.
+ */
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+
+	if (target_proc) {
+		mutex_lock(&target_proc->inner_lock);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		mutex_unlock(&target_proc->inner_lock);
 	}
-	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1249,10 +1669,23 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
 	struct binder_thread *target_thread;
+	struct binder_proc *target_proc;
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from(t);
+		if (target_thread) {
+			target_proc = target_thread->proc;
+			mutex_lock(&target_proc->inner_lock);
+			if (target_thread->is_dead) {
+				/* it exited after we looked and has let go of t */
+				mutex_unlock(&target_proc->inner_lock);
+				binder_thread_dec_tmpref(target_thread);
+				target_thread = NULL;
+			}
+		}
 		if (target_thread) {
+			int popped = 0;
+
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1263,19 +1696,24 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 					     "binder: send failed reply for "
 					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
+					      t->debug_id, target_proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				popped = 1;
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
+			mutex_unlock(&target_proc->inner_lock);
+			binder_thread_dec_tmpref(target_thread);
+			if (popped)
+				binder_free_transaction(t);
 			return;
 		} else {
 			struct binder_transaction *next = t->from_parent;
@@ -1285,7 +1723,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1334,8 +1772,13 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+			bool free_node;
+
+			mutex_lock(&proc->inner_lock);
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
+				mutex_unlock(&proc->inner_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad node %p\n", debug_id, fp->binder);
 				break;
@@ -1343,12 +1786,20 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
-			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			free_node = binder_dec_node_ilocked(node,
+					fp->type == BINDER_TYPE_BINDER, 0);
+			mutex_unlock(&proc->inner_lock);
+			if (free_node)
+				binder_free_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1358,6 +1809,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
 			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			mutex_unlock(&proc->outer_lock);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1400,16 +1852,18 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		mutex_lock(&proc->inner_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			mutex_unlock(&proc->inner_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
+			spin_lock(&in_reply_to->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1418,16 +1872,22 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&in_reply_to->lock);
+			mutex_unlock(&proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		mutex_unlock(&proc->inner_lock);
+		binder_set_nice(in_reply_to->saved_priority);
+		target_thread = binder_get_txn_from(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_thread->proc;
+		mutex_lock(&target_proc->inner_lock);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1436,17 +1896,26 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			mutex_unlock(&target_proc->inner_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
+			binder_thread_dec_tmpref(target_thread);
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
+		mutex_unlock(&target_proc->inner_lock);
 	} else {
+		/*
+		 * The target node is pinned with a temporary reference
+		 * so that the ref it was found through may go away.
+		 */
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1454,12 +1923,15 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_inc_node_tmpref(target_node);
+			mutex_unlock(&proc->outer_lock);
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			binder_inc_node_tmpref(target_node);
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
@@ -1467,10 +1939,12 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		mutex_lock(&proc->inner_lock);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				spin_lock(&tmp->lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1478,15 +1952,27 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&tmp->lock);
+				mutex_unlock(&proc->inner_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
 			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+				struct binder_thread *from;
+
+				spin_lock(&tmp->lock);
+				from = tmp->from;
+				if (from && from->proc == target_proc) {
+					atomic_inc(&from->tmp_ref);
+					target_thread = from;
+					spin_unlock(&tmp->lock);
+					break;
+				}
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
 		}
+		mutex_unlock(&proc->inner_lock);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1505,6 +1991,8 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
+	t->start_time = ktime_get();
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1513,7 +2001,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1594,10 +2082,14 @@ static void binder_transaction(struct binder_proc *proc,
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+
+			mutex_lock(&proc->inner_lock);
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
 				node = binder_new_node(proc, fp->binder, fp->cookie);
 				if (node == NULL) {
+					mutex_unlock(&proc->inner_lock);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
@@ -1610,10 +2102,18 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				mutex_unlock(&proc->inner_lock);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
+			node->tmp_refs++;
+			mutex_unlock(&proc->inner_lock);
+
+			mutex_lock(&target_proc->outer_lock);
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				mutex_unlock(&target_proc->outer_lock);
+				binder_dec_node_tmpref(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1629,11 +2129,21 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			mutex_unlock(&target_proc->outer_lock);
+			binder_dec_node_tmpref(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+			struct binder_ref *new_ref;
+			struct binder_node *node;
+			int ref_debug_id;
+			uint32_t ref_desc;
+
+			mutex_lock(&proc->outer_lock);
+			ref = binder_get_ref(proc, fp->handle);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1641,32 +2151,43 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			node = ref->node;
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inc_node(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
 					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
-			} else {
-				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
-				if (new_ref == NULL) {
-					return_error = BR_FAILED_REPLY;
-					goto err_binder_get_ref_for_node_failed;
-				}
-				fp->handle = new_ref->desc;
-				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
-				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     ref->debug_id, ref->desc, node->debug_id,
+					     node->ptr);
+				mutex_unlock(&proc->outer_lock);
+				break;
+			}
+			ref_debug_id = ref->debug_id;
+			ref_desc = ref->desc;
+			binder_inc_node_tmpref(node);
+			mutex_unlock(&proc->outer_lock);
+
+			mutex_lock(&target_proc->outer_lock);
+			new_ref = binder_get_ref_for_node(target_proc, node);
+			if (new_ref == NULL) {
+				mutex_unlock(&target_proc->outer_lock);
+				binder_dec_node_tmpref(node);
+				return_error = BR_FAILED_REPLY;
+				goto err_binder_get_ref_for_node_failed;
 			}
+			fp->handle = new_ref->desc;
+			binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
+				     ref_debug_id, ref_desc, new_ref->debug_id,
+				     new_ref->desc, node->debug_id);
+			mutex_unlock(&target_proc->outer_lock);
+			binder_dec_node_tmpref(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1715,15 +2236,46 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
-	if (reply) {
-		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
-	} else if (!(t->flags & TF_ONE_WAY)) {
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+
+	/*
+	 * Queue the completion before the transaction becomes visible to
+	 * the target, so that it is always returned ahead of the reply.
+	 */
+	mutex_lock(&proc->inner_lock);
+	if (!reply && !(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
-	} else {
+	}
+	if (reply) {
+		/*
+		 * in_reply_to->buffer is ours and pins the node it was
+		 * sent to until BC_FREE_BUFFER clears it under our lock.
+		 */
+		ktime_t delta = ktime_sub(ktime_get(), in_reply_to->start_time);
+
+		binder_lat_record(&proc->reply_lat, delta);
+		if (in_reply_to->buffer && in_reply_to->buffer->target_node)
+			binder_lat_record(&in_reply_to->buffer->target_node->lat,
+					  delta);
+	}
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	mutex_unlock(&proc->inner_lock);
+
+	mutex_lock(&target_proc->inner_lock);
+	if (target_proc->is_dead ||
+	    (target_thread && target_thread->is_dead)) {
+		mutex_unlock(&target_proc->inner_lock);
+		return_error = BR_DEAD_REPLY;
+		goto err_dead_proc_or_thread;
+	}
+	if (reply) {
+		BUG_ON(t->buffer->async_transaction != 0);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+	} else if (t->flags & TF_ONE_WAY) {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
 		if (target_node->has_async_transaction) {
@@ -1732,14 +2284,29 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
+	trace_binder_transaction_enqueue(t->debug_id, target_proc->pid,
+					 target_thread ? target_thread->pid : 0,
+					 reply, t->code);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	mutex_unlock(&target_proc->inner_lock);
+
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (reply)
+		binder_free_transaction(in_reply_to);
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
 	return;
 
+err_dead_proc_or_thread:
+	/* nobody else has seen t or tcomplete yet, so take them back */
+	mutex_lock(&proc->inner_lock);
+	list_del(&tcomplete->entry);
+	if (!reply && !(t->flags & TF_ONE_WAY))
+		thread->transaction_stack = t->from_parent;
+	mutex_unlock(&proc->inner_lock);
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1764,6 +2331,10 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1775,12 +2346,16 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	mutex_lock(&proc->inner_lock);
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		mutex_unlock(&proc->inner_lock);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
 		thread->return_error = return_error;
+		mutex_unlock(&proc->inner_lock);
+	}
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1795,9 +2370,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1811,11 +2386,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&proc->outer_lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
 					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1826,6 +2402,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1854,6 +2431,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&proc->outer_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1861,6 +2439,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *node_ptr;
 			void *cookie;
 			struct binder_node *node;
+			bool free_node;
 
 			if (get_user(node_ptr, (void * __user *)ptr))
 				return -EFAULT;
@@ -1868,8 +2447,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->inner_lock);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
+				mutex_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1887,6 +2468,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				mutex_unlock(&proc->inner_lock);
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1896,6 +2478,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&proc->inner_lock);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1906,16 +2489,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&proc->inner_lock);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			free_node = binder_dec_node_ilocked(node,
+					cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			mutex_unlock(&proc->inner_lock);
+			if (free_node)
+				binder_free_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1933,20 +2521,32 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			/*
+			 * Claim the buffer under the allocator lock so that
+			 * a racing BC_FREE_BUFFER for it fails the lookup.
+			 */
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
-			if (!buffer->allow_user_free) {
+			if (!buffer->allow_user_free ||
+			    buffer->free_in_progress) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			buffer->free_in_progress = 1;
+			mutex_unlock(&proc->alloc_lock);
+
+			mutex_lock(&proc->inner_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1963,6 +2563,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
+			mutex_unlock(&proc->inner_lock);
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
 			break;
@@ -1983,6 +2584,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2000,6 +2602,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			mutex_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
@@ -2034,8 +2637,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->outer_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&proc->outer_lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2062,11 +2667,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&proc->outer_lock);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					mutex_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					mutex_unlock(&proc->inner_lock);
+					mutex_unlock(&proc->outer_lock);
 					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 						     "binder: %d:%d "
 						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
@@ -2079,12 +2688,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					mutex_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					mutex_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2093,6 +2704,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&proc->outer_lock);
 					break;
 				}
 				death = ref->death;
@@ -2104,9 +2716,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					mutex_unlock(&proc->outer_lock);
 					break;
 				}
 				ref->death = NULL;
+				mutex_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2119,7 +2733,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				mutex_unlock(&proc->inner_lock);
 			}
+			mutex_unlock(&proc->outer_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2129,6 +2745,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			mutex_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2140,6 +2757,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				mutex_unlock(&proc->inner_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2156,6 +2774,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			mutex_unlock(&proc->inner_lock);
 		} break;
 
 		default:
@@ -2172,9 +2791,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2208,6 +2827,7 @@ static int binder_thread_read(struct binder_proc *proc,
 		ptr += sizeof(uint32_t);
 	}
 
+	mutex_lock(&proc->inner_lock);
 retry:
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
@@ -2215,14 +2835,14 @@ retry:
 	if (thread->return_error != BR_OK && ptr < end) {
 		if (thread->return_error2 != BR_OK) {
 			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
-				return -EFAULT;
+				goto err_fault;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
 			thread->return_error2 = BR_OK;
 		}
 		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
+			goto err_fault;
 		ptr += sizeof(uint32_t);
 		thread->return_error = BR_OK;
 		goto done;
@@ -2232,7 +2852,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->inner_lock);
+	up_read(&binder_procs_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2256,19 +2877,24 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_procs_lock);
+	mutex_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
-	if (ret)
+	if (ret) {
+		mutex_unlock(&proc->inner_lock);
 		return ret;
+	}
 
 	while (1) {
 		uint32_t cmd;
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		int from_pid, from_tid;
+		ktime_t delta;
 
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
@@ -2290,7 +2916,7 @@ retry:
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
+				goto err_fault;
 			ptr += sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
@@ -2331,13 +2957,13 @@ retry:
 			}
 			if (cmd != BR_NOOP) {
 				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
+					goto err_fault;
 				ptr += sizeof(uint32_t);
 				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
+					goto err_fault;
 				ptr += sizeof(void *);
 				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
+					goto err_fault;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
@@ -2346,7 +2972,7 @@ retry:
 					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
 			} else {
 				list_del_init(&w->entry);
-				if (!weak && !strong) {
+				if (!weak && !strong && !node->tmp_refs) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
 						     proc->pid, thread->pid, node->debug_id,
@@ -2374,10 +3000,10 @@ retry:
 			else
 				cmd = BR_DEAD_BINDER;
 			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
+				goto err_fault;
 			ptr += sizeof(uint32_t);
 			if (put_user(death->cookie, (void * __user *)ptr))
-				return -EFAULT;
+				goto err_fault;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
@@ -2423,13 +3049,19 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
+		spin_lock(&t->lock);
 		if (t->from) {
 			struct task_struct *sender = t->from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
+			from_pid = t->from->proc->pid;
+			from_tid = t->from->pid;
 		} else {
 			tr.sender_pid = 0;
+			from_pid = 0;
+			from_tid = 0;
 		}
+		spin_unlock(&t->lock);
 
 		tr.data_size = t->buffer->data_size;
 		tr.offsets_size = t->buffer->offsets_size;
@@ -2440,10 +3072,10 @@ retry:
 					    sizeof(void *));
 
 		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
+			goto err_fault;
 		ptr += sizeof(uint32_t);
 		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
+			goto err_fault;
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
@@ -2453,16 +3085,23 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, from_pid, from_tid, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
 		list_del(&t->work.entry);
+		delta = ktime_sub(ktime_get(), t->start_time);
+		binder_lat_record(&proc->dispatch_lat, delta);
+		if (t->buffer->target_node && (t->flags & TF_ONE_WAY))
+			binder_lat_record(&t->buffer->target_node->lat, delta);
+		trace_binder_transaction_dequeue(t->debug_id, proc->pid,
+						 thread->pid, ktime_to_ns(delta));
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
+			spin_lock(&t->lock);
 			t->to_thread = thread;
+			spin_unlock(&t->lock);
 			thread->transaction_stack = t;
 		} else {
 			t->buffer->transaction = NULL;
@@ -2485,17 +3124,30 @@ done:
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
-			return -EFAULT;
+			goto err_fault;
 	}
+	mutex_unlock(&proc->inner_lock);
 	return 0;
+
+err_fault:
+	mutex_unlock(&proc->inner_lock);
+	return -EFAULT;
 }
 
-static void binder_release_work(struct list_head *list)
+/* @list is one of proc's todo lists, which nothing adds to any more */
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+	while (1) {
+		mutex_lock(&proc->inner_lock);
+		if (list_empty(list)) {
+			mutex_unlock(&proc->inner_lock);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		mutex_unlock(&proc->inner_lock);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t;
@@ -2521,6 +3173,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &proc->threads.rb_node;
 
+	mutex_lock(&proc->inner_lock);
 	while (*p) {
 		parent = *p;
 		thread = rb_entry(parent, struct binder_thread, rb_node);
@@ -2535,10 +3188,11 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	if (*p == NULL) {
 		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
 		if (thread == NULL)
-			return NULL;
+			goto out;
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		atomic_set(&thread->tmp_ref, 1);
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
 		rb_link_node(&thread->rb_node, parent, p);
@@ -2547,9 +3201,16 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->return_error = BR_OK;
 		thread->return_error2 = BR_OK;
 	}
+out:
+	mutex_unlock(&proc->inner_lock);
 	return thread;
 }
 
+/*
+ * Unlink @thread from its proc and from every transaction on its stack,
+ * then drop the proc's reference on it. Anyone who still holds one from
+ * binder_get_txn_from() frees it when they are done.
+ */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2557,6 +3218,8 @@ static int binder_free_thread(struct binder_proc *proc,
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	mutex_lock(&proc->inner_lock);
+	thread->is_dead = true;
 	rb_erase(&thread->rb_node, &proc->threads);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
@@ -2569,9 +3232,11 @@ static int binder_free_thread(struct binder_proc *proc,
 			     t->debug_id,
 			     (t->to_thread == thread) ? "in" : "out");
 
+		spin_lock(&t->lock);
 		if (t->to_thread == thread) {
 			t->to_proc = NULL;
 			t->to_thread = NULL;
+			spin_unlock(&t->lock);
 			if (t->buffer) {
 				t->buffer->transaction = NULL;
 				t->buffer = NULL;
@@ -2579,15 +3244,17 @@ static int binder_free_thread(struct binder_proc *proc,
 			t = t->to_parent;
 		} else if (t->from == thread) {
 			t->from = NULL;
+			spin_unlock(&t->lock);
 			t = t->from_parent;
 		} else
 			BUG();
 	}
+	mutex_unlock(&proc->inner_lock);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2598,12 +3265,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_procs_lock);
 	thread = binder_get_thread(proc);
 
+	mutex_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->inner_lock);
+	up_read(&binder_procs_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2621,6 +3290,48 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	struct binder_node *node;
+	int ret = 0;
+
+	mutex_lock(&binder_context_mgr_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	mutex_lock(&proc->inner_lock);
+	node = binder_new_node(proc, NULL, NULL);
+	if (node == NULL) {
+		mutex_unlock(&proc->inner_lock);
+		ret = -ENOMEM;
+		goto out;
+	}
+	node->local_weak_refs++;
+	node->local_strong_refs++;
+	node->has_strong_ref = 1;
+	node->has_weak_ref = 1;
+	mutex_unlock(&proc->inner_lock);
+	/* transactions to handle 0 read the pointer without any lock */
+	smp_wmb();
+	binder_context_mgr_node = node;
+out:
+	mutex_unlock(&binder_context_mgr_lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2635,7 +3346,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_procs_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2694,31 +3405,9 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
-			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
@@ -2744,7 +3433,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	up_read(&binder_procs_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2786,6 +3475,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	void *prefill_end;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2833,15 +3524,38 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
+	proc->vma_vm_mm = vma->vm_mm;
+	atomic_inc(&proc->vma_vm_mm->mm_count);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
+	/*
+	 * Page ranges only change under alloc_lock; the shrinker can see
+	 * pooled pages as soon as they are on binder_lru. Taking it under
+	 * mmap_sem, against the usual order, cannot deadlock: until
+	 * proc->vma is set below no buffer exists and binder_alloc_buf()
+	 * fails before it goes near the mm.
+	 */
+	mutex_lock(&proc->alloc_lock);
 	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+		mutex_unlock(&proc->alloc_lock);
 		ret = -ENOMEM;
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
 	}
+	/* Seed the page pool */
+	prefill_end = proc->buffer + min_t(size_t, proc->buffer_size,
+					   BINDER_POOL_PREFILL_PAGES * PAGE_SIZE);
+	if (!binder_update_page_range(proc, 1, proc->buffer + PAGE_SIZE,
+				      prefill_end, vma))
+		binder_update_page_range(proc, 0, proc->buffer + PAGE_SIZE,
+					 prefill_end, vma);
+	mutex_unlock(&proc->alloc_lock);
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
 	list_add(&buffer->entry, &proc->buffers);
@@ -2857,6 +3571,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	mmdrop(proc->vma_vm_mm);
+	proc->vma_vm_mm = NULL;
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2882,16 +3598,20 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->outer_lock);
+	mutex_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
+	INIT_WORK(&proc->mmput_work, binder_mmput_func);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	down_write(&binder_procs_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	hlist_add_head(&proc->proc_node, &binder_procs);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2916,6 +3636,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	mutex_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2924,6 +3646,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	mutex_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2940,6 +3663,14 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
+/*
+ * Tear down a proc whose fd has been released. The threads, refs and
+ * pending work go first under binder_procs_lock held for reading, with
+ * is_dead keeping anything new from being queued. Then the proc and its
+ * nodes are unlinked with the lock held for writing, which also waits out
+ * every reader that could still have found the proc. What is left is
+ * private to us and is freed without the lock.
+ */
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
@@ -2950,6 +3681,38 @@ static void binder_deferred_release(struct binder_proc *proc)
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	down_read(&binder_procs_lock);
+	mutex_lock(&proc->inner_lock);
+	proc->is_dead = true;
+	mutex_unlock(&proc->inner_lock);
+
+	threads = 0;
+	active_transactions = 0;
+	while (1) {
+		struct binder_thread *thread;
+
+		mutex_lock(&proc->inner_lock);
+		n = rb_first(&proc->threads);
+		mutex_unlock(&proc->inner_lock);
+		if (n == NULL)
+			break;
+		thread = rb_entry(n, struct binder_thread, rb_node);
+		threads++;
+		active_transactions += binder_free_thread(proc, thread);
+	}
+	outgoing_refs = 0;
+	mutex_lock(&proc->outer_lock);
+	while ((n = rb_first(&proc->refs_by_desc))) {
+		struct binder_ref *ref = rb_entry(n, struct binder_ref,
+						  rb_node_desc);
+		outgoing_refs++;
+		binder_delete_ref(ref);
+	}
+	mutex_unlock(&proc->outer_lock);
+	binder_release_work(proc, &proc->todo);
+	up_read(&binder_procs_lock);
+
+	down_write(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
@@ -2957,14 +3720,6 @@ static void binder_deferred_release(struct binder_proc *proc)
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
-
-	threads = 0;
-	active_transactions = 0;
-	while ((n = rb_first(&proc->threads))) {
-		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
-		threads++;
-		active_transactions += binder_free_thread(proc, thread);
-	}
 	nodes = 0;
 	incoming_refs = 0;
 	while ((n = rb_first(&proc->nodes))) {
@@ -2973,6 +3728,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
+		binder_release_work(proc, &node->async_todo);
 		if (hlist_empty(&node->refs)) {
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
@@ -3003,16 +3759,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 				     incoming_refs, death);
 		}
 	}
-	outgoing_refs = 0;
-	while ((n = rb_first(&proc->refs_by_desc))) {
-		struct binder_ref *ref = rb_entry(n, struct binder_ref,
-						  rb_node_desc);
-		outgoing_refs++;
-		binder_delete_ref(ref);
-	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
+	up_write(&binder_procs_lock);
 
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3034,20 +3783,29 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+
+		mutex_lock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
+			struct binder_lru_page *page = &proc->pages[i];
+
+			if (page->page_ptr) {
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
+					     "page %d at %p %s\n",
 					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+					     proc->buffer + i * PAGE_SIZE,
+					     list_empty(&page->lru) ?
+					     "not freed" : "pooled");
+				if (!list_empty(&page->lru))
+					binder_lru_take(proc, page);
+				binder_free_page(proc, page, NULL);
 				page_count++;
 			}
 		}
+		mutex_unlock(&proc->alloc_lock);
+		/* the shrinker may have left us the last mm reference */
+		flush_work(&proc->mmput_work);
+		mmdrop(proc->vma_vm_mm);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3071,7 +3829,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3087,9 +3844,12 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			/* transactions install fds through proc->files */
+			down_write(&binder_procs_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			up_write(&binder_procs_lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
@@ -3098,7 +3858,6 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3118,17 +3877,31 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
-static void print_binder_transaction(struct seq_file *m, const char *prefix,
+/* Called with proc->inner_lock held */
+static void print_binder_transaction(struct seq_file *m,
+				     struct binder_proc *proc,
+				     const char *prefix,
 				     struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	seq_printf(m,
 		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
-		   t->to_proc ? t->to_proc->pid : 0,
+		   to_proc ? to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
 		   t->code, t->flags, t->priority, t->need_reply);
+	spin_unlock(&t->lock);
+
+	/* t->buffer belongs to to_proc, whose inner_lock we may not hold */
+	if (proc != to_proc) {
+		seq_puts(m, "\n");
+		return;
+	}
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3150,7 +3923,8 @@ static void print_binder_buffer(struct seq_file *m, const char *prefix,
 		   buffer->transaction ? "active" : "delivered");
 }
 
-static void print_binder_work(struct seq_file *m, const char *prefix,
+static void print_binder_work(struct seq_file *m, struct binder_proc *proc,
+			      const char *prefix,
 			      const char *transaction_prefix,
 			      struct binder_work *w)
 {
@@ -3160,7 +3934,7 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		print_binder_transaction(m, transaction_prefix, t);
+		print_binder_transaction(m, proc, transaction_prefix, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		seq_printf(m, "%stransaction complete\n", prefix);
@@ -3185,6 +3959,7 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	}
 }
 
+/* Called with thread->proc->inner_lock held */
 static void print_binder_thread(struct seq_file *m,
 				struct binder_thread *thread,
 				int print_always)
@@ -3199,25 +3974,28 @@ static void print_binder_thread(struct seq_file *m,
 	t = thread->transaction_stack;
 	while (t) {
 		if (t->from == thread) {
-			print_binder_transaction(m,
+			print_binder_transaction(m, thread->proc,
 						 "    outgoing transaction", t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			print_binder_transaction(m,
+			print_binder_transaction(m, thread->proc,
 						 "    incoming transaction", t);
 			t = t->to_parent;
 		} else {
-			print_binder_transaction(m, "    bad transaction", t);
+			print_binder_transaction(m, thread->proc,
+						 "    bad transaction", t);
 			t = NULL;
 		}
 	}
 	list_for_each_entry(w, &thread->todo, entry) {
-		print_binder_work(m, "    ", "    pending transaction", w);
+		print_binder_work(m, thread->proc, "    ",
+				  "    pending transaction", w);
 	}
 	if (!print_always && m->count == header_pos)
 		m->count = start_pos;
 }
 
+/* Called with the node lock held */
 static void print_binder_node(struct seq_file *m, struct binder_node *node)
 {
 	struct binder_ref *ref;
@@ -3241,7 +4019,7 @@ static void print_binder_node(struct seq_file *m, struct binder_node *node)
 	}
 	seq_puts(m, "\n");
 	list_for_each_entry(w, &node->async_todo, entry)
-		print_binder_work(m, "    ",
+		print_binder_work(m, node->proc, "    ",
 				  "    pending async transaction", w);
 }
 
@@ -3263,6 +4041,7 @@ static void print_binder_proc(struct seq_file *m,
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	mutex_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		print_binder_thread(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
@@ -3272,22 +4051,29 @@ static void print_binder_proc(struct seq_file *m,
 		if (print_all || node->has_async_transaction)
 			print_binder_node(m, node);
 	}
+	mutex_unlock(&proc->inner_lock);
 	if (print_all) {
+		mutex_lock(&proc->outer_lock);
 		for (n = rb_first(&proc->refs_by_desc);
 		     n != NULL;
 		     n = rb_next(n))
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
+		mutex_unlock(&proc->outer_lock);
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
+	mutex_lock(&proc->inner_lock);
 	list_for_each_entry(w, &proc->todo, entry)
-		print_binder_work(m, "  ", "  pending transaction", w);
+		print_binder_work(m, proc, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		seq_puts(m, "  has delivered dead binder\n");
 		break;
 	}
+	mutex_unlock(&proc->inner_lock);
 	if (!print_all && m->count == header_pos)
 		m->count = start_pos;
 }
@@ -3351,17 +4137,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3369,14 +4159,33 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
+static void print_binder_lat_hist(struct seq_file *m, const char *prefix,
+				  const char *name, struct binder_lat_hist *h)
+{
+	int i;
+
+	if (!h->count)
+		return;
+	seq_printf(m, "%s%s: %u avg %llu us\n%s ", prefix, name, h->count,
+		   div_u64(h->total_us, h->count), prefix);
+	for (i = 0; i < BINDER_LAT_BUCKETS - 1; i++)
+		if (h->buckets[i])
+			seq_printf(m, " <%uus:%u", 1U << i, h->buckets[i]);
+	if (h->buckets[i])
+		seq_printf(m, " >=%uus:%u", 1U << (i - 1), h->buckets[i]);
+	seq_puts(m, "\n");
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
@@ -3385,6 +4194,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	int count, strong, weak;
 
 	seq_printf(m, "proc %d\n", proc->pid);
+	mutex_lock(&proc->inner_lock);
 	count = 0;
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
@@ -3398,9 +4208,11 @@ static void print_binder_proc_stats(struct seq_file *m,
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  nodes: %d\n", count);
+	mutex_unlock(&proc->inner_lock);
 	count = 0;
 	strong = 0;
 	weak = 0;
+	mutex_lock(&proc->outer_lock);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
@@ -3408,13 +4220,18 @@ static void print_binder_proc_stats(struct seq_file *m,
 		strong += ref->strong;
 		weak += ref->weak;
 	}
+	mutex_unlock(&proc->outer_lock);
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  pooled pages: %d\n", proc->pool_pages);
 
+	mutex_lock(&proc->inner_lock);
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
@@ -3427,6 +4244,19 @@ static void print_binder_proc_stats(struct seq_file *m,
 	}
 	seq_printf(m, "  pending transactions: %d\n", count);
 
+	print_binder_lat_hist(m, "  ", "dispatch latency", &proc->dispatch_lat);
+	print_binder_lat_hist(m, "  ", "reply latency", &proc->reply_lat);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+		char name[24];
+
+		snprintf(name, sizeof(name), "node %d latency",
+			 node->debug_id);
+		print_binder_lat_hist(m, "  ", name, &node->lat);
+	}
+	mutex_unlock(&proc->inner_lock);
+
 	print_binder_stats(m, "  ", &proc->stats);
 }
 
@@ -3439,19 +4269,21 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_procs_lock);
 
 	seq_puts(m, "binder state:\n");
 
+	mutex_lock(&binder_dead_nodes_lock);
 	if (!hlist_empty(&binder_dead_nodes))
 		seq_puts(m, "dead nodes:\n");
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
 		print_binder_node(m, node);
+	mutex_unlock(&binder_dead_nodes_lock);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_procs_lock);
 	return 0;
 }
 
@@ -3462,16 +4294,17 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_procs_lock);
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "pooled pages: %d\n", binder_lru_count);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_procs_lock);
 	return 0;
 }
 
@@ -3482,13 +4315,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_procs_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_procs_lock);
 	return 0;
 }
 
@@ -3498,11 +4331,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_procs_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_procs_lock);
 	return 0;
 }
 
@@ -3565,6 +4398,7 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -21,20 +21,72 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
+#include <asm/unaligned.h>
+
 #include <asm/ioctls.h>
 
+/* size of each CPU's staging buffer, must hold a maximal entry */
+#define LOGGER_CPU_BUF_SIZE	(16 * 1024)
+
+/* bounds for resizing a log at runtime */
+#define LOGGER_MIN_LOG_SIZE	(64 * 1024)
+#define LOGGER_MAX_LOG_SIZE	(4 * 1024 * 1024)
+#define LOGGER_MAX_HIST_SIZE	(16 * 1024 * 1024)
+
+/* aged entries are compressed in runs of about this many bytes */
+#define LOGGER_HIST_CHUNK	(32 * 1024)
+#define LOGGER_HIST_RAW_MAX	(LOGGER_HIST_CHUNK + \
+				 sizeof(struct logger_entry) + \
+				 LOGGER_ENTRY_MAX_PAYLOAD)
+
+/*
+ * struct logger_hist_chunk - a run of entries evicted from the ring,
+ * compressed with lzo. Chunks are numbered in eviction order.
+ */
+struct logger_hist_chunk {
+	struct list_head	list;	/* entry in logger_log's hist */
+	u32			seq;	/* eviction order */
+	size_t			raw_len; /* bytes of entries */
+	size_t			z_len;	/* bytes of 'data' */
+	unsigned char		data[0];
+};
+
+/*
+ * struct logger_cpu_buf - a CPU's staging buffer for writers
+ *
+ * Writers append whole entries here instead of to the ring, so that they
+ * only contend with writers on the same CPU. Each entry is preceded by the
+ * u32 sequence number it was stamped with, which logger_flush() merges on
+ * when it moves the entries to the ring. 'buffer' and 'w_off' are protected
+ * by 'mutex'; 'r_off' is only used by logger_flush().
+ */
+struct logger_cpu_buf {
+	struct mutex		mutex;	/* serializes this CPU's writers */
+	unsigned char		*buffer;/* staged entries, never wraps */
+	size_t			w_off;	/* bytes staged */
+	size_t			r_off;	/* bytes merged so far */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The ring is protected by the mutex
+ * 'mutex'. Writers hold 'flush_sem' shared while staging an entry on their
+ * CPU, logger_flush() holds it exclusively, then 'mutex', while merging.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
@@ -42,9 +94,20 @@ struct logger_log {
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
 	struct mutex		mutex;	/* mutex protecting buffer */
+	struct rw_semaphore	flush_sem; /* writers vs. logger_flush() */
+	struct logger_cpu_buf __percpu *cpu_bufs; /* staged entries */
+	atomic_t		seq;	/* stamps staged entries in write order */
+	atomic_t		mmap_count; /* read-only mappings of buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct list_head	hist;	/* compressed history, oldest first */
+	size_t			hist_size; /* budget for hist, 0 disables it */
+	size_t			hist_used; /* bytes taken by hist */
+	u32			hist_seq; /* seq of the next chunk */
+	unsigned char		*hist_raw; /* compression work buffers */
+	unsigned char		*hist_z;
+	void			*hist_wrkmem;
 };
 
 /*
@@ -57,8 +120,14 @@ struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	size_t			mmap_off; /* r_off handed out to mmap reader */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	bool			r_hist;	/* reader is still in the history */
+	u32			hist_seq; /* next chunk to decompress */
+	unsigned char		*hist_buf; /* the decompressed chunk */
+	size_t			hist_off; /* read offset into hist_buf */
+	size_t			hist_len; /* bytes in hist_buf */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -230,6 +299,92 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+/*
+ * hist_find - returns the oldest chunk of the history numbered 'seq' or
+ * later, or NULL if there is none
+ *
+ * Caller must hold log->mutex.
+ */
+static struct logger_hist_chunk *hist_find(struct logger_log *log, u32 seq)
+{
+	struct logger_hist_chunk *chunk;
+
+	list_for_each_entry(chunk, &log->hist, list)
+		if ((s32)(chunk->seq - seq) >= 0)
+			return chunk;
+	return NULL;
+}
+
+/*
+ * hist_peek - returns the reader's next entry from the compressed history,
+ * decompressing the next chunk when needed. Once the history is exhausted,
+ * the reader continues at the head of the ring and NULL is returned.
+ *
+ * Caller must hold log->mutex.
+ */
+static struct logger_entry *hist_peek(struct logger_log *log,
+				      struct logger_reader *reader)
+{
+	struct logger_hist_chunk *chunk;
+	struct logger_entry *entry;
+
+	while (1) {
+		if (reader->hist_off < reader->hist_len) {
+			entry = (struct logger_entry *)
+				(reader->hist_buf + reader->hist_off);
+			if (reader->r_all || entry->euid == current_euid())
+				return entry;
+			reader->hist_off += sizeof(struct logger_entry) +
+				entry->len;
+			continue;
+		}
+
+		chunk = hist_find(log, reader->hist_seq);
+		if (!chunk)
+			break;
+		if (!reader->hist_buf) {
+			reader->hist_buf = vmalloc(LOGGER_HIST_RAW_MAX);
+			if (!reader->hist_buf)
+				break;
+		}
+
+		reader->hist_off = 0;
+		reader->hist_len = LOGGER_HIST_RAW_MAX;
+		if (lzo1x_decompress_safe(chunk->data, chunk->z_len,
+					  reader->hist_buf,
+					  &reader->hist_len) != LZO_E_OK)
+			reader->hist_len = 0;
+		reader->hist_seq = chunk->seq + 1;
+	}
+
+	reader->r_hist = false;
+	reader->r_off = log->head;
+	return NULL;
+}
+
+/*
+ * do_read_hist_to_user - reads the entry 'entry' returned by hist_peek()
+ * into the user-space buffer 'buf', which holds exactly 'count' bytes.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t do_read_hist_to_user(struct logger_reader *reader,
+				    struct logger_entry *entry,
+				    char __user *buf, size_t count)
+{
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+	if (copy_to_user(buf + hdr_len, entry->msg, count - hdr_len))
+		return -EFAULT;
+
+	reader->hist_off += sizeof(struct logger_entry) + entry->len;
+	return count;
+}
+
+static void logger_flush(struct logger_log *log);
+
 /*
  * logger_read - our log's read() method
  *
@@ -238,6 +393,7 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
  * 	- Atomically reads exactly one log entry
+ * 	- A new reader gets the compressed history, if any, before the ring
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -254,8 +410,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
+		logger_flush(log);
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = (log->w_off == reader->r_off) && !reader->r_hist;
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -279,6 +436,21 @@ start:
 
 	mutex_lock(&log->mutex);
 
+	/* entries evicted before the reader opened come first */
+	if (reader->r_hist) {
+		struct logger_entry *entry = hist_peek(log, reader);
+
+		if (entry) {
+			ret = get_user_hdr_len(reader->r_ver) + entry->len;
+			if (count < ret)
+				ret = -EINVAL;
+			else
+				ret = do_read_hist_to_user(reader, entry,
+							   buf, ret);
+			goto out;
+		}
+	}
+
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -343,6 +515,87 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * hist_drop - frees the oldest chunk of the history
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void hist_drop(struct logger_log *log)
+{
+	struct logger_hist_chunk *chunk;
+
+	chunk = list_first_entry(&log->hist, struct logger_hist_chunk, list);
+	list_del(&chunk->list);
+	log->hist_used -= sizeof(*chunk) + chunk->z_len;
+	kfree(chunk);
+}
+
+/*
+ * hist_add - compresses the 'len' bytes of entries at 'off' into a new
+ * chunk of history, dropping the oldest chunks that no longer fit the
+ * budget. 'len' must not exceed LOGGER_HIST_RAW_MAX.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void hist_add(struct logger_log *log, size_t off, size_t len)
+{
+	struct logger_hist_chunk *chunk;
+	size_t z_len;
+	size_t n;
+
+	n = min(len, log->size - off);
+	memcpy(log->hist_raw, log->buffer + off, n);
+	if (len != n)
+		memcpy(log->hist_raw + n, log->buffer, len - n);
+
+	if (lzo1x_1_compress(log->hist_raw, len, log->hist_z, &z_len,
+			     log->hist_wrkmem) != LZO_E_OK)
+		return;
+
+	chunk = kmalloc(sizeof(*chunk) + z_len, GFP_KERNEL);
+	if (!chunk)
+		return;
+	chunk->seq = log->hist_seq++;
+	chunk->raw_len = len;
+	chunk->z_len = z_len;
+	memcpy(chunk->data, log->hist_z, z_len);
+
+	list_add_tail(&chunk->list, &log->hist);
+	log->hist_used += sizeof(*chunk) + z_len;
+	while (log->hist_used > log->hist_size)
+		hist_drop(log);
+}
+
+/*
+ * evict - moves the start head at least 'len' bytes forward. With a
+ * history, the entries passed over are compressed rather than lost; to
+ * give lzo something to work with, at least LOGGER_HIST_CHUNK bytes go at
+ * once. 'len' must not exceed LOGGER_HIST_CHUNK then.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void evict(struct logger_log *log, size_t len)
+{
+	size_t off = log->head;
+	size_t count = 0;
+
+	if (!log->hist_size) {
+		log->head = get_next_entry(log, log->head, len);
+		return;
+	}
+
+	while (count < LOGGER_HIST_CHUNK && off != log->w_off) {
+		size_t nr = sizeof(struct logger_entry) +
+			get_entry_msg_len(log, off);
+		off = logger_offset(off + nr);
+		count += nr;
+	}
+
+	if (count)
+		hist_add(log, log->head, count);
+	log->head = off;
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
@@ -358,10 +611,11 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	struct logger_reader *reader;
 
 	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+		evict(log, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (!reader->r_hist &&
+		    clock_interval(old, new, reader->r_off))
 			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
@@ -385,51 +639,100 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * __logger_flush - moves the entries staged on all CPUs to the ring, oldest
+ * first. Each CPU's entries are already in order, so this merges on the
+ * heads of the staging buffers. Timestamps are too coarse to order them,
+ * and a writer that migrated may have left entries on several CPUs within
+ * the same tick, so the sequence numbers decide.
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller needs to hold log->flush_sem for writing and log->mutex.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void __logger_flush(struct logger_log *log)
 {
-	size_t len;
+	struct logger_cpu_buf *cpu_buf;
+	int cpu;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (1) {
+		struct logger_cpu_buf *oldest = NULL;
+		struct logger_entry *first = NULL;
+		u32 seq, first_seq = 0;
+		size_t len;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+		for_each_possible_cpu(cpu) {
+			cpu_buf = per_cpu_ptr(log->cpu_bufs, cpu);
+			if (cpu_buf->r_off == cpu_buf->w_off)
+				continue;
+			seq = get_unaligned((u32 *)
+					    (cpu_buf->buffer + cpu_buf->r_off));
+			if (!first || (s32)(seq - first_seq) < 0) {
+				oldest = cpu_buf;
+				first = (struct logger_entry *)(cpu_buf->buffer +
+						cpu_buf->r_off + sizeof(u32));
+				first_seq = seq;
+			}
+		}
+		if (!oldest)
+			break;
 
-	log->w_off = logger_offset(log->w_off + count);
+		/*
+		 * Fix up any readers, pulling them forward to the first
+		 * readable entry after (what will be) the new write offset.
+		 */
+		len = sizeof(struct logger_entry) + first->len;
+		fix_up_readers(log, len);
+		do_write_log(log, first, len);
+		oldest->r_off += sizeof(u32) + len;
+	}
 
-	return count;
+	for_each_possible_cpu(cpu) {
+		cpu_buf = per_cpu_ptr(log->cpu_bufs, cpu);
+		cpu_buf->w_off = 0;
+		cpu_buf->r_off = 0;
+	}
+}
+
+/*
+ * logger_flush - moves the entries staged on all CPUs to the ring
+ *
+ * Must not be called with log->mutex held.
+ */
+static void logger_flush(struct logger_log *log)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (per_cpu_ptr(log->cpu_bufs, cpu)->w_off)
+			break;
+	if (cpu >= nr_cpu_ids)
+		return;
+
+	down_write(&log->flush_sem);
+	mutex_lock(&log->mutex);
+	__logger_flush(log);
+	mutex_unlock(&log->mutex);
+	up_write(&log->flush_sem);
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
- * them above all else.
+ * them above all else: an entry is only staged on the current CPU, readers
+ * flush it to the ring.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_cpu_buf *cpu_buf;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned char *msg;
+	size_t count;
+	u32 seq;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -438,41 +741,58 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	count = sizeof(struct logger_entry) + header.len;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+again:
+	down_read(&log->flush_sem);
+	cpu_buf = per_cpu_ptr(log->cpu_bufs, raw_smp_processor_id());
+	mutex_lock(&cpu_buf->mutex);
+
+	if (cpu_buf->w_off + sizeof(u32) + count > LOGGER_CPU_BUF_SIZE) {
+		mutex_unlock(&cpu_buf->mutex);
+		up_read(&log->flush_sem);
+		logger_flush(log);
+		goto again;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	/* stamped under the mutex, so each CPU's entries stay in order */
+	seq = atomic_inc_return(&log->seq);
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+	put_unaligned(seq, (u32 *)(cpu_buf->buffer + cpu_buf->w_off));
+	memcpy(cpu_buf->buffer + cpu_buf->w_off + sizeof(u32), &header,
+	       sizeof(struct logger_entry));
+	msg = cpu_buf->buffer + cpu_buf->w_off + sizeof(u32) +
+		sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
-		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		/*
+		 * A failed copy just leaves the entry unstaged, there are
+		 * no clobbered entries to worry about.
+		 */
+		if (len && copy_from_user(msg + ret, iov->iov_base, len)) {
+			ret = -EFAULT;
+			goto out;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
+	cpu_buf->w_off += sizeof(u32) + count;
 
-	mutex_unlock(&log->mutex);
+out:
+	mutex_unlock(&cpu_buf->mutex);
+	up_read(&log->flush_sem);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	if (ret > 0)
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -506,13 +826,21 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->mmap_off = 0;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
+		reader->hist_buf = NULL;
+		reader->hist_off = 0;
+		reader->hist_len = 0;
 
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
+		reader->r_hist = !list_empty(&log->hist);
+		if (reader->r_hist)
+			reader->hist_seq = list_first_entry(&log->hist,
+				struct logger_hist_chunk, list)->seq;
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -532,7 +860,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
+		vfree(reader->hist_buf);
 		kfree(reader);
 	}
 
@@ -562,12 +895,13 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
+	logger_flush(log);
 	mutex_lock(&log->mutex);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (log->w_off != reader->r_off || reader->r_hist)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -587,6 +921,184 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * get_readable_len - bytes between the reader's offset and the write head
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t get_readable_len(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	if (log->w_off >= reader->r_off)
+		return log->w_off - reader->r_off;
+	else
+		return (log->size - reader->r_off) + log->w_off;
+}
+
+/*
+ * logger_mmap_window - tell an mmap reader which part of the ring it may
+ * parse. Entries there are in the v2 format whatever the reader's version.
+ */
+static long logger_mmap_window(struct logger_log *log,
+			       struct logger_reader *reader, void __user *arg)
+{
+	struct logger_mmap_window win;
+
+	/* the history cannot be mapped, mmap readers start at the ring */
+	if (reader->r_hist) {
+		reader->r_hist = false;
+		reader->r_off = log->head;
+	}
+
+	win.off = reader->r_off;
+	win.len = get_readable_len(log, reader);
+	reader->mmap_off = reader->r_off;
+
+	if (copy_to_user(arg, &win, sizeof(win)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * logger_mmap_consume - advance an mmap reader past 'len' bytes of whole
+ * entries of its window. Fails with -ESTALE if a writer lapped the reader
+ * since the window was handed out, as the entries it parsed may then have
+ * been overwritten.
+ */
+static long logger_mmap_consume(struct logger_log *log,
+				struct logger_reader *reader, size_t len)
+{
+	size_t off = reader->r_off;
+	size_t count = 0;
+
+	if (reader->r_off != reader->mmap_off)
+		return -ESTALE;
+	if (len > get_readable_len(log, reader))
+		return -EINVAL;
+
+	while (count < len) {
+		size_t nr = sizeof(struct logger_entry) +
+			get_entry_msg_len(log, off);
+		off = logger_offset(off + nr);
+		count += nr;
+	}
+	if (count != len)
+		return -EINVAL;
+
+	reader->r_off = off;
+	reader->mmap_off = off;
+	return 0;
+}
+
+/*
+ * logger_resize - replaces the ring of 'log' by one of 'size' bytes, keeping
+ * the newest entries that fit. The others go to the history, if any.
+ */
+static int logger_resize(struct logger_log *log, size_t size)
+{
+	struct logger_reader *reader;
+	unsigned char *buffer;
+	size_t used, n;
+	int ret = 0;
+
+	if (!is_power_of_2(size) || size < LOGGER_MIN_LOG_SIZE ||
+	    size > LOGGER_MAX_LOG_SIZE)
+		return -EINVAL;
+
+	buffer = vmalloc_user(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	down_write(&log->flush_sem);
+	mutex_lock(&log->mutex);
+
+	/* mapped readers would keep parsing the old ring */
+	if (atomic_read(&log->mmap_count)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	__logger_flush(log);
+
+	used = logger_offset(log->w_off - log->head);
+	while (used >= size) {
+		size_t head = log->head;
+
+		evict(log, min_t(size_t, used - size + 1, LOGGER_HIST_CHUNK));
+		used -= logger_offset(log->head - head);
+	}
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t off = logger_offset(reader->r_off - log->head);
+
+		reader->r_off = off <= used ? off : 0;
+		reader->mmap_off = reader->r_off;
+	}
+
+	n = min(used, log->size - log->head);
+	memcpy(buffer, log->buffer + log->head, n);
+	memcpy(buffer + n, log->buffer, used - n);
+
+	swap(log->buffer, buffer);
+	log->size = size;
+	log->head = 0;
+	log->w_off = used;
+
+out:
+	mutex_unlock(&log->mutex);
+	up_write(&log->flush_sem);
+	vfree(buffer);
+
+	return ret;
+}
+
+/*
+ * logger_set_hist_size - sets the budget of the compressed history of 'log',
+ * dropping the oldest chunks that no longer fit. Zero turns it off.
+ */
+static int logger_set_hist_size(struct logger_log *log, size_t size)
+{
+	struct logger_reader *reader;
+	int ret = 0;
+
+	if (size > LOGGER_MAX_HIST_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&log->mutex);
+
+	if (size && !log->hist_raw) {
+		log->hist_raw = vmalloc(LOGGER_HIST_RAW_MAX);
+		log->hist_z = vmalloc(lzo1x_worst_compress(LOGGER_HIST_RAW_MAX));
+		log->hist_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		if (!log->hist_raw || !log->hist_z || !log->hist_wrkmem) {
+			size = 0;
+			ret = -ENOMEM;
+		}
+	}
+
+	log->hist_size = size;
+	while (log->hist_used > size)
+		hist_drop(log);
+
+	if (!size) {
+		list_for_each_entry(reader, &log->readers, list)
+			if (reader->r_hist) {
+				reader->r_hist = false;
+				reader->r_off = log->head;
+			}
+		vfree(log->hist_raw);
+		vfree(log->hist_z);
+		vfree(log->hist_wrkmem);
+		log->hist_raw = NULL;
+		log->hist_z = NULL;
+		log->hist_wrkmem = NULL;
+	}
+
+	mutex_unlock(&log->mutex);
+
+	return ret;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -594,6 +1106,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
+	if (cmd == LOGGER_SET_LOG_BUF_SIZE) {
+		if (!capable(CAP_SYSLOG))
+			return -EPERM;
+		return logger_resize(log, arg);
+	}
+
+	logger_flush(log);
 	mutex_lock(&log->mutex);
 
 	switch (cmd) {
@@ -606,10 +1125,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = get_readable_len(log, reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -618,6 +1134,16 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
+		if (reader->r_hist) {
+			struct logger_entry *entry = hist_peek(log, reader);
+
+			if (entry) {
+				ret = get_user_hdr_len(reader->r_ver) +
+					entry->len;
+				break;
+			}
+		}
+
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
@@ -633,9 +1159,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
+		list_for_each_entry(reader, &log->readers, list) {
 			reader->r_off = log->w_off;
+			reader->r_hist = false;
+		}
 		log->head = log->w_off;
+		while (!list_empty(&log->hist))
+			hist_drop(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -654,6 +1184,22 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_GET_MMAP_WINDOW:
+	case LOGGER_MMAP_CONSUME:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		if (!reader->r_all) {
+			ret = -EPERM;
+			break;
+		}
+		if (cmd == LOGGER_GET_MMAP_WINDOW)
+			ret = logger_mmap_window(log, reader, argp);
+		else
+			ret = logger_mmap_consume(log, reader, arg);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -661,6 +1207,69 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+static void logger_vma_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mmap_count);
+}
+
+static void logger_vma_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mmap_count);
+}
+
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vma_open,
+	.close = logger_vma_close,
+};
+
+/*
+ * logger_mmap - maps the whole ring read-only, so that readers can parse
+ * entries in place. Only readers that may see every entry can do this.
+ * The log cannot be resized while it is mapped.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	mutex_lock(&log->mutex);
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != log->size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	ret = remap_vmalloc_range(vma, log->buffer, 0);
+	if (ret)
+		goto out;
+
+	vma->vm_ops = &logger_vm_ops;
+	vma->vm_private_data = log;
+	atomic_inc(&log->mmap_count);
+
+out:
+	mutex_unlock(&log->mutex);
+
+	return ret;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -668,19 +1277,18 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * Defines a log structure with name 'NAME' and an initial size of 'SIZE'
+ * bytes, which must be a power of two between LOGGER_MIN_LOG_SIZE and
+ * LOGGER_MAX_LOG_SIZE. The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -690,9 +1298,12 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.flush_sem = __RWSEM_INITIALIZER(VAR .flush_sem), \
+	.mmap_count = ATOMIC_INIT(0), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.hist = LIST_HEAD_INIT(VAR .hist), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -713,21 +1324,138 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static inline struct logger_log *dev_get_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+static ssize_t show_buffer_size(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->size);
+}
+
+static ssize_t store_buffer_size(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	unsigned long val;
+	int ret;
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	ret = logger_resize(dev_get_log(dev), val);
+	return ret ? ret : count;
+}
+
+static ssize_t show_history_size(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->hist_size);
+}
+
+static ssize_t store_history_size(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	unsigned long val;
+	int ret;
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	ret = logger_set_hist_size(dev_get_log(dev), val);
+	return ret ? ret : count;
+}
+
+/* chunks, bytes of entries and bytes used in the compressed history */
+static ssize_t show_history(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+	struct logger_hist_chunk *chunk;
+	size_t chunks = 0, raw = 0;
+
+	mutex_lock(&log->mutex);
+	list_for_each_entry(chunk, &log->hist, list) {
+		chunks++;
+		raw += chunk->raw_len;
+	}
+	mutex_unlock(&log->mutex);
+
+	return sprintf(buf, "%zu %zu %zu\n", chunks, raw, log->hist_used);
+}
+
+static DEVICE_ATTR(buffer_size, S_IRUGO | S_IWUSR,
+		   show_buffer_size, store_buffer_size);
+static DEVICE_ATTR(history_size, S_IRUGO | S_IWUSR,
+		   show_history_size, store_history_size);
+static DEVICE_ATTR(history, S_IRUGO, show_history, NULL);
+
+static struct attribute *logger_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	&dev_attr_history_size.attr,
+	&dev_attr_history.attr,
+	NULL
+};
+
+static const struct attribute_group logger_attr_group = {
+	.attrs = logger_attrs,
+};
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
+	int cpu;
+
+	log->buffer = vmalloc_user(log->size);
+	if (unlikely(!log->buffer))
+		return -ENOMEM;
+
+	log->cpu_bufs = alloc_percpu(struct logger_cpu_buf);
+	if (unlikely(!log->cpu_bufs)) {
+		vfree(log->buffer);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct logger_cpu_buf *cpu_buf = per_cpu_ptr(log->cpu_bufs, cpu);
+
+		mutex_init(&cpu_buf->mutex);
+		cpu_buf->buffer = kmalloc(LOGGER_CPU_BUF_SIZE, GFP_KERNEL);
+		if (unlikely(!cpu_buf->buffer)) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+	}
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
-		return ret;
+		goto err_free;
 	}
 
+	if (sysfs_create_group(&log->misc.this_device->kobj, &logger_attr_group))
+		printk(KERN_WARNING "logger: failed to create sysfs "
+		       "attributes for log '%s'\n", log->misc.name);
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
 	return 0;
+
+err_free:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(log->cpu_bufs, cpu)->buffer);
+	free_percpu(log->cpu_bufs);
+	vfree(log->buffer);
+	return ret;
 }
 
 static int __init logger_init(void)
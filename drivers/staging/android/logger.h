@@ -51,6 +51,15 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The part of the ring an mmap reader may parse, as returned by
+ * LOGGER_GET_MMAP_WINDOW. Entries there are always struct logger_entry.
+ */
+struct logger_mmap_window {
+	__u32		off;		/* ring offset of the first entry */
+	__u32		len;		/* bytes of whole entries from 'off' */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +75,8 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_GET_MMAP_WINDOW		_IO(__LOGGERIO, 7) /* mmap read window */
+#define LOGGER_MMAP_CONSUME		_IO(__LOGGERIO, 8) /* mmap read done */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 9) /* resize log */
 
 #endif /* _LINUX_LOGGER_H */
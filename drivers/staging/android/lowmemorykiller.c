@@ -16,6 +16,20 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Rather than walking the task list from reclaim, the driver keeps an index
+ * of processes bucketed by oom_adj, updated on fork, exit and oom_adj writes.
+ * A victim is picked from the highest non-empty bucket, comparing only the
+ * RSS of the processes in it.
+ *
+ * The shrinker itself never kills: it only wakes a kill thread, so reclaim
+ * is not held up while a victim exits. Apart from the lowest (most critical)
+ * level, the thread only kills while reclaim is failing, i.e. when the share
+ * of scanned pages that could not be reclaimed is at least "pressure" percent.
+ * Free swap (e.g. zram) means reclaim still has room, so "swap_weight"
+ * percent of the free swap percentage is taken off that pressure. Once a
+ * level is entered it is only left when free memory rises "hysteresis"
+ * percent above its minfree, to avoid kill storms around a threshold.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -31,11 +45,21 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
+#include <linux/rculist.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/wait.h>
 #include <linux/notifier.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
+
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
 	0,
@@ -51,9 +75,16 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static uint32_t lowmem_pressure = 60;
+static uint32_t lowmem_swap_weight = 50;
+static uint32_t lowmem_hysteresis = 10;
 
 static struct task_struct *lowmem_deathpending;
-static unsigned long lowmem_deathpending_timeout;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_death_wait);
+
+static struct task_struct *lowmem_thread;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);
+static int lowmem_kick;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -73,38 +104,349 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
 
-	if (task == lowmem_deathpending)
+	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
+		wake_up(&lowmem_death_wait);
+	}
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Index of killable processes. Each process has one entry, found by its
+ * signal_struct through lowmem_proc_hash and linked on the list of its
+ * oom_adj. Updates are serialized by lowmem_index_lock; the shrinker
+ * walks the oom_adj lists under RCU. An entry never moves between lists,
+ * it is replaced instead so that readers cannot stray onto another list.
+ */
+#define LOWMEM_ADJ_LISTS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	6
+
+struct lowmem_proc {
+	struct list_head adj_node;	/* in lowmem_adj_list[], RCU */
+	struct hlist_node hash_node;	/* in lowmem_proc_hash[] */
+	struct signal_struct *sig;	/* lookup key only */
+	struct pid *pid;		/* tgid, follows the group leader */
+	int oom_adj;
+	struct rcu_head rcu;
+};
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_adj_list[LOWMEM_ADJ_LISTS];
+static struct hlist_head lowmem_proc_hash[1 << LOWMEM_HASH_BITS];
+
+static struct hlist_head *lowmem_proc_bucket(struct signal_struct *sig)
+{
+	return &lowmem_proc_hash[hash_ptr(sig, LOWMEM_HASH_BITS)];
+}
+
+static struct lowmem_proc *lowmem_proc_find(struct signal_struct *sig)
+{
+	struct lowmem_proc *proc;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(proc, node, lowmem_proc_bucket(sig), hash_node)
+		if (proc->sig == sig)
+			return proc;
+
+	return NULL;
+}
+
+static void lowmem_proc_free_rcu(struct rcu_head *rcu)
+{
+	struct lowmem_proc *proc = container_of(rcu, struct lowmem_proc, rcu);
+
+	put_pid(proc->pid);
+	kfree(proc);
+}
+
+static void lowmem_proc_del(struct lowmem_proc *proc)
+{
+	list_del_rcu(&proc->adj_node);
+	hlist_del(&proc->hash_node);
+	call_rcu(&proc->rcu, lowmem_proc_free_rcu);
+}
+
+/*
+ * Add @task's process to the index, or move it to the list of its
+ * current oom_adj. Kernel threads and exiting processes are left out.
+ */
+static void lowmem_index_update(struct task_struct *task, gfp_t gfp)
+{
+	struct signal_struct *sig = task->signal;
+	struct lowmem_proc *proc, *old;
+	int oom_adj;
+
+	if (task->flags & PF_KTHREAD)
+		return;
+
+	proc = kmalloc(sizeof(*proc), gfp);
+	if (!proc)
+		return;
+
+	spin_lock(&lowmem_index_lock);
+	old = lowmem_proc_find(sig);
+	oom_adj = sig->oom_adj;
+
+	if (!atomic_read(&sig->live) || (old && old->oom_adj == oom_adj)) {
+		spin_unlock(&lowmem_index_lock);
+		kfree(proc);
+		return;
+	}
+
+	proc->sig = sig;
+	proc->pid = get_pid(task_tgid(task));
+	proc->oom_adj = oom_adj;
+	if (old)
+		lowmem_proc_del(old);
+	hlist_add_head(&proc->hash_node, lowmem_proc_bucket(sig));
+	list_add_tail_rcu(&proc->adj_node,
+			  &lowmem_adj_list[oom_adj - OOM_DISABLE]);
+	spin_unlock(&lowmem_index_lock);
+}
+
+static void lowmem_index_remove(struct task_struct *task)
+{
+	struct lowmem_proc *proc;
+
+	spin_lock(&lowmem_index_lock);
+	proc = lowmem_proc_find(task->signal);
+	if (proc)
+		lowmem_proc_del(proc);
+	spin_unlock(&lowmem_index_lock);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+
+	if (val == OOM_ADJ_EXIT)
+		lowmem_index_remove(task);
+	else
+		lowmem_index_update(task, GFP_KERNEL);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static void lowmem_index_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_LISTS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_list[i]);
+
+	/* Processes forked from here on are added by the notifier */
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_index_update(p, GFP_ATOMIC);
+	read_unlock(&tasklist_lock);
+}
+
+static void lowmem_index_exit(void)
+{
+	struct lowmem_proc *proc, *tmp;
+	int i;
+
+	unregister_oom_adj_notifier(&oom_adj_nb);
+
+	spin_lock(&lowmem_index_lock);
+	for (i = 0; i < LOWMEM_ADJ_LISTS; i++)
+		list_for_each_entry_safe(proc, tmp, &lowmem_adj_list[i],
+					 adj_node)
+			lowmem_proc_del(proc);
+	spin_unlock(&lowmem_index_lock);
+
+	rcu_barrier();
+}
+
+/*
+ * Return the most critical level whose thresholds are crossed, or the level
+ * entered before as long as free memory is within the hysteresis margin of
+ * it, or -1.
+ */
+static int lowmem_level(int other_free, int other_file)
+{
+	static int level = -1;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	size_t minfree;
+	int i;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			level = i;
+			return level;
+		}
+	}
+
+	if (level >= 0 && level < array_size) {
+		minfree = lowmem_minfree[level] * (100 + lowmem_hysteresis) / 100;
+		if (other_free < minfree && other_file < minfree)
+			return level;
+	}
+
+	level = -1;
+	return level;
+}
+
+/*
+ * Percentage of the pages scanned by vmscan since the last call that could
+ * not be reclaimed, discounted by the free swap reclaim can still use.
+ */
+static int lowmem_reclaim_pressure(void)
+{
+	static unsigned long events[NR_VM_EVENT_ITEMS];
+	static unsigned long last_scanned, last_reclaimed;
+	unsigned long scanned = 0, reclaimed = 0, ds, dr;
+	int pressure = 0, swap_free = 0;
+	int i;
+
+	all_vm_events(events);
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + i] +
+			   events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + i];
+		reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + i];
+	}
+
+	ds = scanned - last_scanned;
+	dr = reclaimed - last_reclaimed;
+	last_scanned = scanned;
+	last_reclaimed = reclaimed;
+
+	if (ds && dr < ds)
+		pressure = (ds - dr) * 100 / ds;
+	if (total_swap_pages > 0)
+		swap_free = nr_swap_pages * 100 / total_swap_pages;
+
+	return pressure * (100 - swap_free * lowmem_swap_weight / 100) / 100;
+}
+
+/*
+ * Send SIGKILL to the largest process of the highest oom_adj >= min_adj.
+ * Returns the victim, which is only good for comparing pointers, or NULL.
+ */
+static struct task_struct *lowmem_kill(int min_adj)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int adj;
+	u64 start;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = min_adj;
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	start = local_clock();
+	rcu_read_lock();
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		struct lowmem_proc *proc;
+
+		list_for_each_entry_rcu(proc,
+				&lowmem_adj_list[adj - OOM_DISABLE], adj_node) {
+			struct task_struct *t;
+
+			p = pid_task(proc->pid, PIDTYPE_PID);
+			if (!p)
+				continue;
+			t = find_lock_task_mm(p);
+			if (!t)
+				continue;
+			tasksize = get_mm_rss(t->mm);
+			task_unlock(t);
+			if (tasksize <= 0)
+				continue;
+			if (selected && tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, adj, tasksize);
+		}
+	}
+	if (selected) {
+		trace_lowmem_select(min_adj, selected->pid, selected_oom_adj,
+				    selected_tasksize, local_clock() - start);
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize);
+		lowmem_deathpending = selected;
+		force_sig(SIGKILL, selected);
+	}
+	rcu_read_unlock();
+
+	return selected;
+}
+
+static int lowmem_thread_fn(void *data)
+{
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_wait,
+				lowmem_kick || kthread_should_stop());
+		lowmem_kick = 0;
+
+		for (;;) {
+			int level, pressure;
+			int other_free = global_page_state(NR_FREE_PAGES);
+			int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+			level = lowmem_level(other_free, other_file);
+			if (level < 0)
+				break;
+
+			pressure = lowmem_reclaim_pressure();
+			lowmem_print(3, "lowmem_thread ofree %d %d, level %d, "
+				     "pressure %d\n", other_free, other_file,
+				     level, pressure);
+			if (level > 0 && pressure < lowmem_pressure)
+				break;
+
+			if (!lowmem_kill(lowmem_adj[level]))
+				break;
+
+			/*
+			 * Give the victim up to a second to free its memory
+			 * before considering another kill.
+			 */
+			wait_event_timeout(lowmem_death_wait,
+					   !lowmem_deathpending, HZ);
+			if (kthread_should_stop())
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Called from reclaim: only report how much could be reclaimed and kick the
+ * kill thread when a threshold is crossed.
+ */
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem;
+	int min_adj = OOM_ADJUST_MAX + 1;
+	int i;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
-
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
@@ -124,60 +466,12 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
 		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
-	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	if (sc->nr_to_scan > 0 && min_adj != OOM_ADJUST_MAX + 1) {
+		lowmem_kick = 1;
+		wake_up(&lowmem_wait);
 	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
-	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
+	lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -189,6 +483,13 @@ static struct shrinker lowmem_shrinker = {
 static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
+	lowmem_index_init();
+	lowmem_thread = kthread_run(lowmem_thread_fn, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_thread)) {
+		lowmem_index_exit();
+		task_free_unregister(&task_nb);
+		return PTR_ERR(lowmem_thread);
+	}
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -196,6 +497,8 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	kthread_stop(lowmem_thread);
+	lowmem_index_exit();
 	task_free_unregister(&task_nb);
 }
 
@@ -204,6 +507,9 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure, uint, S_IRUGO | S_IWUSR);
+module_param_named(swap_weight, lowmem_swap_weight, uint, S_IRUGO | S_IWUSR);
+module_param_named(hysteresis, lowmem_hysteresis, uint, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
@@ -0,0 +1,170 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/crypto.h>
+#include <linux/lzo.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_comp.h"
+
+/*
+ * LZO is called directly (no crypto tfm indirection) since it is
+ * the default and the fastest codec we have.
+ */
+static int zram_lzo_init(struct zram_comp_strm *strm, const char *alg)
+{
+	strm->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	if (!strm->workmem)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void zram_lzo_exit(struct zram_comp_strm *strm)
+{
+	kfree(strm->workmem);
+	strm->workmem = NULL;
+}
+
+static int zram_lzo_compress(struct zram_comp_strm *strm,
+		const unsigned char *src, unsigned char *dst, size_t *dst_len)
+{
+	int ret;
+
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, strm->workmem);
+	return ret == LZO_E_OK ? 0 : -EINVAL;
+}
+
+static int zram_lzo_decompress(struct zram_comp_strm *strm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	int ret;
+	size_t dst_len = PAGE_SIZE;
+
+	ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+	return ret == LZO_E_OK ? 0 : -EINVAL;
+}
+
+static const struct zram_backend zram_lzo_backend = {
+	.name = "lzo",
+	.init = zram_lzo_init,
+	.exit = zram_lzo_exit,
+	.compress = zram_lzo_compress,
+	.decompress = zram_lzo_decompress,
+};
+
+/*
+ * Any other algorithm goes through the crypto API, e.g. "deflate"
+ * which is backed by lib/zlib_deflate and lib/zlib_inflate.
+ */
+static int zram_crypto_init(struct zram_comp_strm *strm, const char *alg)
+{
+	strm->tfm = crypto_alloc_comp(alg, 0, 0);
+	if (IS_ERR(strm->tfm)) {
+		int ret = PTR_ERR(strm->tfm);
+
+		strm->tfm = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void zram_crypto_exit(struct zram_comp_strm *strm)
+{
+	if (strm->tfm)
+		crypto_free_comp(strm->tfm);
+	strm->tfm = NULL;
+}
+
+static int zram_crypto_compress(struct zram_comp_strm *strm,
+		const unsigned char *src, unsigned char *dst, size_t *dst_len)
+{
+	int ret;
+	unsigned int len = 2 * PAGE_SIZE;
+
+	ret = crypto_comp_compress(strm->tfm, src, PAGE_SIZE, dst, &len);
+	*dst_len = len;
+	return ret;
+}
+
+static int zram_crypto_decompress(struct zram_comp_strm *strm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	int ret;
+	unsigned int len = PAGE_SIZE;
+
+	ret = crypto_comp_decompress(strm->tfm, src, src_len, dst, &len);
+	if (!ret && len != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+static const struct zram_backend zram_crypto_backend = {
+	.name = "crypto",
+	.init = zram_crypto_init,
+	.exit = zram_crypto_exit,
+	.compress = zram_crypto_compress,
+	.decompress = zram_crypto_decompress,
+};
+
+/* Algorithms advertised in the comp_algorithm sysfs node */
+static const char * const zram_comp_names[] = {
+	"lzo",
+	"deflate",
+};
+
+/*
+ * Returns the backend for the given algorithm name or NULL if it
+ * is not available in this kernel.
+ */
+const struct zram_backend *zram_comp_find(const char *alg)
+{
+	if (!strcmp(alg, zram_lzo_backend.name))
+		return &zram_lzo_backend;
+
+	if (crypto_has_comp(alg, 0, 0))
+		return &zram_crypto_backend;
+
+	return NULL;
+}
+
+ssize_t zram_comp_available_show(const char *cur, char *buf)
+{
+	int i, listed = 0;
+	ssize_t sz = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zram_comp_names); i++) {
+		if (!strcmp(cur, zram_comp_names[i])) {
+			sz += sprintf(buf + sz, "[%s] ", zram_comp_names[i]);
+			listed = 1;
+		} else if (zram_comp_find(zram_comp_names[i])) {
+			sz += sprintf(buf + sz, "%s ", zram_comp_names[i]);
+		}
+	}
+
+	/* Algorithm set by name which we do not list above */
+	if (!listed)
+		sz += sprintf(buf + sz, "[%s] ", cur);
+
+	if (sz)
+		buf[sz - 1] = '\n';
+
+	return sz;
+}
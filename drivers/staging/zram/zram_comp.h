@@ -0,0 +1,48 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/crypto.h>
+
+/* Used if no algorithm was selected through sysfs */
+#define ZRAM_DEFAULT_COMPRESSOR	"lzo"
+
+/* Per-CPU compression workspace */
+struct zram_comp_strm {
+	void *workmem;		/* backend private working memory */
+	void *buffer;		/* compressed output, 2 pages */
+	struct crypto_comp *tfm;	/* crypto API backends only */
+};
+
+/*
+ * Compression backend. All callbacks except init/exit are called with
+ * preemption disabled and must not sleep.
+ */
+struct zram_backend {
+	const char *name;
+	int (*init)(struct zram_comp_strm *strm, const char *alg);
+	void (*exit)(struct zram_comp_strm *strm);
+	int (*compress)(struct zram_comp_strm *strm, const unsigned char *src,
+			unsigned char *dst, size_t *dst_len);
+	int (*decompress)(struct zram_comp_strm *strm,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+};
+
+const struct zram_backend *zram_comp_find(const char *alg);
+ssize_t zram_comp_available_show(const char *cur, char *buf);
+
+#endif
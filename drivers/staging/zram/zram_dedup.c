@@ -0,0 +1,149 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+/*
+ * Deduplication of identical pages. Each compressed object is described
+ * by a zram_entry, indexed by a checksum of the uncompressed page. A write
+ * whose checksum matches a stored entry is compared against its contents,
+ * and on a match the table slot just takes a reference on that entry.
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+u32 zram_dedup_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/* Called with dedup_lock held; strm->buffer is used as scratch space */
+static int zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			struct zram_comp_strm *strm, void *mem)
+{
+	int ret;
+	unsigned char *cmem;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = zram->backend->decompress(strm, cmem, entry->len, strm->buffer);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return !ret && !memcmp(strm->buffer, mem, PAGE_SIZE);
+}
+
+/*
+ * Look for a stored page identical to @mem. On success a reference
+ * is taken on the returned entry.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+		struct zram_comp_strm *strm, void *mem, u32 checksum)
+{
+	struct rb_node *node;
+	struct zram_entry *entry;
+
+	spin_lock(&zram->dedup_lock);
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		entry = rb_entry(node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		node = checksum < entry->checksum ?
+			node->rb_left : node->rb_right;
+	}
+
+	if (!node)
+		goto out;
+
+	/* Rewind to the first entry with this checksum */
+	while (rb_prev(node)) {
+		entry = rb_entry(rb_prev(node), struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		node = rb_prev(node);
+	}
+
+	for (; node; node = rb_next(node)) {
+		entry = rb_entry(node, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		if (zram_dedup_match(zram, entry, strm, mem)) {
+			entry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+
+out:
+	spin_unlock(&zram->dedup_lock);
+	return NULL;
+}
+
+/* Index a newly stored object, with a single reference */
+struct zram_entry *zram_dedup_new(struct zram *zram, unsigned long handle,
+		u32 len, u32 checksum)
+{
+	struct rb_node **p, *parent = NULL;
+	struct zram_entry *entry, *tmp;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->handle = handle;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	p = &zram->dedup_root.rb_node;
+	while (*p) {
+		parent = *p;
+		tmp = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < tmp->checksum)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference, freeing the object with the last one. Returns the
+ * no. of references left.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	int refcount;
+
+	spin_lock(&zram->dedup_lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		rb_erase(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	if (!refcount) {
+		zs_free(zram->mem_pool, entry->handle);
+		kfree(entry);
+	}
+
+	return refcount;
+}
@@ -25,13 +25,16 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -89,21 +92,65 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * zram->lock is only held across table lookups/updates and decompression;
+ * account the times we had to spin for it.
+ */
+static void zram_read_lock(struct zram *zram)
+{
+	if (unlikely(!read_trylock(&zram->lock))) {
+		zram_stat64_inc(zram, &zram->stats.lock_contended);
+		read_lock(&zram->lock);
+	}
+}
+
+static void zram_write_lock(struct zram *zram)
+{
+	if (unlikely(!write_trylock(&zram->lock))) {
+		zram_stat64_inc(zram, &zram->stats.lock_contended);
+		write_lock(&zram->lock);
+	}
+}
+
+static void zram_lat_account(struct zram_lat_hist *hist, u64 start)
+{
+	u64 us = (local_clock() - start) >> 10;
+	int idx = us ? fls64(us) : 0;
+
+	atomic_inc(&hist->bucket[min(idx, ZRAM_LAT_BUCKETS - 1)]);
+}
+
+/*
+ * Check if the page is filled with a single repeated word. That word
+ * is all we need to store for it; zero pages are the common case.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+/* zsmalloc handle of a compressed page */
+static unsigned long zram_obj_handle(struct zram *zram, u32 index)
+{
+	unsigned long handle = zram->table[index].handle;
+
+	if (zram->use_dedup)
+		return ((struct zram_entry *)handle)->handle;
+
+	return handle;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,15 +180,145 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Block 0 of the backing device is never handed out so that 0 can
+ * mean "no space left".
+ */
+static unsigned long zram_bdev_alloc(struct zram *zram)
+{
+	unsigned long blk;
+
+	do {
+		blk = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+		if (blk >= zram->nr_pages)
+			return 0;
+	} while (test_and_set_bit(blk, zram->bitmap));
+
+	return blk;
+}
+
+static void zram_bdev_free(struct zram *zram, unsigned long blk)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk, zram->bitmap));
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	struct completion *done = bio->bi_private;
+
+	complete(done);
+}
+
+static int zram_bdev_rw_page(struct zram *zram, unsigned long blk,
+				struct page *page, int rw)
+{
+	int ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long blk;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bdev_read_fn(struct work_struct *work)
+{
+	struct zram_bdev_read_work *rw =
+		container_of(work, struct zram_bdev_read_work, work);
+
+	rw->ret = zram_bdev_rw_page(rw->zram, rw->blk, rw->page, READ);
+}
+
+/*
+ * We are called from make_request, where bios submitted by this task
+ * are only dispatched after we return. Waiting for one here would
+ * deadlock, so the read is issued from a worker instead.
+ *
+ * The slot lock is not held across the read: swap never reads a slot
+ * it is freeing, so the block cannot be reused underneath us.
+ */
+static int zram_bdev_read(struct zram *zram, unsigned long blk,
+				struct page *page)
+{
+	struct zram_bdev_read_work rw;
+
+	rw.zram = zram;
+	rw.blk = blk;
+	rw.page = page;
+
+	INIT_WORK_ONSTACK(&rw.work, zram_bdev_read_fn);
+	queue_work(system_unbound_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	if (!rw.ret)
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return rw.ret;
+}
+#else
+static void zram_bdev_free(struct zram *zram, unsigned long blk)
+{
+}
+
+static int zram_bdev_read(struct zram *zram, unsigned long blk,
+				struct page *page)
+{
+	return -EIO;
+}
+#endif
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+
+	/* Let a writeback in progress know the slot has changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	/* Handle is the block no. of a page on the backing device */
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_bdev_free(zram, handle);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Handle holds the fill value of a same-filled page */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -155,26 +332,32 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	if (zram->use_dedup) {
+		/* Memory is only released with the last reference */
+		if (zram_dedup_put(zram, (struct zram_entry *)handle)) {
+			zram_stat_dec(&zram->stats.pages_dup);
+			clen = 0;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
+
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -188,20 +371,93 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct page *page, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
+/*
+ * Fill @page with the contents of a slot held in memory.
+ * Called with zram->lock held.
+ */
+static int zram_read_page(struct zram *zram, u32 index, struct page *page)
+{
+	int ret;
+	u64 start;
+	unsigned long handle;
+	struct zram_comp_strm *strm;
+	unsigned char *user_mem, *cmem;
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		handle_zero_page(page);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(page, zram->table[index].handle);
+		return 0;
+	}
+
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		pr_debug("Read before write: page=%u\n", index);
+		handle_zero_page(page);
+		return 0;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	strm = get_cpu_ptr(zram->comp_strm);
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	handle = zram_obj_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+
+	start = local_clock();
+	ret = zram->backend->decompress(strm, cmem,
+		zram->table[index].size, user_mem);
+	zram_lat_account(&zram->stats.decompr_lat, start);
+
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+	put_cpu_ptr(zram->comp_strm);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret;
+	}
 
 	flush_dcache_page(page);
+	return 0;
 }
 
 static void zram_read(struct zram *zram, struct bio *bio)
@@ -216,58 +472,32 @@ static void zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
+		zram_read_lock(zram);
+
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long blk = zram->table[index].handle;
+
+			read_unlock(&zram->lock);
+			ret = zram_bdev_read(zram, blk, page);
+		} else {
+			/*
+			 * Readers only ever clear this bit, so doing it
+			 * under the read lock is safe.
+			 */
+			zram_clear_flag(zram, index, ZRAM_IDLE);
+			ret = zram_read_page(zram, index, page);
+			read_unlock(&zram->lock);
 		}
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
-
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
-
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
-
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+		if (unlikely(ret)) {
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
 
-		flush_dcache_page(page);
 		index++;
 	}
 
@@ -279,6 +509,298 @@ out:
 	bio_io_error(bio);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+#define ZRAM_WB_BATCH	32
+
+struct zram_wb_ctl {
+	atomic_t pending;
+	struct completion done;
+};
+
+struct zram_wb_req {
+	struct bio *bio;
+	u32 index;
+	unsigned long blk;
+};
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_ctl *ctl = bio->bi_private;
+
+	if (atomic_dec_and_test(&ctl->pending))
+		complete(&ctl->done);
+}
+
+static int zram_wb_eligible(struct zram *zram, u32 index, int idle_only)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_ZERO) ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if (idle_only)
+		return zram_test_flag(zram, index, ZRAM_IDLE);
+
+	return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+}
+
+/*
+ * Once the write completes, the slot is switched over to the backing
+ * device unless it was freed or rewritten in the meantime, which
+ * zram_free_page() signals by clearing ZRAM_UNDER_WB.
+ */
+static int zram_wb_complete(struct zram *zram, struct zram_wb_req *req)
+{
+	int ret = 0;
+	u32 index = req->index;
+
+	zram_write_lock(zram);
+	if (!test_bit(BIO_UPTODATE, &req->bio->bi_flags)) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		zram_bdev_free(zram, req->blk);
+		ret = -EIO;
+	} else if (zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].handle = req->blk;
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat_inc(&zram->stats.pages_stored);
+	} else {
+		zram_bdev_free(zram, req->blk);
+	}
+	write_unlock(&zram->lock);
+
+	if (!ret)
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+	__free_page(req->bio->bi_io_vec[0].bv_page);
+	bio_put(req->bio);
+	return ret;
+}
+
+/*
+ * Write incompressible pages (or, with @idle_only, pages not accessed
+ * since the last zram_mark_idle()) out to the backing device. Pages
+ * are copied out under the table lock and then written in batches of
+ * ZRAM_WB_BATCH asynchronous bios.
+ */
+int zram_writeback(struct zram *zram, int idle_only)
+{
+	int ret = 0, err = 0, n, i;
+	u32 index = 0, nr;
+	struct zram_wb_ctl ctl;
+	struct zram_wb_req *reqs;
+	struct page *page = NULL;
+	struct bio *bio = NULL;
+
+	reqs = kmalloc(ZRAM_WB_BATCH * sizeof(*reqs), GFP_KERNEL);
+	if (!reqs)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	nr = zram->disksize >> PAGE_SHIFT;
+	while (index < nr && !err) {
+		n = 0;
+		while (index < nr && n < ZRAM_WB_BATCH) {
+			unsigned long blk;
+			u32 cur = index++;
+
+			/* Skipped slots hand their page and bio to the next */
+			if (!page)
+				page = alloc_page(GFP_KERNEL);
+			if (!bio)
+				bio = bio_alloc(GFP_KERNEL, 1);
+			if (!page || !bio) {
+				err = -ENOMEM;
+				break;
+			}
+
+			zram_write_lock(zram);
+			if (!zram_wb_eligible(zram, cur, idle_only) ||
+			    zram_read_page(zram, cur, page)) {
+				write_unlock(&zram->lock);
+				cond_resched();
+				continue;
+			}
+			zram_set_flag(zram, cur, ZRAM_UNDER_WB);
+			write_unlock(&zram->lock);
+
+			blk = zram_bdev_alloc(zram);
+			if (!blk) {
+				zram_write_lock(zram);
+				zram_clear_flag(zram, cur, ZRAM_UNDER_WB);
+				write_unlock(&zram->lock);
+				err = -ENOSPC;
+				break;
+			}
+
+			bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+			bio->bi_bdev = zram->bdev;
+			bio->bi_end_io = zram_wb_end_io;
+			bio->bi_private = &ctl;
+			bio_add_page(bio, page, PAGE_SIZE, 0);
+
+			reqs[n].bio = bio;
+			reqs[n].index = cur;
+			reqs[n].blk = blk;
+			n++;
+			page = NULL;
+			bio = NULL;
+		}
+
+		if (!n)
+			continue;
+
+		atomic_set(&ctl.pending, n);
+		init_completion(&ctl.done);
+		for (i = 0; i < n; i++)
+			submit_bio(WRITE, reqs[i].bio);
+		wait_for_completion(&ctl.done);
+
+		for (i = 0; i < n; i++) {
+			if (zram_wb_complete(zram, &reqs[i]) && !err)
+				err = -EIO;
+		}
+
+		cond_resched();
+	}
+	ret = err;
+
+out:
+	mutex_unlock(&zram->init_lock);
+	if (page)
+		__free_page(page);
+	if (bio)
+		bio_put(bio);
+	kfree(reqs);
+	return ret;
+}
+
+/*
+ * Mark every page held in memory as idle. Reads and writes clear the
+ * mark, so a later idle writeback only picks pages untouched since.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	u32 index, nr;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	nr = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr; index++) {
+		zram_write_lock(zram);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		write_unlock(&zram->lock);
+	}
+
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Called with zram->init_lock held, before the device is initialized.
+ * A @path of "none" detaches the current backing device.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	unsigned long nr_pages, *bitmap;
+	struct file *filp;
+	struct inode *inode;
+	struct block_device *bdev;
+
+	if (!strcmp(path, "none")) {
+		zram_reset_bdev(zram);
+		return 0;
+	}
+
+	filp = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(filp)) {
+		pr_err("Error opening backing device %s\n", path);
+		return PTR_ERR(filp);
+	}
+
+	inode = filp->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out_close;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	zram_reset_bdev(zram);
+
+	zram->backing_dev = filp;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+
+	pr_info("Using %s as backing device: %lu pages\n", path, nr_pages);
+	return 0;
+
+out_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out_close:
+	filp_close(filp, NULL);
+	return ret;
+}
+#else
+static void zram_reset_bdev(struct zram *zram)
+{
+}
+#endif
+
+/*
+ * Compression is done outside of zram->lock using this CPU's workspace,
+ * so concurrent writers only serialize on the short table update at the
+ * end. The per-CPU stream pins us to the CPU, hence the object is first
+ * allocated without sleeping; if that fails we drop the stream, allocate
+ * with GFP_NOIO and compress again.
+ *
+ * With dedup enabled, a page identical to one already stored just takes
+ * a reference on the existing object and skips compression.
+ */
 static void zram_write(struct zram *zram, struct bio *bio)
 {
 	int i;
@@ -289,43 +811,69 @@ static void zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
+		int ret, uncompressed = 0, dup = 0, checked = 0;
+		u64 start;
+		u32 alloc_size = 0, checksum = 0;
 		size_t clen;
-		struct zobj_header *zheader;
+		unsigned long element, handle = 0;
+		struct zram_entry *entry;
+		struct zram_comp_strm *strm;
 		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
+		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_write_lock(zram);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			zram_free_page(zram, index);
+			if (!element) {
+				zram_stat_inc(&zram->stats.pages_zero);
+				zram_set_flag(zram, index, ZRAM_ZERO);
+			} else {
+				zram_stat_inc(&zram->stats.pages_same);
+				zram_set_flag(zram, index, ZRAM_SAME);
+				zram->table[index].handle = element;
+			}
+			write_unlock(&zram->lock);
 			index++;
 			continue;
 		}
+		kunmap_atomic(user_mem, KM_USER0);
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+compress_again:
+		strm = get_cpu_ptr(zram->comp_strm);
+		user_mem = kmap_atomic(page, KM_USER0);
 
+		if (zram->use_dedup && !checked) {
+			checked = 1;
+			checksum = zram_dedup_checksum(user_mem);
+			entry = zram_dedup_find(zram, strm, user_mem, checksum);
+			if (entry) {
+				kunmap_atomic(user_mem, KM_USER0);
+				put_cpu_ptr(zram->comp_strm);
+				zram_stat64_inc(zram, &zram->stats.dedup_hits);
+				handle = (unsigned long)entry;
+				clen = entry->len;
+				dup = 1;
+				goto store;
+			}
+		}
+
+		start = local_clock();
+		ret = zram->backend->compress(strm, user_mem, strm->buffer,
+					&clen);
+		zram_lat_account(&zram->stats.compr_lat, start);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			put_cpu_ptr(zram->comp_strm);
+			zs_free(zram->mem_pool, handle);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -337,10 +885,12 @@ static void zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			put_cpu_ptr(zram->comp_strm);
+			zs_free(zram->mem_pool, handle);
+
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -348,52 +898,88 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+			user_mem = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, user_mem, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(user_mem, KM_USER0);
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			handle = (unsigned long)page_store;
+			uncompressed = 1;
+			goto store;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		/* The page may have changed if we had to compress again */
+		if (handle && alloc_size < clen) {
+			zs_free(zram->mem_pool, handle);
+			handle = 0;
+		}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		if (!handle) {
+			alloc_size = clen;
+			handle = zs_malloc(zram->mem_pool, alloc_size,
+					GFP_NOWAIT | __GFP_HIGHMEM |
+					__GFP_NOWARN);
+			if (!handle) {
+				put_cpu_ptr(zram->comp_strm);
+				handle = zs_malloc(zram->mem_pool, alloc_size,
+						GFP_NOIO | __GFP_HIGHMEM);
+				if (!handle) {
+					pr_info("Error allocating memory for "
+						"compressed page: %u, "
+						"size=%zu\n", index, clen);
+					zram_stat64_inc(zram,
+						&zram->stats.failed_writes);
+					goto out;
+				}
+				goto compress_again;
+			}
+		}
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, strm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		put_cpu_ptr(zram->comp_strm);
+
+		if (zram->use_dedup) {
+			entry = zram_dedup_new(zram, handle, clen, checksum);
+			if (unlikely(!entry)) {
+				zs_free(zram->mem_pool, handle);
+				pr_info("Error allocating dedup entry for "
+					"page: %u\n", index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
+			handle = (unsigned long)entry;
 		}
-#endif
 
-		memcpy(cmem, src, clen);
+store:
+		zram_write_lock(zram);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
+
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+		if (unlikely(uncompressed)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		}
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		if (dup)
+			zram_stat_inc(&zram->stats.pages_dup);
+		else
+			zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		write_unlock(&zram->lock);
 		index++;
 	}
 
@@ -453,6 +1039,76 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+/* Tear down the streams of all possible cpus before @last (all if -1) */
+static void __zram_free_comp_strm(struct zram *zram, int last)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_strm *strm = per_cpu_ptr(zram->comp_strm, cpu);
+
+		if (cpu == last)
+			break;
+		zram->backend->exit(strm);
+		free_pages((unsigned long)strm->buffer, 1);
+	}
+
+	free_percpu(zram->comp_strm);
+	zram->comp_strm = NULL;
+	zram->backend = NULL;
+}
+
+static void zram_free_comp_strm(struct zram *zram)
+{
+	if (!zram->comp_strm)
+		return;
+
+	__zram_free_comp_strm(zram, -1);
+}
+
+static int zram_alloc_comp_strm(struct zram *zram)
+{
+	int cpu, ret;
+
+	zram->backend = zram_comp_find(zram->compressor);
+	if (!zram->backend) {
+		pr_err("Compression algorithm %s not available\n",
+			zram->compressor);
+		return -EINVAL;
+	}
+
+	zram->comp_strm = alloc_percpu(struct zram_comp_strm);
+	if (!zram->comp_strm) {
+		pr_err("Error allocating per-cpu compression streams\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_strm *strm = per_cpu_ptr(zram->comp_strm, cpu);
+
+		ret = zram->backend->init(strm, zram->compressor);
+		if (ret) {
+			pr_err("Error allocating compressor working memory!\n");
+			goto fail;
+		}
+
+		strm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!strm->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			zram->backend->exit(strm);
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	/* Only the streams of the cpus before this one were set up */
+	__zram_free_comp_strm(zram, cpu);
+	return ret;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -461,35 +1117,21 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_comp_strm(zram);
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_reset_bdev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -511,17 +1153,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_comp_strm(zram);
+	if (ret) {
+		/* To prevent accessing table entries during cleanup */
+		zram->disksize = 0;
 		goto fail;
 	}
 
@@ -540,7 +1175,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -566,7 +1201,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_write_lock(zram);
 	zram_free_page(zram, index);
+	write_unlock(&zram->lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,7 +1216,11 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
+	rwlock_init(&zram->lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_root = RB_ROOT;
+	strlcpy(zram->compressor, ZRAM_DEFAULT_COMPRESSOR,
+		sizeof(zram->compressor));
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
 
@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,8 +42,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,19 +62,55 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is filled with a single word, stored in table.handle */
+	ZRAM_SAME,
+
+	/* Page lives on the backing device, table.handle is its block no. */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since the last "idle" marking */
+	ZRAM_IDLE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/*
+ * Compress/decompress latency histogram buckets: bucket 0 counts
+ * calls under 1us, bucket i counts [2^(i-1), 2^i) us and the last
+ * one everything slower.
+ */
+#define ZRAM_LAT_BUCKETS	12
+
 /*-- Data structures */
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;	/* zsmalloc handle (struct zram_entry *
+				 * with dedup), struct page * if
+				 * ZRAM_UNCOMPRESSED, fill word if
+				 * ZRAM_SAME, backing device block if
+				 * ZRAM_WB */
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/* Compressed object shared by identical pages (dedup only) */
+struct zram_entry {
+	struct rb_node rb_node;		/* in zram->dedup_root */
+	u32 checksum;			/* of the uncompressed page */
+	u32 len;			/* compressed size */
+	unsigned long handle;		/* zsmalloc handle */
+	int refcount;			/* no. of table entries using it */
+};
+
+struct zram_lat_hist {
+	atomic_t bucket[ZRAM_LAT_BUCKETS];
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -92,23 +119,45 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 lock_contended;	/* no. of times table lock was contended */
+	u64 dedup_hits;		/* no. of writes matching a stored page */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written to backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other single-value filled pages */
+	u32 pages_dup;		/* no. of pages sharing another's object */
+	u32 pages_wb;		/* no. of pages on the backing device */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	struct zram_lat_hist compr_lat;		/* compression latency */
+	struct zram_lat_hist decompr_lat;	/* decompression latency */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_comp_strm __percpu *comp_strm;
+	const struct zram_backend *backend;
+	/* Algorithm name, can only be changed before init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t lock;		/* protect table entries and 32-bit stats
+				 * against concurrent read/write/free */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
+	/* Share identical compressed pages, can only be changed before init */
+	int use_dedup;
+	spinlock_t dedup_lock;	/* protect dedup_root and entry refcounts */
+	struct rb_root dedup_root;	/* zram_entry by checksum */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device, can only be changed before init */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long *bitmap;	/* blocks in use on backing device */
+	unsigned long nr_pages;	/* size of backing device in pages */
+#endif
 	/* Prevent concurrent execution of device init and reset */
 	struct mutex init_lock;
 	/*
@@ -129,4 +178,17 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int idle_only);
+#endif
+
+extern u32 zram_dedup_checksum(void *mem);
+extern struct zram_entry *zram_dedup_find(struct zram *zram,
+		struct zram_comp_strm *strm, void *mem, u32 checksum);
+extern struct zram_entry *zram_dedup_new(struct zram *zram,
+		unsigned long handle, u32 len, u32 checksum);
+extern int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
 #endif
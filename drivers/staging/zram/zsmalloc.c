@@ -0,0 +1,677 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc is a size-class allocator for compressed pages. Objects of
+ * similar size (rounded up to ZS_SIZE_CLASS_DELTA) are packed into
+ * "zspages" of 1..ZS_MAX_PAGES_PER_ZSPAGE order-0 pages, with the zspage
+ * size chosen per class to minimize the tail waste.
+ *
+ * Allocations return an opaque handle instead of a <page, offset> pair,
+ * so objects can be moved. zs_compact() uses this to migrate objects out
+ * of sparsely used zspages and give the emptied pages back to the buddy
+ * allocator. Compaction also runs from a per-pool shrinker.
+ *
+ * Each size class has its own lock, so allocations of different sizes
+ * do not contend.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cachep;
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc);
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Find the number of pages per zspage that wastes the least space
+ * at the end of the zspage for the given object size.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+						struct zspage *zspage)
+{
+	int inuse = zspage->inuse;
+	int max = class->objs_per_zspage;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max)
+		return ZS_FULL;
+	if (inuse <= 3 * max / ZS_FULLNESS_THRESHOLD_FRAC)
+		return ZS_ALMOST_EMPTY;
+
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Move zspage to the list matching its current usage. Empty zspages
+ * are taken off all lists; the caller frees them.
+ */
+static void fix_fullness_group(struct size_class *class,
+				struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return;
+
+	list_del_init(&zspage->list);
+	zspage->fullness = newfg;
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+}
+
+/*
+ * Fill the fullest zspages first so that sparse ones can drain and
+ * be reclaimed.
+ */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+	static const enum fullness_group fg[] = {
+		ZS_ALMOST_FULL, ZS_ALMOST_EMPTY
+	};
+
+	for (i = 0; i < ARRAY_SIZE(fg); i++) {
+		if (!list_empty(&class->fullness_list[fg[i]]))
+			return list_first_entry(&class->fullness_list[fg[i]],
+						struct zspage, list);
+	}
+
+	return NULL;
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			BITS_TO_LONGS(class->objs_per_zspage) * sizeof(long),
+			flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (unlikely(!zspage->pages[i]))
+			goto fail;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	int i;
+	struct size_class *class = zspage->class;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/*
+ * Copy @len bytes between @buf and the zspage, starting at byte @off
+ * of the zspage, crossing page boundaries as required.
+ */
+static void obj_copy(struct zspage *zspage, unsigned long off,
+			void *buf, int len, int to_obj)
+{
+	while (len) {
+		char *addr;
+		int pgoff = off & ~PAGE_MASK;
+		int n = min_t(int, len, PAGE_SIZE - pgoff);
+
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER0);
+		if (to_obj)
+			memcpy(addr + pgoff, buf, n);
+		else
+			memcpy(buf, addr + pgoff, n);
+		kunmap_atomic(addr, KM_USER0);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static void obj_attach(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, struct zs_handle *h)
+{
+	unsigned long handle = (unsigned long)h;
+
+	__set_bit(idx, zspage->obj_map);
+	zspage->inuse++;
+
+	h->zspage = zspage;
+	h->idx = idx;
+	obj_copy(zspage, idx * class->size, &handle, ZS_HANDLE_SIZE, 1);
+}
+
+static void pin_handle(struct zs_handle *h)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, &h->flags);
+}
+
+static void unpin_handle(struct zs_handle *h)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, &h->flags);
+}
+
+/**
+ * zs_create_pool - create a new memory pool
+ * @name: name of the pool, for diagnostics only
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	int i, j;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+	}
+
+	atomic_long_set(&pool->pages_allocated, 0);
+	pool->name = name;
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, j;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[j], list) {
+				pr_info("%s: freeing non-empty zspage, "
+					"class=%d inuse=%u\n", pool->name,
+					class->size, zspage->inuse);
+				list_del(&zspage->list);
+				free_zspage(pool, zspage);
+			}
+		}
+	}
+
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - allocate block of given size from pool
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: gfp flags used when the pool needs to grow
+ *
+ * On success, a non-zero handle to the object is returned. It must
+ * be mapped with zs_map_object() to access the object. On failure,
+ * or if size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE, 0 is returned.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned int idx;
+	struct zs_handle *h;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (unlikely(!h))
+		return 0;
+	h->flags = 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(class, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cachep, h);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	idx = find_first_zero_bit(zspage->obj_map, class->objs_per_zspage);
+	obj_attach(class, zspage, idx, h);
+	class->objs_inuse++;
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	int empty;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Keep compaction from moving the object under us */
+	pin_handle(h);
+	zspage = h->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	__clear_bit(h->idx, zspage->obj_map);
+	zspage->inuse--;
+	class->objs_inuse--;
+	fix_fullness_group(class, zspage);
+	empty = zspage->fullness == ZS_EMPTY;
+	if (empty)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	unpin_handle(h);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kmem_cache_free(zs_handle_cachep, h);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the object will be accessed
+ *
+ * Preemption is disabled and the object cannot be moved until the
+ * matching zs_unmap_object(). Only one object can be mapped at a time
+ * on a given CPU.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned long off;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct mapping_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	BUG_ON(!handle);
+
+	pin_handle(h);
+	zspage = h->zspage;
+	class = zspage->class;
+	off = h->idx * class->size;
+
+	area = &get_cpu_var(zs_map_area);
+	area->mm = mm;
+
+	if ((off >> PAGE_SHIFT) == ((off + class->size - 1) >> PAGE_SHIFT)) {
+		/* Object fits within a single page */
+		area->vm_addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+						KM_USER1);
+		return area->vm_addr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* Object spans two pages, go through the bounce buffer */
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		obj_copy(zspage, off, area->buf, class->size, 0);
+
+	return area->buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long off;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct mapping_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = h->zspage;
+		class = zspage->class;
+		off = h->idx * class->size + ZS_HANDLE_SIZE;
+		obj_copy(zspage, off, area->buf + ZS_HANDLE_SIZE,
+			class->size - ZS_HANDLE_SIZE, 1);
+	}
+	put_cpu_var(zs_map_area);
+
+	unpin_handle(h);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Move object @idx of @src into a free slot of @dst. Fails if the
+ * object is currently mapped or being freed. Called with class->lock.
+ */
+static int migrate_object(struct size_class *class, struct zspage *src,
+			unsigned int idx, struct zspage *dst)
+{
+	unsigned int didx;
+	unsigned long handle;
+	struct zs_handle *h;
+	struct mapping_area *area;
+
+	obj_copy(src, idx * class->size, &handle, ZS_HANDLE_SIZE, 0);
+	h = (struct zs_handle *)handle;
+	if (!bit_spin_trylock(HANDLE_PIN_BIT, &h->flags))
+		return 0;
+
+	didx = find_first_zero_bit(dst->obj_map, class->objs_per_zspage);
+
+	area = &get_cpu_var(zs_map_area);
+	obj_copy(src, idx * class->size, area->buf, class->size, 0);
+	obj_copy(dst, didx * class->size, area->buf, class->size, 1);
+	put_cpu_var(zs_map_area);
+
+	__set_bit(didx, dst->obj_map);
+	dst->inuse++;
+	__clear_bit(idx, src->obj_map);
+	src->inuse--;
+
+	h->zspage = dst;
+	h->idx = didx;
+	unpin_handle(h);
+
+	fix_fullness_group(class, dst);
+	return 1;
+}
+
+/*
+ * Drain the sparsest zspages of a class into the others, until about
+ * @nr_to_free pages are freed. Returns the number of pages given back
+ * to the buddy allocator.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+				struct size_class *class,
+				unsigned long nr_to_free)
+{
+	unsigned long freed = 0;
+	struct list_head *sparse = &class->fullness_list[ZS_ALMOST_EMPTY];
+
+	spin_lock(&class->lock);
+	while (freed < nr_to_free && !list_empty(sparse)) {
+		unsigned int idx;
+		unsigned long room;
+		int done = 1;
+		struct zspage *src, *dst;
+
+		src = list_entry(sparse->prev, struct zspage, list);
+
+		/* Only start if the other zspages can take all its objects */
+		room = (class->zspages - 1) * class->objs_per_zspage -
+				(class->objs_inuse - src->inuse);
+		if (room < src->inuse)
+			break;
+
+		/* Isolate the source so it is not picked as destination */
+		list_del_init(&src->list);
+
+		for_each_set_bit(idx, src->obj_map, class->objs_per_zspage) {
+			dst = find_get_zspage(class);
+			if (!dst || !migrate_object(class, src, idx, dst)) {
+				done = 0;
+				break;
+			}
+		}
+
+		if (!done) {
+			/* Out of room or object busy: put it back and stop */
+			list_add_tail(&src->list,
+				&class->fullness_list[src->fullness]);
+			fix_fullness_group(class, src);
+			break;
+		}
+
+		src->fullness = ZS_EMPTY;
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				unsigned long nr_to_free)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0 && freed < nr_to_free; i--)
+		freed += compact_class(pool, &pool->size_class[i],
+				nr_to_free - freed);
+
+	return freed;
+}
+
+/**
+ * zs_compact - give back memory held by sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return __zs_compact(pool, ULONG_MAX);
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Pages compaction could give back: whole zspages worth of unused
+ * objects in each class. Read without locks, so only an estimate.
+ */
+static unsigned long zs_can_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long unused;
+
+		unused = class->zspages * class->objs_per_zspage -
+				class->objs_inuse;
+		pages += unused / class->objs_per_zspage *
+				class->pages_per_zspage;
+	}
+
+	return pages;
+}
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	/*
+	 * zram allocates from the swap-out path with I/O disabled; don't
+	 * make such callers wait on the class locks of a compaction.
+	 */
+	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_IO))
+		return -1;
+
+	/* Each call only asks for its own batch, not the whole pool */
+	if (sc->nr_to_scan)
+		__zs_compact(pool, sc->nr_to_scan);
+
+	return min_t(unsigned long, zs_can_compact(pool), INT_MAX);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/* Bytes occupied by allocated objects, including class round up */
+u64 zs_get_used_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 used = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		used += (u64)class->objs_inuse * class->size;
+	}
+
+	return used;
+}
+EXPORT_SYMBOL_GPL(zs_get_used_size_bytes);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(zs_map_area, cpu).buf);
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!area->buf) {
+			zs_free_map_areas();
+			kmem_cache_destroy(zs_handle_cachep);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void __exit zs_exit(void)
+{
+	zs_free_map_areas();
+	kmem_cache_destroy(zs_handle_cachep);
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Size-class allocator for compressed objects");
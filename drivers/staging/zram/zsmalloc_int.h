@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * Every object starts with its handle so that compaction can find
+ * and update the handle of an object it moves.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes, i.e. 16
+ * bytes for 4k pages. Objects are rounded up to their class size.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is a group of up to this many order-0 pages (not physically
+ * contiguous) holding objects of a single class. Objects may straddle
+ * the boundary between two pages of a zspage.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * A zspage is "almost empty" if at most 3/ZS_FULLNESS_THRESHOLD_FRAC
+ * of its objects are in use. Those are compaction sources.
+ */
+#define ZS_FULLNESS_THRESHOLD_FRAC	4
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	ZS_EMPTY
+};
+
+/* Bit in zs_handle->flags held while the object is mapped or freed */
+#define HANDLE_PIN_BIT	0
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	unsigned int inuse;		/* no. of allocated objects */
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long obj_map[0];	/* bitmap of allocated objects */
+};
+
+/*
+ * What users see as a handle: a fixed location telling where the
+ * object currently lives. Only compaction changes zspage/idx.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	int size;			/* object size incl. handle */
+	int pages_per_zspage;
+	int objs_per_zspage;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+
+	/* stats, protected by lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	atomic_long_t pages_allocated;
+	struct shrinker shrinker;
+	const char *name;
+};
+
+/*
+ * Per-CPU bounce buffer used to map objects that span two pages and
+ * to move objects during compaction.
+ */
+struct mapping_area {
+	char *buf;			/* PAGE_SIZE bytes */
+	char *vm_addr;			/* kmap'ed page, if object fits */
+	enum zs_mapmode mm;
+};
+
+#endif
@@ -231,10 +231,11 @@ static inline unsigned int fsr_stl_page_size(stl_info_t *ssp)
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 #include <linux/blkdev.h>
+#include <linux/workqueue.h>
 
 struct fsr_dev 
 {
-	struct request		*req;        
+	struct work_struct	work;		/* serves the request queue */
 	struct list_head	list;
 	int			size;
 	spinlock_t		lock;
@@ -20,6 +20,8 @@
 #include <linux/fs.h>
 #include <linux/version.h>
 #include <linux/proc_fs.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
 #include <linux/platform_device.h>
 #else
@@ -53,49 +55,79 @@ EXPORT_SYMBOL(bml_module_resume);
 #endif /* end of CONFIG_PM */
 
 /**
- * transger data from BML to buffer cache
+ * workqueue on which requests of every bml device are served
+ */
+static struct workqueue_struct *bml_wq;
+
+/**
+ * read sectors of one scatterlist segment from BML
+ * @param volume        : device number
+ * @param vpn           : first virtual page of the partition
+ * @param sector        : first sector, relative to the partition
+ * @param nsect         : number of sectors
+ * @param buf           : virtually contiguous destination buffer
+ * @return              FSR_BML_SUCCESS on success
+ */
+static int bml_read_segment(u32 volume, u32 vpn, unsigned long sector,
+		unsigned long nsect, u8 *buf)
+{
+	FSRVolSpec *vs = fsr_get_vol_spec(volume);
+	u32 spp_shift = ffs(vs->nSctsPerPg) - 1;
+	u32 spp_mask = vs->nSctsPerPg - 1;
+
+	/*
+	 * If sector and nsect are aligned with vs->nSctsPerPg,
+	 * you have to use a FSR_BML_Read() function using page unit,
+	 * If not, use a FSR_BML_ReadScts() function using sector unit.
+	 */
+	if (!(sector & spp_mask) && !(nsect & spp_mask))
+	{
+		return FSR_BML_Read(volume, vpn + (sector >> spp_shift),
+				nsect >> spp_shift, buf, NULL, FSR_BML_FLAG_ECC_ON);
+	}
+
+	return FSR_BML_ReadScts(volume, vpn + (sector >> spp_shift),
+			sector & spp_mask, nsect, buf, NULL, FSR_BML_FLAG_ECC_ON);
+}
+
+/**
+ * transfer a whole request from BML to buffer cache
  * @param volume        : device number
  * @param partno        : 0~15: partition, other: whole device
+ * @param dev           : bml device the request was queued on
  * @param req           : request description
- * @return              1 on success, 0 on failure
+ * @return              0 on success, -errno on failure
  *
- * It will erase a block before it do write the data
+ * The request is mapped into dev->sg, so each physically contiguous run of
+ * the request is read with one multi-page BML call instead of one call per
+ * bio segment.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-static int bml_transfer(u32 volume, u32 partno, struct request *req, u32 data_len)
-#else
-static int bml_transfer(u32 volume, u32 partno, struct request *req)
-#endif
+static int bml_transfer(u32 volume, u32 partno, struct fsr_dev *dev,
+		struct request *req)
 {
 	unsigned long sector, nsect;
-	char *buf;
-	FSRVolSpec *vs;
 	FSRPartI *ps;
-	u32 nPgsPerUnit = 0, n1stVpn = 0, spp_shift, spp_mask;
+	struct scatterlist *sg;
+	u32 nPgsPerUnit = 0, n1stVpn = 0;
+	int nsg, i;
 	int ret;
-	
+
 	DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
-	if (req == NULL || (req->cmd_type != REQ_TYPE_FS)) {
+	if (req->cmd_type != REQ_TYPE_FS)
+	{
 		printk (KERN_NOTICE "Skip non-CMD request\n");
-		__blk_end_request_all(req, -EIO);
 		return -EIO;
 	}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	sector = blk_rq_pos(req);
-	nsect = data_len >> 9;
-#else
-	sector = req->sector;
-	nsect = req->current_nr_sectors;
-#endif
-	buf = req->buffer;
-	
-	vs = fsr_get_vol_spec(volume);
+	if (rq_data_dir(req) != READ)
+	{
+		ERRPRINTK("Unknown request 0x%x\n", (u32) rq_data_dir(req));
+		return -EINVAL;
+	}
+
 	ps = fsr_get_part_spec(volume);
-	spp_shift = ffs(vs->nSctsPerPg) - 1;
-	spp_mask = vs->nSctsPerPg - 1;
-	
+
 	if(!fsr_is_whole_dev(partno))
 	{
 		if (FSR_BML_GetVirUnitInfo(volume, 
@@ -107,154 +139,80 @@ static int bml_transfer(u32 volume, u32 partno, struct request *req)
 		}
 	}
 
-	switch (rq_data_dir(req)) 
-	{
-		case READ:
-			/*
-			 * If sector and nsect are aligned with vs->nSctsPerPg,
-			 * you have to use a FSR_BML_Read() function using page unit,
-			 * If not, use a FSR_BML_ReadScts() function using sector unit.
-			 */
-			if ((!(sector & spp_mask) && !(nsect & spp_mask))) 
-			{
-				ret = FSR_BML_Read(volume, n1stVpn + (sector >> spp_shift),
-						nsect >> spp_shift, buf, NULL, FSR_BML_FLAG_ECC_ON);
-			} 
-			else 
-			{
-				ret = FSR_BML_ReadScts(volume, n1stVpn + (sector >> spp_shift),
-						sector & spp_mask, nsect, buf, NULL, FSR_BML_FLAG_ECC_ON);
-			}
-			break;
-		default:
-			ERRPRINTK("Unknown request 0x%x\n", (u32) rq_data_dir(req));
-			return -EINVAL;
-	}
+	sector = blk_rq_pos(req);
+	nsg = blk_rq_map_sg(dev->queue, req, dev->sg);
 
-	/* I/O error */
-	if (ret != FSR_BML_SUCCESS) 
+	for_each_sg(dev->sg, sg, nsg, i)
 	{
-		ERRPRINTK("TINY: transfer error = %X\n", ret);
-		return -EIO;
+		nsect = sg->length >> SECTOR_BITS;
+
+		ret = bml_read_segment(volume, n1stVpn, sector, nsect,
+				sg_virt(sg));
+		/* I/O error */
+		if (ret != FSR_BML_SUCCESS) 
+		{
+			ERRPRINTK("TINY: transfer error = %X\n", ret);
+			return -EIO;
+		}
+		sector += nsect;
 	}
-	
+
 	DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
 
-	return 1;
+	return 0;
 }
 
 /**
- * request function which is do read/write sector
- * @param rq    : request queue which is created by blk_init_queue()
+ * worker which serves the requests queued on a bml device
+ * @param work  : work_struct embedded in struct fsr_dev
  * @return              none
+ *
+ * The queue lock is only taken to fetch and complete requests, never per
+ * segment.
  */
-static void bml_request(struct request_queue *rq)
+static void bml_request_work(struct work_struct *work)
 {
-	u32 minor, volume, partno, spp_mask;
+	struct fsr_dev *dev = container_of(work, struct fsr_dev, work);
+	struct request_queue *rq = dev->queue;
 	struct request *req;
-	struct fsr_dev *dev;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25)
-	int ret;
-#endif
-	int trans_ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	int error = 0;
-	u32 len = 0;
-#endif
-
-	FSRVolSpec *vs;
+	u32 minor, volume, partno;
+	int error;
 
 	DEBUG(DL3,"TINY[I]\n");
 
-	dev = rq->queuedata;
-	if (dev->req)
-		return;
+	minor = dev->gd->first_minor;
+	volume = fsr_vol(minor);
+	partno = fsr_part(minor);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	while ((dev->req = req = blk_peek_request(rq)) != NULL)
-#else
-	while ((dev->req = req = elv_next_request(rq)) != NULL) 
-#endif
+	spin_lock_irq(rq->queue_lock);
+	while ((req = blk_fetch_request(rq)) != NULL)
 	{
 		spin_unlock_irq(rq->queue_lock);
-		
-		minor = dev->gd->first_minor;
-		volume = fsr_vol(minor);
-		partno = fsr_part(minor);
-		vs = fsr_get_vol_spec(volume);
-		spp_mask = vs->nSctsPerPg - 1;
-		
-		DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		len = blk_rq_cur_bytes(req);
-		if (!( blk_rq_pos(req) & spp_mask) && ( blk_rq_cur_sectors(req) != blk_rq_sectors(req)))
-		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				len = dev->sg->length;
-			}
-			if (len > blk_rq_bytes(req))
-			{
-				len = blk_rq_bytes(req);
-			}
+		error = bml_transfer(volume, partno, dev, req);
 
-		}
-		trans_ret = bml_transfer(volume, partno, req, len);
-#else
-		if (!(req->sector & spp_mask) && (req->current_nr_sectors != req->nr_sectors))
-		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				req->current_nr_sectors = dev->sg->length >> SECTOR_BITS;
-			}
-			if (req->current_nr_sectors > req->nr_sectors)
-			{
-				req->current_nr_sectors = req->nr_sectors;
-			}
-		}
-		trans_ret = bml_transfer(volume, partno, req);
-#endif
-		
 		spin_lock_irq(rq->queue_lock);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		if (trans_ret)
-		{
-			error = 0;
-		} else
-		{
-			error = -EIO;
-		}
-		/* don't need to check if request is finished */
-		if (blk_rq_sectors(req) <= (len >> 9))
-			list_del_init(&req->queuelist);
-		__blk_end_request(req, error, len);
-
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
-		req->hard_cur_sectors = req->current_nr_sectors;
-		end_request(req, trans_ret);
-#else	
-		ret = end_that_request_chunk(req, trans_ret, req->current_nr_sectors << SECTOR_BITS);
-		if (!ret)
-		{
-			add_disk_randomness(req->rq_disk);
-			blkdev_dequeue_request(req);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16)
-			end_that_request_last(req, trans_ret);
-#else
-			end_that_request_last(req);
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 16) */
-		}
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25) */
-
-		DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
+		__blk_end_request_all(req, error);
 	}
+	spin_unlock_irq(rq->queue_lock);
 
 	DEBUG(DL3,"TINY[O]\n");
 }
 
+/**
+ * request function which is do read/write sector
+ * @param rq    : request queue which is created by blk_init_queue()
+ * @return              none
+ *
+ * Called with the queue lock held, it only kicks the worker.
+ */
+static void bml_request(struct request_queue *rq)
+{
+	struct fsr_dev *dev = rq->queuedata;
+
+	queue_work(bml_wq, &dev->work);
+}
+
 /**
  * add each partitions as disk
  * @param volume        a volume number
@@ -285,9 +243,9 @@ static int bml_add_disk(u32 volume, u32 partno)
 	up(&bml_list_mutex);
 	
 	/* init queue */
+	INIT_WORK(&dev->work, bml_request_work);
 	dev->queue = blk_init_queue(bml_request, &dev->lock);
 	dev->queue->queuedata = dev;
-	dev->req = NULL;
 
 	/* alloc scatterlist */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
@@ -375,15 +333,26 @@ static void bml_del_disk(struct fsr_dev *dev)
 	if (dev->gd) 
 	{
 		del_gendisk(dev->gd);
-		put_disk(dev->gd);
 	}
 
-	kfree(dev->sg);
-
 	if (dev->queue)
 	{
 		blk_cleanup_queue(dev->queue);
 	}
+
+	/*
+	 * The worker maps requests into dev->sg and looks at dev->gd, so
+	 * both stay until the queue is shut down and the worker has stopped.
+	 */
+	cancel_work_sync(&dev->work);
+
+	if (dev->gd) 
+	{
+		put_disk(dev->gd);
+	}
+
+	kfree(dev->sg);
+
 	list_del(&dev->list);
 	kfree(dev);
 
@@ -576,15 +545,24 @@ int __init bml_blkdev_init(void)
 #ifdef CONFIG_PM
 #endif
 
+	bml_wq = create_singlethread_workqueue("tfsr_bmld");
+	if (!bml_wq)
+	{
+		ERRPRINTK("TinyFSR: Can't create workqueue\n");
+		return -ENOMEM;
+	}
+
 	if (register_blkdev(MAJOR_NR, DEVICE_NAME)) 
 	{
 		ERRPRINTK("TiyFSR: unable to get major %d\n", MAJOR_NR);
+		destroy_workqueue(bml_wq);
 		return -EAGAIN;
 	}
 	
 	if (bml_blkdev_create()) 
 	{
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		destroy_workqueue(bml_wq);
 		ERRPRINTK("TiyFSR: Can't created bml_blkdev_create()\n");
 		return -ENOMEM;
 	}
@@ -597,6 +575,7 @@ int __init bml_blkdev_init(void)
 		ERRPRINTK("TinyFSR: Can't register driver(major:%d)\n", MAJOR_NR);
 		bml_blkdev_free();
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		destroy_workqueue(bml_wq);
 		return -ENODEV;
 	}
 
@@ -609,6 +588,7 @@ int __init bml_blkdev_init(void)
 #endif
 		bml_blkdev_free();
 		unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+		destroy_workqueue(bml_wq);
 		return -ENODEV;
 	}
 
@@ -644,6 +624,7 @@ void __exit bml_blkdev_exit(void)
 #endif
 	bml_blkdev_free();
 	unregister_blkdev(MAJOR_NR, DEVICE_NAME);
+	destroy_workqueue(bml_wq);
 }
 
 MODULE_LICENSE("GPL");
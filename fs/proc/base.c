@@ -1067,6 +1067,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_CHANGE, task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1202,6 +1204,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_CHANGE, task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -13,6 +13,7 @@
 
 #include "yaffs_checkptrw.h"
 #include "yaffs_getblockinfo.h"
+#include "yaffs_nand.h"
 
 static int yaffs2_checkpt_space_ok(struct yaffs_dev *dev)
 {
@@ -42,6 +43,10 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 
 			dev->n_erasures++;
 
+			/* Checkpoint blocks never hold file data, so no
+			 * unlocked reader can be using them: no erase lock.
+			 */
+			yaffs_flash_lock(dev);
 			if (dev->param.
 			    erase_fn(dev,
 				     i - dev->block_offset /* realign */ )) {
@@ -53,6 +58,7 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 				dev->param.bad_block_fn(dev, i);
 				bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 			}
+			yaffs_flash_unlock(dev);
 		}
 	}
 
@@ -108,8 +114,10 @@ static void yaffs2_checkpt_find_block(struct yaffs_dev *dev)
 			int chunk = i * dev->param.chunks_per_block;
 			int realigned_chunk = chunk - dev->chunk_offset;
 
+			yaffs_flash_lock(dev);
 			dev->param.read_chunk_tags_fn(dev, realigned_chunk,
 						      NULL, &tags);
+			yaffs_flash_unlock(dev);
 			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 				"find next checkpt block: search: block %d oid %d seq %d eccr %d",
 				i, tags.obj_id, tags.seq_number,
@@ -239,8 +247,10 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 
 	dev->n_page_writes++;
 
+	yaffs_flash_lock(dev);
 	dev->param.write_chunk_tags_fn(dev, realigned_chunk,
 				       dev->checkpt_buffer, &tags);
+	yaffs_flash_unlock(dev);
 	dev->checkpt_byte_offs = 0;
 	dev->checkpt_page_seq++;
 	dev->checkpt_cur_chunk++;
@@ -320,14 +330,15 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 
 				realigned_chunk = chunk - dev->chunk_offset;
 
-				dev->n_page_reads++;
-
 				/* read in the next chunk */
+				yaffs_flash_lock(dev);
+				dev->n_page_reads++;
 				dev->param.read_chunk_tags_fn(dev,
 							      realigned_chunk,
 							      dev->
 							      checkpt_buffer,
 							      &tags);
+				yaffs_flash_unlock(dev);
 
 				if (tags.chunk_id != (dev->checkpt_page_seq + 1)
 				    || tags.ecc_result > YAFFS_ECC_RESULT_FIXED
@@ -440,16 +440,85 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 	return -1;
 }
 
+static unsigned yaffs_gc_policy(struct yaffs_dev *dev)
+{
+	if (!dev->param.gc_control)
+		return YAFFS_GC_CTRL_ENABLE;
+	return dev->param.gc_control(dev);
+}
+
+/*
+ * yaffs_close_cold_block() stops allocating gc copies from the cold block.
+ * Once it is full it has to take part in the oldest dirty tracking like any
+ * other full block.
+ */
+static void yaffs_close_cold_block(struct yaffs_dev *dev)
+{
+	struct yaffs_block_info *bi;
+
+	if (dev->cold_alloc_block <= 0)
+		return;
+
+	bi = yaffs_get_block_info(dev, dev->cold_alloc_block);
+	if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
+		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		if (bi->pages_in_use - bi->soft_del_pages <
+		    dev->param.chunks_per_block)
+			yaffs2_update_oldest_dirty_seq(dev,
+						       dev->cold_alloc_block,
+						       bi);
+	}
+	dev->cold_alloc_block = -1;
+}
+
+/*
+ * yaffs_open_cold_block() opens a block for gc copies when hot/cold
+ * separation is on.
+ *
+ * yaffs2 scanning relies on a rewritten chunk always landing in a block with
+ * a higher sequence number than the copy it replaces. Chunks copied into the
+ * cold block may later be rewritten by the host, so the cold block is only
+ * ever opened immediately before a new hot block: every block that takes
+ * host writes while it is open is newer than it.
+ */
+static void yaffs_open_cold_block(struct yaffs_dev *dev)
+{
+	int spare;
+
+	if (!dev->param.is_yaffs2 || dev->cold_alloc_block > 0 ||
+	    !(yaffs_gc_policy(dev) & YAFFS_GC_CTRL_HOT_COLD))
+		return;
+
+	/* Leave the reserve, the checkpoint and the new hot block alone */
+	spare = dev->n_erased_blocks - dev->param.n_reserved_blocks -
+	    yaffs_calc_checkpt_blocks_required(dev) - 1;
+	if (spare < 1)
+		return;
+
+	dev->cold_alloc_block = yaffs_find_alloc_block(dev);
+	dev->cold_alloc_page = 0;
+}
+
 static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 			     struct yaffs_block_info **block_ptr)
 {
 	int ret_val;
 	struct yaffs_block_info *bi;
+	int *block = &dev->alloc_block;
+	u32 *page = &dev->alloc_page;
 
-	if (dev->alloc_block < 0) {
+	if (dev->alloc_cold && dev->cold_alloc_block > 0) {
+		block = &dev->cold_alloc_block;
+		page = &dev->cold_alloc_page;
+	} else if (dev->alloc_block < 0) {
 		/* Get next block to allocate off */
+		dev->alloc_cold = 0;
+		yaffs_open_cold_block(dev);
 		dev->alloc_block = yaffs_find_alloc_block(dev);
 		dev->alloc_page = 0;
+	} else {
+		/* No cold block, gc copies share the hot block */
+		dev->alloc_cold = 0;
 	}
 
 	if (!use_reserver && !yaffs_check_alloc_available(dev, 1)) {
@@ -458,26 +527,29 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 	}
 
 	if (dev->n_erased_blocks < dev->param.n_reserved_blocks
-	    && dev->alloc_page == 0)
+	    && *page == 0)
 		yaffs_trace(YAFFS_TRACE_ALLOCATE, "Allocating reserve");
 
 	/* Next page please.... */
-	if (dev->alloc_block >= 0) {
-		bi = yaffs_get_block_info(dev, dev->alloc_block);
+	if (*block >= 0) {
+		bi = yaffs_get_block_info(dev, *block);
 
-		ret_val = (dev->alloc_block * dev->param.chunks_per_block) +
-		    dev->alloc_page;
+		ret_val = (*block * dev->param.chunks_per_block) + *page;
 		bi->pages_in_use++;
-		yaffs_set_chunk_bit(dev, dev->alloc_block, dev->alloc_page);
+		yaffs_set_chunk_bit(dev, *block, *page);
 
-		dev->alloc_page++;
+		(*page)++;
 
 		dev->n_free_chunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->alloc_page >= dev->param.chunks_per_block) {
-			bi->block_state = YAFFS_BLOCK_STATE_FULL;
-			dev->alloc_block = -1;
+		if (*page >= dev->param.chunks_per_block) {
+			if (block == &dev->cold_alloc_block) {
+				yaffs_close_cold_block(dev);
+			} else {
+				bi->block_state = YAFFS_BLOCK_STATE_FULL;
+				dev->alloc_block = -1;
+			}
 		}
 
 		if (block_ptr)
@@ -500,6 +572,9 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
 	if (dev->alloc_block > 0)
 		n += (dev->param.chunks_per_block - dev->alloc_page);
 
+	if (dev->cold_alloc_block > 0)
+		n += (dev->param.chunks_per_block - dev->cold_alloc_page);
+
 	return n;
 
 }
@@ -510,6 +585,11 @@ static int yaffs_get_erased_chunks(struct yaffs_dev *dev)
  */
 void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 {
+	if (dev->alloc_cold) {
+		yaffs_close_cold_block(dev);
+		return;
+	}
+
 	if (dev->alloc_block > 0) {
 		struct yaffs_block_info *bi =
 		    yaffs_get_block_info(dev, dev->alloc_block);
@@ -641,16 +721,19 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 			struct yaffs_ext_tags tags;
 			int chunk_id =
 			    flash_block * dev->param.chunks_per_block;
+			int result;
 
 			u8 *buffer = yaffs_get_temp_buffer(dev, __LINE__);
 
 			memset(buffer, 0xff, dev->data_bytes_per_chunk);
 			yaffs_init_tags(&tags);
 			tags.seq_number = YAFFS_SEQUENCE_BAD_BLOCK;
-			if (dev->param.write_chunk_tags_fn(dev, chunk_id -
-							   dev->chunk_offset,
-							   buffer,
-							   &tags) != YAFFS_OK)
+			yaffs_flash_lock(dev);
+			result = dev->param.write_chunk_tags_fn(dev, chunk_id -
+							dev->chunk_offset,
+							buffer, &tags);
+			yaffs_flash_unlock(dev);
+			if (result != YAFFS_OK)
 				yaffs_trace(YAFFS_TRACE_ALWAYS,
 					"yaffs: Failed to write bad block marker to block %d",
 					flash_block);
@@ -686,6 +769,153 @@ static u16 yaffs_calc_name_sum(const YCHAR * name)
 	return sum;
 }
 
+/*---------------- Directory name index ------------
+ * Large directories keep their children hashed by name sum so that
+ * yaffs_find_by_name() need not walk (and read the headers of) every child.
+ * The sum is what the linear search filtered on anyway, so it is reused as
+ * the key rather than growing every object by another hash.
+ */
+
+static struct yaffs_dir_index *yaffs_dir_index_of(struct yaffs_obj *dir)
+{
+	if (!dir || dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return NULL;
+	return dir->variant.dir_variant.index;
+}
+
+static struct list_head *yaffs_dir_index_bucket(struct yaffs_dir_index *index,
+						u16 sum)
+{
+	/* Spread the sums, which cluster, over the table */
+	u32 h = (u32) sum * 0x9e370001UL;
+
+	return &index->buckets[(h >> 16) & (index->n_buckets - 1)];
+}
+
+/* Only objects whose sum really is the sum of their name may be hashed */
+static int yaffs_dir_index_settled(struct yaffs_obj *obj)
+{
+	return !obj->lazy_loaded && obj->hdr_chunk > 0 &&
+	    obj->obj_id != YAFFS_OBJECTID_LOSTNFOUND;
+}
+
+static void yaffs_dir_index_insert(struct yaffs_dir_index *index,
+				   struct yaffs_obj *obj)
+{
+	if (yaffs_dir_index_settled(obj)) {
+		list_add(&obj->name_link,
+			 yaffs_dir_index_bucket(index, obj->sum));
+		obj->name_hashed = 1;
+		index->n_hashed++;
+	} else {
+		list_add(&obj->name_link, &index->unhashed);
+	}
+}
+
+static void yaffs_dir_index_remove(struct yaffs_dir_index *index,
+				   struct yaffs_obj *obj)
+{
+	if (list_empty(&obj->name_link))
+		return;
+	list_del_init(&obj->name_link);
+	if (obj->name_hashed)
+		index->n_hashed--;
+	obj->name_hashed = 0;
+}
+
+/* Called when obj's name sum or settled state may have changed */
+static void yaffs_dir_index_rehash(struct yaffs_obj *obj)
+{
+	struct yaffs_dir_index *index = yaffs_dir_index_of(obj->parent);
+
+	if (!index)
+		return;
+	yaffs_dir_index_remove(index, obj);
+	yaffs_dir_index_insert(index, obj);
+}
+
+static struct yaffs_dir_index *yaffs_dir_index_alloc(int n_buckets)
+{
+	struct yaffs_dir_index *index;
+	int i;
+
+	index = kmalloc(sizeof(struct yaffs_dir_index) +
+			n_buckets * sizeof(struct list_head), GFP_NOFS);
+	if (!index)
+		return NULL;
+
+	index->n_buckets = n_buckets;
+	index->n_hashed = 0;
+	INIT_LIST_HEAD(&index->unhashed);
+	for (i = 0; i < n_buckets; i++)
+		INIT_LIST_HEAD(&index->buckets[i]);
+	return index;
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index = yaffs_dir_index_of(dir);
+	struct list_head *i;
+
+	if (!index)
+		return;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_dir_index_remove(index, list_entry(i, struct yaffs_obj,
+							 siblings));
+	dir->variant.dir_variant.index = NULL;
+	kfree(index);
+}
+
+/* (Re)build the index of dir with n_buckets buckets. Failure is harmless:
+ * the directory just keeps its old index, or none.
+ */
+static void yaffs_dir_index_build(struct yaffs_obj *dir, int n_buckets)
+{
+	struct yaffs_dir_index *index;
+	struct list_head *i;
+
+	index = yaffs_dir_index_alloc(n_buckets);
+	if (!index)
+		return;
+
+	yaffs_dir_index_free(dir);
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_dir_index_insert(index, list_entry(i, struct yaffs_obj,
+							 siblings));
+	dir->variant.dir_variant.index = index;
+
+	yaffs_trace(YAFFS_TRACE_OS, "indexed directory %d, %d buckets",
+		dir->obj_id, n_buckets);
+}
+
+/* Give dir an index, or a bigger one, if it has grown enough to want it */
+static void yaffs_dir_index_check_size(struct yaffs_obj *dir)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_dir_index *index = yaffs_dir_index_of(dir);
+	struct list_head *i;
+	int n = 0;
+
+	/* The unlinked and deleted dirs are never looked up for real */
+	if (dir == dev->unlinked_dir || dir == dev->del_dir)
+		return;
+
+	if (index) {
+		if (index->n_hashed > 2 * index->n_buckets &&
+		    index->n_buckets < YAFFS_DIR_INDEX_MAX_BUCKETS)
+			yaffs_dir_index_build(dir, index->n_buckets * 2);
+		return;
+	}
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		if (++n >= YAFFS_DIR_INDEX_THRESHOLD) {
+			yaffs_dir_index_build(dir, YAFFS_DIR_INDEX_MIN_BUCKETS);
+			return;
+		}
+	}
+}
+
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
 #ifndef CONFIG_YAFFS_NO_SHORT_NAMES
@@ -698,6 +928,7 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 		obj->short_name[0] = _Y('\0');
 #endif
 	obj->sum = yaffs_calc_name_sum(name);
+	yaffs_dir_index_rehash(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -1281,6 +1512,8 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	if (yaffs_dir_index_of(parent))
+		yaffs_dir_index_remove(parent->variant.dir_variant.index, obj);
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
@@ -1315,6 +1548,9 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	if (directory->variant.dir_variant.index)
+		yaffs_dir_index_insert(directory->variant.dir_variant.index,
+				       obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1394,10 +1630,42 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cached chunks are found through a hash on object and chunk id, and
+ *   replaced in least recently used order, so the cache can be made large
+ *   enough to soak up bursts of small writes.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    int obj_id, int chunk_id)
+{
+	u32 h = (u32) obj_id * 0x9e370001 + (u32) chunk_id;
+
+	return &dev->cache_hash[h & dev->cache_hash_mask];
+}
+
+/* Attach a cache to a chunk and make it the most recently used */
+static void yaffs_cache_set(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			    struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	list_add(&cache->hash_link,
+		 yaffs_cache_bucket(dev, obj->obj_id, chunk_id));
+	list_move(&cache->lru, &dev->cache_lru);
+}
+
+/* Detach a cache from its chunk, it becomes the first to be reused */
+static void yaffs_cache_release(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	cache->object = NULL;
+	cache->dirty = 0;
+	list_del_init(&cache->hash_link);
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1448,8 +1716,7 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 						      cache->chunk_id,
 						      cache->data,
 						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_cache_release(dev, cache);
 			}
 
 		} while (cache && chunk_written > 0);
@@ -1498,13 +1765,14 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	if (dev->param.n_caches > 0 && !list_empty(&dev->cache_lru)) {
+		/* Free caches live at the tail of the lru */
+		cache = list_entry(dev->cache_lru.prev, struct yaffs_cache,
+				   lru);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -1513,10 +1781,8 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
+	struct yaffs_cache *victim;
 	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches > 0) {
 		/* Try find a non-dirty one... */
@@ -1524,32 +1790,29 @@ static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 		cache = yaffs_grab_chunk_worker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+			/* Reuse the least recently used clean cache, so that
+			 * dirty ones stay around to gather more writes. If
+			 * they are all dirty, flush the object owning the
+			 * least recently used one, then find again.
 			 */
 
 			/* With locking we can't assume we can use entry zero */
 
 			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
+			list_for_each_entry_reverse(victim, &dev->cache_lru,
+						    lru) {
+				if (victim->locked)
+					continue;
+				if (!victim->dirty) {
+					yaffs_cache_release(dev, victim);
+					return victim;
 				}
+				if (!the_obj)
+					the_obj = victim->object;
 			}
 
-			if (!cache || cache->dirty) {
+			if (the_obj) {
 				/* Flush and try again */
 				yaffs_flush_file_cache(the_obj);
 				cache = yaffs_grab_chunk_worker(dev);
@@ -1567,14 +1830,17 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
+
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj->obj_id,
+						       chunk_id), hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id) {
 				dev->cache_hits++;
 
-				return &dev->cache[i];
+				return cache;
 			}
 		}
 	}
@@ -1587,18 +1853,7 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move(&cache->lru, &dev->cache_lru);
 
 		if (is_write)
 			cache->dirty = 1;
@@ -1616,7 +1871,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_release(object->my_dev, cache);
 	}
 }
 
@@ -1632,7 +1887,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_cache_release(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -1674,6 +1929,7 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	}
 
 	yaffs_unhash_obj(obj);
+	yaffs_dir_index_free(obj);
 
 	yaffs_free_raw_obj(dev, obj);
 	dev->n_obj--;
@@ -1857,12 +2113,17 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
 		INIT_LIST_HEAD(&obj->siblings);
+		INIT_LIST_HEAD(&obj->name_link);
 
 		/* Now make the directory sane */
 		if (dev->root_dir) {
 			obj->parent = dev->root_dir;
 			list_add(&(obj->siblings),
 				 &dev->root_dir->variant.dir_variant.children);
+			if (dev->root_dir->variant.dir_variant.index)
+				yaffs_dir_index_insert(dev->root_dir->
+						       variant.dir_variant.index,
+						       obj);
 		}
 
 		/* Add it to the lost and found directory.
@@ -2306,6 +2567,8 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	dev->chunk_bits = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
+	dev->cold_alloc_block = -1;
+	dev->alloc_cold = 0;
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
@@ -2489,6 +2752,14 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		max_copies = (whole_block) ? dev->param.chunks_per_block : 5;
 		old_chunk = block * dev->param.chunks_per_block + dev->gc_chunk;
 
+		/* Survivors go to the cold block, but only if it is newer
+		 * than this block so that the copies still win over any
+		 * stale versions when scanning.
+		 */
+		dev->alloc_cold = dev->cold_alloc_block > 0 &&
+		    bi->seq_number <
+		    yaffs_get_block_info(dev, dev->cold_alloc_block)->seq_number;
+
 		for ( /* init already done */ ;
 		     ret_val == YAFFS_OK &&
 		     dev->gc_chunk < dev->param.chunks_per_block &&
@@ -2667,6 +2938,8 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 			}
 		}
 
+		dev->alloc_cold = 0;
+
 		yaffs_release_temp_buffer(dev, buffer, __LINE__);
 
 	}
@@ -2715,6 +2988,33 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * Cost-benefit comparison of two gc candidates (the LFS cleaning policy).
+ * A block scores by the space it frees per chunk copied, weighted by its age
+ * in allocated blocks: data that has stayed live for a long time is unlikely
+ * to change soon, so it is worth moving once, while a young block is left to
+ * go on dying.
+ *
+ *	score = free * (age + 1) / (chunks_per_block + used)
+ *
+ * Compared by cross multiplication to stay in integers.
+ */
+static int yaffs_gc_cb_better(struct yaffs_dev *dev,
+			      struct yaffs_block_info *a, int used_a,
+			      struct yaffs_block_info *b, int used_b)
+{
+	u32 n = dev->param.chunks_per_block;
+	u64 score_a;
+	u64 score_b;
+
+	score_a = (u64) (n - used_a) * (dev->seq_number - a->seq_number + 1) *
+	    (n + used_b);
+	score_b = (u64) (n - used_b) * (dev->seq_number - b->seq_number + 1) *
+	    (n + used_a);
+
+	return score_a > score_b;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2730,6 +3030,14 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	int prioritised_exist = 0;
 	struct yaffs_block_info *bi;
 	int threshold;
+	int cost_benefit =
+	    (yaffs_gc_policy(dev) & YAFFS_GC_CTRL_COST_BENEFIT) != 0;
+
+	/* An open cold block pins newer shrink header blocks (see
+	 * yaffs_block_ok_for_gc()), don't let it do so when short of space.
+	 */
+	if (aggressive)
+		yaffs_close_cold_block(dev);
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->has_pending_prioritised_gc && !aggressive) {
@@ -2812,11 +3120,26 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
 
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    pages_used >= dev->param.chunks_per_block)
+				continue;
+
+			if (cost_benefit) {
+				/* Only rank blocks that would be taken */
+				if (pages_used > threshold)
+					continue;
+				if (dev->gc_dirtiest > 0 &&
+				    !yaffs_gc_cb_better(dev, bi, pages_used,
+					yaffs_get_block_info(dev,
+							     dev->gc_dirtiest),
+					dev->gc_pages_in_use))
+					continue;
+			} else if (dev->gc_dirtiest > 0 &&
+				   pages_used >= dev->gc_pages_in_use) {
+				continue;
+			}
+
+			if (yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
 			}
@@ -2892,7 +3215,7 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int erased_chunks;
 	int checkpt_block_adjust;
 
-	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
+	if (!(yaffs_gc_policy(dev) & YAFFS_GC_CTRL_ENABLE))
 		return YAFFS_OK;
 
 	if (dev->gc_disable) {
@@ -3581,10 +3904,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_set(dev, cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 					cache->n_bytes = 0;
@@ -3627,6 +3947,47 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * yaffs_file_map_chunks() finds where the chunks holding n_bytes of file data
+ * at offset live in NAND, so that they can be read after dropping the gross
+ * lock. Holes map to -1. Returns the number of chunks, or -1 if the range has
+ * to be read with yaffs_file_rd() instead: it is not whole chunks, some of it
+ * is in the short op cache, or the device cannot read a chunk without the
+ * cache or temp buffers.
+ */
+int yaffs_file_map_chunks(struct yaffs_obj *in, loff_t offset, int n_bytes,
+			  int *nand_chunks, int max_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+	int n;
+	int i;
+
+	if (!dev->param.is_yaffs2 || dev->param.inband_tags ||
+	    !dev->param.read_chunk_tags_fn)
+		return -1;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	if (start || n_bytes % dev->data_bytes_per_chunk)
+		return -1;
+	n = n_bytes / dev->data_bytes_per_chunk;
+	if (n > max_chunks)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (yaffs_find_chunk_cache(in, chunk + i))
+			return -1;
+		nand_chunks[i] = yaffs_find_chunk_in_file(in, chunk + i, NULL);
+		if (nand_chunks[i] <= 0)
+			nand_chunks[i] = -1;
+	}
+
+	return n;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 		     int n_bytes, int write_trhrough)
 {
@@ -3707,10 +4068,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_set(dev, cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -4466,6 +4824,52 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+static struct yaffs_obj *yaffs_find_by_name_indexed(struct yaffs_obj *directory,
+						     const YCHAR * name,
+						     int sum)
+{
+	struct yaffs_dir_index *index = directory->variant.dir_variant.index;
+	struct list_head *i, *n;
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	struct yaffs_obj *l;
+
+	/* First settle what we can of the children whose name was unknown.
+	 * Loading the details rehashes l (to the head of the unhashed list
+	 * if it is still unsettled), so walk safely.
+	 */
+	list_for_each_safe(i, n, &index->unhashed) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+
+		if (l->parent != directory)
+			YBUG();
+
+		yaffs_check_obj_details_loaded(l);
+
+		if (yaffs_dir_index_settled(l)) {
+			if (!l->name_hashed)
+				yaffs_dir_index_rehash(l);
+			continue;
+		}
+
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+			return l;
+	}
+
+	list_for_each(i, yaffs_dir_index_bucket(index, sum)) {
+		l = list_entry(i, struct yaffs_obj, name_link);
+
+		if (l->sum != sum)
+			continue;
+
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+			return l;
+	}
+
+	return NULL;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR * name)
 {
@@ -4495,6 +4899,10 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
+	yaffs_dir_index_check_size(directory);
+	if (directory->variant.dir_variant.index)
+		return yaffs_find_by_name_indexed(directory, name, sum);
+
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		if (i) {
 			l = list_entry(i, struct yaffs_obj, siblings);
@@ -4939,35 +5347,49 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
 	dev->gc_cleanup_list = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		u32 n_buckets = 1;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+
+		while (n_buckets < dev->param.n_caches)
+			n_buckets <<= 1;
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash =
+		    kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
+		dev->cache_hash_mask = n_buckets - 1;
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_hash)
+			buf = NULL;
 
-		if (dev->cache)
+		if (buf) {
 			memset(dev->cache, 0, cache_bytes);
+			for (i = 0; i < n_buckets; i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+		}
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
@@ -5012,6 +5434,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 				dev->n_free_chunks = 0;
 				dev->alloc_block = -1;
 				dev->alloc_page = -1;
+				dev->cold_alloc_block = -1;
 				dev->n_deleted_files = 0;
 				dev->n_unlinked_files = 0;
 				dev->n_bg_deletions = 0;
@@ -5069,11 +5492,24 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 }
 
+static void yaffs_free_dir_indexes(struct yaffs_dev *dev)
+{
+	struct list_head *lh;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		list_for_each(lh, &dev->obj_bucket[i].list)
+			yaffs_dir_index_free(list_entry(lh, struct yaffs_obj,
+							hash_link));
+	}
+}
+
 void yaffs_deinitialise(struct yaffs_dev *dev)
 {
 	if (dev->is_mounted) {
 		int i;
 
+		yaffs_free_dir_indexes(dev);
 		yaffs_deinit_blocks(dev);
 		yaffs_deinit_tnodes_and_objs(dev);
 		if (dev->param.n_caches > 0 && dev->cache) {
@@ -5087,6 +5523,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
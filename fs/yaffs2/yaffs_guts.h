@@ -57,6 +57,16 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Directories with at least this many children get a hashed name index */
+#define YAFFS_DIR_INDEX_THRESHOLD	64
+#define YAFFS_DIR_INDEX_MIN_BUCKETS	64
+#define YAFFS_DIR_INDEX_MAX_BUCKETS	4096
+
+/* Bits returned by the gc_control callback */
+#define YAFFS_GC_CTRL_ENABLE		0x1	/* background gc allowed */
+#define YAFFS_GC_CTRL_COST_BENEFIT	0x2	/* age-aware victim selection */
+#define YAFFS_GC_CTRL_HOT_COLD		0x4	/* gc copies to a separate block */
+
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
 
@@ -83,7 +93,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -108,9 +118,10 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash while object is set */
+	struct list_head lru;	/* In dev->cache_lru, most recently used first */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -354,9 +365,22 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+/* Name index of a large directory.
+ * Children are chained into buckets by their name sum. Children whose name
+ * is not known yet (lazy loaded, no header written, lost+found) sit on the
+ * unhashed list until a lookup finds their name.
+ */
+struct yaffs_dir_index {
+	int n_buckets;		/* power of 2 */
+	int n_hashed;		/* children in the buckets */
+	struct list_head unhashed;
+	struct list_head buckets[0];
+};
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_dir_index *index;	/* NULL for small directories */
 };
 
 struct yaffs_symlink_var {
@@ -398,6 +422,7 @@ struct yaffs_obj {
 
 	u8 xattr_known:1;	/* We know if this has object has xattribs or not. */
 	u8 has_xattr:1;		/* This object has xattribs. Valid if xattr_known. */
+	u8 name_hashed:1;	/* In a bucket of its parent's name index */
 
 	u8 serial;		/* serial number of chunk in NAND. Cached here */
 	u16 sum;		/* sum of the name to speed searching */
@@ -412,6 +437,7 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct list_head name_link;	/* entry in parent's name index */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -506,8 +532,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -547,6 +573,12 @@ struct yaffs_param {
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
 			       u32 * seq_number);
+	/* Optional: tags of all chunks in a block, in one go, for the scan */
+	int (*read_block_tags_fn) (struct yaffs_dev * dev, int block_no,
+				   struct yaffs_ext_tags * tags);
+	/* Optional: data of consecutive chunks in one go, for read-ahead */
+	int (*read_chunks_fn) (struct yaffs_dev * dev, int nand_chunk,
+			       int n_chunks, u8 * data);
 #endif
 
 	/* The remove_obj_fn function must be supplied by OS flavours that
@@ -559,8 +591,27 @@ struct yaffs_param {
 	/* Callback to mark the superblock dirty */
 	void (*sb_dirty_fn) (struct yaffs_dev * dev);
 
+	/* Optional locking for OS flavours that read chunks without holding
+	 * their gross lock (see yaffs_rd_chunk_nand_unlocked).
+	 * flash_lock_fn serialises calls into the NAND access functions.
+	 * erase_lock_fn is held around erases, so that the unlocked readers
+	 * can keep a block from being erased under them.
+	 */
+	void (*flash_lock_fn) (struct yaffs_dev * dev);
+	void (*flash_unlock_fn) (struct yaffs_dev * dev);
+	void (*erase_lock_fn) (struct yaffs_dev * dev);
+	void (*erase_unlock_fn) (struct yaffs_dev * dev);
+
+	/* Optional: run read_block_tags_fn for block_no in the background,
+	 * storing its return value in *result. Only one is outstanding at a
+	 * time; wait_block_tags_fn waits for it to finish. Used by the scan.
+	 */
+	void (*start_block_tags_fn) (struct yaffs_dev * dev, int block_no,
+				     struct yaffs_ext_tags * tags, int *result);
+	void (*wait_block_tags_fn) (struct yaffs_dev * dev);
+
 	/*  Callback to control garbage collection. */
-	unsigned (*gc_control) (struct yaffs_dev * dev);
+	unsigned (*gc_control) (struct yaffs_dev * dev);	/* YAFFS_GC_CTRL_xxx */
 
 	/* Debug control flags. Don't use unless you know what you're doing */
 	int use_header_file_size;	/* Flag to determine if we should use file sizes from the header */
@@ -645,6 +696,9 @@ struct yaffs_dev {
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
+	int cold_alloc_block;	/* Block receiving gc copies (cold data) */
+	u32 cold_alloc_page;
+	int alloc_cold;		/* Set while gc copies, selects cold_alloc_block */
 
 	/* Object and Tnode memory management */
 	void *allocator;
@@ -685,7 +739,9 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Cached chunks by object and chunk id */
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* Free caches are kept at the tail */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -801,6 +857,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_map_chunks(struct yaffs_obj *in, loff_t offset, int n_bytes,
+			  int *nand_chunks, int max_chunks);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -18,6 +18,11 @@
 
 #include "yportenv.h"
 
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+
 struct yaffs_linux_context {
 	struct list_head context_list;	/* List of these we have mounted */
 	struct yaffs_dev *dev;
@@ -25,9 +30,21 @@ struct yaffs_linux_context {
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
 	struct mutex gross_lock;	/* Gross locking mutex*/
+	struct mutex flash_lock;	/* Serialises calls into the flash driver */
+	struct rw_semaphore erase_sem;	/* Held for read by readers that have
+					 * dropped gross_lock, so the chunks
+					 * they mapped are not erased yet.
+					 */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	struct mutex ra_lock;	/* Protects ra_buffer */
+	u8 *ra_buffer;		/* Bounce buffer for multi-chunk read-ahead */
+	struct work_struct tags_work;	/* Background block tags read */
+	struct completion tags_done;
+	int tags_block;
+	struct yaffs_ext_tags *tags_buffer;
+	int *tags_result;
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
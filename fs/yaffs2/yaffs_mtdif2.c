@@ -165,6 +165,78 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/* Read the tags of every chunk in a block with a single oob read, so that
+ * the mtd driver can stream the pages. Used by the mount scan; inband tags
+ * are not supported.
+ */
+int nandmtd2_read_block_tags(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct mtd_oob_ops ops;
+	struct yaffs_packed_tags2 pt;
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+	int n = dev->param.chunks_per_block;
+	u8 *oob;
+	int retval;
+	int i;
+
+	oob = kmalloc(n * mtd->oobavail, GFP_NOFS);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = n * mtd->oobavail;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, (loff_t) block_no * dev->param.chunks_per_block *
+			       dev->param.total_bytes_per_chunk, &ops);
+
+	/* The ecc status of a multi-page read does not say which page it
+	 * was for, so leave any trouble to the per-chunk reads.
+	 */
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < n; i++) {
+			memcpy(packed_tags_ptr, oob + i * mtd->oobavail,
+			       packed_tags_size);
+			yaffs_unpack_tags2(&tags[i], &pt,
+					   !dev->param.no_tags_ecc);
+		}
+	}
+
+	kfree(oob);
+
+	return (retval == 0 && ops.oobretlen == ops.ooblen) ?
+	    YAFFS_OK : YAFFS_FAIL;
+}
+
+/* Read the data of consecutive chunks with a single mtd read. Any ecc
+ * trouble fails the read, the caller then goes chunk by chunk so that it
+ * is accounted to the right block. Inband tags are not supported.
+ */
+int nandmtd2_read_chunks(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			 u8 * data)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	loff_t addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+	size_t len = n_chunks * dev->param.total_bytes_per_chunk;
+	size_t retlen = 0;
+	int retval;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_chunks chunk %d n %d data %p",
+		nand_chunk, n_chunks, data);
+
+	retval = mtd->read(mtd, addr, len, &retlen, data);
+
+	return (retval == 0 && retlen == len) ? YAFFS_OK : YAFFS_FAIL;
+}
+
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
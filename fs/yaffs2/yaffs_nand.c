@@ -17,6 +17,25 @@
 
 #include "yaffs_getblockinfo.h"
 
+/*
+ * The flash driver and its buffers are shared by everyone holding the gross
+ * lock and by readers that have dropped it (see yaffs_rd_chunk_nand_unlocked),
+ * so every call into the driver is made under the flash lock, if the OS
+ * flavour supplies one.
+ * Lock order: gross lock -> erase lock -> flash lock.
+ */
+void yaffs_flash_lock(struct yaffs_dev *dev)
+{
+	if (dev->param.flash_lock_fn)
+		dev->param.flash_lock_fn(dev);
+}
+
+void yaffs_flash_unlock(struct yaffs_dev *dev)
+{
+	if (dev->param.flash_unlock_fn)
+		dev->param.flash_unlock_fn(dev);
+}
+
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * buffer, struct yaffs_ext_tags *tags)
 {
@@ -25,12 +44,12 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 
 	int realigned_chunk = nand_chunk - dev->chunk_offset;
 
-	dev->n_page_reads++;
-
 	/* If there are no tags provided, use local tags to get prioritised gc working */
 	if (!tags)
 		tags = &local_tags;
 
+	yaffs_flash_lock(dev);
+	dev->n_page_reads++;
 	if (dev->param.read_chunk_tags_fn)
 		result =
 		    dev->param.read_chunk_tags_fn(dev, realigned_chunk, buffer,
@@ -38,6 +57,8 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	else
 		result = yaffs_tags_compat_rd(dev,
 					      realigned_chunk, buffer, tags);
+	yaffs_flash_unlock(dev);
+
 	if (tags && tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
 
 		struct yaffs_block_info *bi;
@@ -50,10 +71,67 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * Read the data of a chunk without the gross lock held. The caller must keep
+ * the block from being erased, as erase_lock_fn waits for, and the device
+ * must read through read_chunk_tags_fn without inband tags. Errors are not
+ * handled here, since that needs the block info: the caller retries with
+ * the gross lock held, which does.
+ */
+int yaffs_rd_chunk_nand_unlocked(struct yaffs_dev *dev, int nand_chunk,
+				 u8 * buffer)
+{
+	struct yaffs_ext_tags tags;
+	int result;
+
+	yaffs_flash_lock(dev);
+	dev->n_page_reads++;
+	result = dev->param.read_chunk_tags_fn(dev,
+					       nand_chunk - dev->chunk_offset,
+					       buffer, &tags);
+	yaffs_flash_unlock(dev);
+
+	if (result != YAFFS_OK ||
+	    tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+		return YAFFS_FAIL;
+	return YAFFS_OK;
+}
+
+/*
+ * As yaffs_rd_chunk_nand_unlocked(), for n_chunks consecutive chunks read
+ * into one buffer. Devices with a read_chunks_fn get a single multi-page
+ * read the driver can stream.
+ */
+int yaffs_rd_chunks_nand_unlocked(struct yaffs_dev *dev, int nand_chunk,
+				  int n_chunks, u8 * buffer)
+{
+	int result;
+	int i;
+
+	if (!dev->param.read_chunks_fn) {
+		for (i = 0; i < n_chunks; i++) {
+			if (yaffs_rd_chunk_nand_unlocked(dev, nand_chunk + i,
+					buffer + i * dev->data_bytes_per_chunk)
+			    != YAFFS_OK)
+				return YAFFS_FAIL;
+		}
+		return YAFFS_OK;
+	}
+
+	yaffs_flash_lock(dev);
+	dev->n_page_reads += n_chunks;
+	result = dev->param.read_chunks_fn(dev, nand_chunk - dev->chunk_offset,
+					   n_chunks, buffer);
+	yaffs_flash_unlock(dev);
+
+	return result;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
 {
+	int result;
 
 	dev->n_page_writes++;
 
@@ -74,21 +152,53 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 		YBUG();
 	}
 
+	yaffs_flash_lock(dev);
 	if (dev->param.write_chunk_tags_fn)
-		return dev->param.write_chunk_tags_fn(dev, nand_chunk, buffer,
-						      tags);
+		result = dev->param.write_chunk_tags_fn(dev, nand_chunk, buffer,
+							tags);
 	else
-		return yaffs_tags_compat_wr(dev, nand_chunk, buffer, tags);
+		result = yaffs_tags_compat_wr(dev, nand_chunk, buffer, tags);
+	yaffs_flash_unlock(dev);
+
+	return result;
+}
+
+/*
+ * Read the tags of a whole block. ECC trouble is not handled here, so on
+ * YAFFS_FAIL the caller falls back to yaffs_rd_chunk_tags_nand() per chunk.
+ */
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	int result;
+
+	if (!dev->param.read_block_tags_fn)
+		return YAFFS_FAIL;
+
+	block_no -= dev->block_offset;
+
+	yaffs_flash_lock(dev);
+	dev->n_page_reads += dev->param.chunks_per_block;
+	result = dev->param.read_block_tags_fn(dev, block_no, tags);
+	yaffs_flash_unlock(dev);
+
+	return result;
 }
 
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no)
 {
+	int result;
+
 	block_no -= dev->block_offset;
 
+	yaffs_flash_lock(dev);
 	if (dev->param.bad_block_fn)
-		return dev->param.bad_block_fn(dev, block_no);
+		result = dev->param.bad_block_fn(dev, block_no);
 	else
-		return yaffs_tags_compat_mark_bad(dev, block_no);
+		result = yaffs_tags_compat_mark_bad(dev, block_no);
+	yaffs_flash_unlock(dev);
+
+	return result;
 }
 
 int yaffs_query_init_block_state(struct yaffs_dev *dev,
@@ -96,14 +206,20 @@ int yaffs_query_init_block_state(struct yaffs_dev *dev,
 				 enum yaffs_block_state *state,
 				 u32 * seq_number)
 {
+	int result;
+
 	block_no -= dev->block_offset;
 
+	yaffs_flash_lock(dev);
 	if (dev->param.query_block_fn)
-		return dev->param.query_block_fn(dev, block_no, state,
-						 seq_number);
+		result = dev->param.query_block_fn(dev, block_no, state,
+						   seq_number);
 	else
-		return yaffs_tags_compat_query_block(dev, block_no,
-						     state, seq_number);
+		result = yaffs_tags_compat_query_block(dev, block_no,
+						       state, seq_number);
+	yaffs_flash_unlock(dev);
+
+	return result;
 }
 
 int yaffs_erase_block(struct yaffs_dev *dev, int flash_block)
@@ -114,14 +230,26 @@ int yaffs_erase_block(struct yaffs_dev *dev, int flash_block)
 
 	dev->n_erasures++;
 
+	/* Wait for unlocked readers that may have mapped a chunk in here */
+	if (dev->param.erase_lock_fn)
+		dev->param.erase_lock_fn(dev);
+	yaffs_flash_lock(dev);
 	result = dev->param.erase_fn(dev, flash_block);
+	yaffs_flash_unlock(dev);
+	if (dev->param.erase_unlock_fn)
+		dev->param.erase_unlock_fn(dev);
 
 	return result;
 }
 
 int yaffs_init_nand(struct yaffs_dev *dev)
 {
+	int result = YAFFS_OK;
+
+	yaffs_flash_lock(dev);
 	if (dev->param.initialise_flash_fn)
-		return dev->param.initialise_flash_fn(dev);
-	return YAFFS_OK;
+		result = dev->param.initialise_flash_fn(dev);
+	yaffs_flash_unlock(dev);
+
+	return result;
 }
@@ -33,6 +33,17 @@ int yaffs_query_init_block_state(struct yaffs_dev *dev,
 
 int yaffs_erase_block(struct yaffs_dev *dev, int flash_block);
 
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags);
+
 int yaffs_init_nand(struct yaffs_dev *dev);
 
+void yaffs_flash_lock(struct yaffs_dev *dev);
+void yaffs_flash_unlock(struct yaffs_dev *dev);
+
+int yaffs_rd_chunk_nand_unlocked(struct yaffs_dev *dev, int nand_chunk,
+				 u8 * buffer);
+int yaffs_rd_chunks_nand_unlocked(struct yaffs_dev *dev, int nand_chunk,
+				  int n_chunks, u8 * buffer);
+
 #endif
@@ -86,6 +86,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_attribs.h"
 
 #include "yaffs_linux.h"
+#include "yaffs_nand.h"
 
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
@@ -94,8 +95,10 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_trace_mask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
-unsigned int yaffs_gc_control = 1;
+unsigned int yaffs_gc_control = YAFFS_GC_CTRL_ENABLE;	/* YAFFS_GC_CTRL_xxx */
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_checkpoint_interval = 60;	/* seconds idle, 0 = off */
+unsigned int yaffs_n_caches = 32;	/* short op caches per mount */
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -103,6 +106,8 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_checkpoint_interval, uint, 0644);
+module_param(yaffs_n_caches, uint, 0444);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -133,6 +138,63 @@ static void yaffs_gross_unlock(struct yaffs_dev *dev)
 	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
+/*
+ * readpage drops the gross lock around the flash reads, so the guts need
+ * their own locks for the driver and for erases. See yaffs_nand.c.
+ */
+static void yaffs_flash_lock_callback(struct yaffs_dev *dev)
+{
+	mutex_lock(&(yaffs_dev_to_lc(dev)->flash_lock));
+}
+
+static void yaffs_flash_unlock_callback(struct yaffs_dev *dev)
+{
+	mutex_unlock(&(yaffs_dev_to_lc(dev)->flash_lock));
+}
+
+static void yaffs_erase_lock_callback(struct yaffs_dev *dev)
+{
+	down_write(&(yaffs_dev_to_lc(dev)->erase_sem));
+}
+
+static void yaffs_erase_unlock_callback(struct yaffs_dev *dev)
+{
+	up_write(&(yaffs_dev_to_lc(dev)->erase_sem));
+}
+
+/*
+ * The mount scan reads the tags of the next block while it processes the
+ * current one. The read runs on an unbound worker.
+ */
+static void yaffs_block_tags_work(struct work_struct *work)
+{
+	struct yaffs_linux_context *lc =
+	    container_of(work, struct yaffs_linux_context, tags_work);
+
+	*lc->tags_result = yaffs_rd_block_tags_nand(lc->dev, lc->tags_block,
+						    lc->tags_buffer);
+	complete(&lc->tags_done);
+}
+
+static void yaffs_start_block_tags_callback(struct yaffs_dev *dev,
+					    int block_no,
+					    struct yaffs_ext_tags *tags,
+					    int *result)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	lc->tags_block = block_no;
+	lc->tags_buffer = tags;
+	lc->tags_result = result;
+	INIT_COMPLETION(lc->tags_done);
+	queue_work(system_unbound_wq, &lc->tags_work);
+}
+
+static void yaffs_wait_block_tags_callback(struct yaffs_dev *dev)
+{
+	wait_for_completion(&(yaffs_dev_to_lc(dev)->tags_done));
+}
+
 static void yaffs_fill_inode_from_obj(struct inode *inode,
 				      struct yaffs_obj *obj);
 
@@ -1124,6 +1186,34 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 		sb->s_dirt = 1;
 }
 
+/* Most chunks a page can span and still be read without the gross lock */
+#define YAFFS_PAGE_MAX_CHUNKS	8
+
+/* Most pages yaffs_readpages() reads in one go, also the ra_buffer size */
+#define YAFFS_RA_MAX_PAGES	8
+
+/*
+ * Read chunks mapped by yaffs_file_map_chunks() into a page, with erase_sem
+ * held for read instead of the gross lock. This lets page cache misses go to
+ * flash in parallel with writers and gc, which hold the gross lock for longer.
+ */
+static int yaffs_readpage_unlocked(struct yaffs_dev *dev, u8 * pg_buf,
+				   const int *nand_chunks, int n_chunks)
+{
+	int i;
+
+	for (i = 0; i < n_chunks; i++) {
+		u8 *buf = pg_buf + i * dev->data_bytes_per_chunk;
+
+		if (nand_chunks[i] < 0)
+			memset(buf, 0, dev->data_bytes_per_chunk);
+		else if (yaffs_rd_chunk_nand_unlocked(dev, nand_chunks[i],
+						      buf) != YAFFS_OK)
+			return -EIO;
+	}
+	return 0;
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -1133,6 +1223,10 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	int ret;
 
 	struct yaffs_dev *dev;
+	struct yaffs_linux_context *lc;
+	int nand_chunks[YAFFS_PAGE_MAX_CHUNKS];
+	int n_chunks;
+	loff_t pos = (loff_t) pg->index << PAGE_CACHE_SHIFT;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_readpage_nolock at %08x, size %08x",
@@ -1142,6 +1236,7 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 
 	dev = obj->my_dev;
+	lc = yaffs_dev_to_lc(dev);
 
 	BUG_ON(!PageLocked(pg));
 
@@ -1150,11 +1245,30 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 
 	yaffs_gross_lock(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	n_chunks = yaffs_file_map_chunks(obj, pos, PAGE_CACHE_SIZE,
+					 nand_chunks, YAFFS_PAGE_MAX_CHUNKS);
+	if (n_chunks >= 0) {
+		/* Keep the mapped chunks from being erased under us */
+		down_read(&lc->erase_sem);
+		yaffs_gross_unlock(dev);
+
+		ret = yaffs_readpage_unlocked(dev, pg_buf, nand_chunks,
+					      n_chunks);
+		up_read(&lc->erase_sem);
+
+		if (ret == 0)
+			goto done;
+
+		/* Go round again the slow way, which handles the error */
+		yaffs_gross_lock(dev);
+	}
+
+	ret = yaffs_file_rd(obj, pg_buf, pos, PAGE_CACHE_SIZE);
 
 	yaffs_gross_unlock(dev);
 
+done:
+
 	if (ret >= 0)
 		ret = 0;
 
@@ -1190,6 +1304,174 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return ret;
 }
 
+/*
+ * Read-ahead. The pages of a batch are mapped to chunks under one gross lock
+ * hold, then read with erase_sem held for read as in yaffs_readpage_nolock().
+ * Runs of chunks that are consecutive in a block are read with one multi-page
+ * read into ra_buffer, so sequential reads stream from flash instead of going
+ * a chunk at a time. Pages that cannot be done this way take the readpage
+ * path.
+ */
+struct yaffs_ra_batch {
+	struct page *pages[YAFFS_RA_MAX_PAGES];
+	u8 *bufs[YAFFS_RA_MAX_PAGES];
+	int n_chunks[YAFFS_RA_MAX_PAGES];	/* per page, -1 = slow path */
+	int nand_chunks[YAFFS_RA_MAX_PAGES][YAFFS_PAGE_MAX_CHUNKS];
+	int n_pages;
+};
+
+/* Read pages first..last-1, which all map the same number of chunks */
+static void yaffs_readpages_run(struct yaffs_dev *dev,
+				struct yaffs_ra_batch *ra, int first, int last)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	int per_page = ra->n_chunks[first];
+	int total = (last - first) * per_page;
+	int max_run = (YAFFS_RA_MAX_PAGES << PAGE_CACHE_SHIFT) /
+	    dev->data_bytes_per_chunk;
+	int bytes = dev->data_bytes_per_chunk;
+	int f;
+	int run;
+	int i;
+	int ok;
+
+#define RA_CHUNK(f)	ra->nand_chunks[first + (f) / per_page][(f) % per_page]
+#define RA_BUF(f)	(ra->bufs[first + (f) / per_page] + ((f) % per_page) * bytes)
+
+	for (f = 0; f < total; f += run) {
+		int chunk = RA_CHUNK(f);
+
+		run = 1;
+		if (chunk < 0) {
+			memset(RA_BUF(f), 0, bytes);
+			continue;
+		}
+
+		if (lc->ra_buffer)
+			while (f + run < total && run < max_run &&
+			       RA_CHUNK(f + run) == chunk + run &&
+			       (chunk + run) % dev->param.chunks_per_block)
+				run++;
+
+		if (run == 1) {
+			ok = (yaffs_rd_chunk_nand_unlocked(dev, chunk,
+							   RA_BUF(f)) ==
+			      YAFFS_OK);
+		} else {
+			ok = (yaffs_rd_chunks_nand_unlocked(dev, chunk, run,
+							    lc->ra_buffer) ==
+			      YAFFS_OK);
+			for (i = 0; ok && i < run; i++)
+				memcpy(RA_BUF(f + i),
+				       lc->ra_buffer + i * bytes, bytes);
+		}
+
+		/* Leave the pages touched by a failed read to readpage */
+		if (!ok)
+			for (i = f; i < f + run; i++)
+				ra->n_chunks[first + i / per_page] = -1;
+	}
+
+#undef RA_CHUNK
+#undef RA_BUF
+}
+
+static void yaffs_readpages_batch(struct file *f, struct yaffs_ra_batch *ra)
+{
+	struct yaffs_obj *obj = yaffs_dentry_to_obj(f->f_dentry);
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct page *pg;
+	int i;
+	int j;
+
+	yaffs_gross_lock(dev);
+	for (i = 0; i < ra->n_pages; i++)
+		ra->n_chunks[i] =
+		    yaffs_file_map_chunks(obj,
+					  (loff_t) ra->pages[i]->index <<
+					  PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE,
+					  ra->nand_chunks[i],
+					  YAFFS_PAGE_MAX_CHUNKS);
+	/* Keep the mapped chunks from being erased under us */
+	down_read(&lc->erase_sem);
+	yaffs_gross_unlock(dev);
+
+	mutex_lock(&lc->ra_lock);
+	for (i = 0; i < ra->n_pages; i = j) {
+		j = i + 1;
+		if (ra->n_chunks[i] < 0)
+			continue;
+		while (j < ra->n_pages && ra->n_chunks[j] == ra->n_chunks[i] &&
+		       ra->pages[j]->index == ra->pages[j - 1]->index + 1)
+			j++;
+		yaffs_readpages_run(dev, ra, i, j);
+	}
+	mutex_unlock(&lc->ra_lock);
+
+	up_read(&lc->erase_sem);
+
+	for (i = 0; i < ra->n_pages; i++) {
+		pg = ra->pages[i];
+		if (ra->n_chunks[i] < 0) {
+			kunmap(pg);
+			yaffs_readpage_unlock(f, pg);
+		} else {
+			SetPageUptodate(pg);
+			ClearPageError(pg);
+			flush_dcache_page(pg);
+			kunmap(pg);
+			UnlockPage(pg);
+		}
+		page_cache_release(pg);
+	}
+	ra->n_pages = 0;
+}
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+			   struct list_head *pages, unsigned nr_pages)
+{
+	struct yaffs_ra_batch *ra;
+	struct page *pg;
+	unsigned i;
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages %u", nr_pages);
+
+	ra = kmalloc(sizeof(*ra), GFP_KERNEL);
+	if (ra)
+		ra->n_pages = 0;
+
+	for (i = 0; i < nr_pages; i++) {
+		pg = list_entry(pages->prev, struct page, lru);
+		list_del(&pg->lru);
+		if (add_to_page_cache_lru(pg, mapping, pg->index,
+					  GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (!ra) {
+			yaffs_readpage_unlock(f, pg);
+			page_cache_release(pg);
+			continue;
+		}
+
+		ra->pages[ra->n_pages] = pg;
+		ra->bufs[ra->n_pages] = kmap(pg);
+		if (++ra->n_pages == YAFFS_RA_MAX_PAGES)
+			yaffs_readpages_batch(f, ra);
+	}
+
+	if (ra) {
+		if (ra->n_pages)
+			yaffs_readpages_batch(f, ra);
+		kfree(ra);
+	}
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages done");
+	return 0;
+}
+
 /* writepage inspired by/stolen from smbfs */
 
 static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
@@ -1621,8 +1903,10 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long next_checkpoint = now;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 last_writes = dev->n_page_writes;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1667,10 +1951,35 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
+
+		/*
+		 * Write a checkpoint once the device has been idle for a while
+		 * rather than only at sync/unmount, so that a mount after an
+		 * unclean shutdown can mostly skip the full scan.
+		 */
+		if (yaffs_checkpoint_interval && yaffs_bg_enable &&
+		    !dev->is_checkpointed) {
+			if (dev->n_page_writes != last_writes) {
+				last_writes = dev->n_page_writes;
+				next_checkpoint =
+				    now + yaffs_checkpoint_interval * HZ;
+			} else if (time_after(now, next_checkpoint) &&
+				   !yaffs_bg_gc_urgency(dev)) {
+				yaffs_trace(YAFFS_TRACE_BACKGROUND,
+					"yaffs_background: idle checkpoint");
+				yaffs_flush_super(context->super, 1);
+				last_writes = dev->n_page_writes;
+				next_checkpoint =
+				    now + yaffs_checkpoint_interval * HZ;
+			}
+		}
 		yaffs_gross_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
+		if (yaffs_checkpoint_interval && !dev->is_checkpointed &&
+		    time_before(next_checkpoint, expires))
+			expires = next_checkpoint;
 		if (time_before(expires, now))
 			expires = now + HZ;
 
@@ -1831,6 +2140,7 @@ static int yaffs_parse_options(struct yaffs_options *options,
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+	.readpages = yaffs_readpages,
 	.writepage = yaffs_writepage,
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -1984,6 +2294,9 @@ static void yaffs_put_super(struct super_block *sb)
 		yaffs_dev_to_lc(dev)->spare_buffer = NULL;
 	}
 
+	kfree(yaffs_dev_to_lc(dev)->ra_buffer);
+	yaffs_dev_to_lc(dev)->ra_buffer = NULL;
+
 	kfree(dev);
 }
 
@@ -2214,7 +2527,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 : yaffs_n_caches;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2261,6 +2574,13 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
+		if (!param->inband_tags) {
+			param->read_block_tags_fn = nandmtd2_read_block_tags;
+			param->read_chunks_fn = nandmtd2_read_chunks;
+			yaffs_dev_to_lc(dev)->ra_buffer =
+			    kmalloc(YAFFS_RA_MAX_PAGES * PAGE_CACHE_SIZE,
+				    GFP_NOFS);
+		}
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
@@ -2319,7 +2639,19 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
+	param->flash_lock_fn = yaffs_flash_lock_callback;
+	param->flash_unlock_fn = yaffs_flash_unlock_callback;
+	param->erase_lock_fn = yaffs_erase_lock_callback;
+	param->erase_unlock_fn = yaffs_erase_unlock_callback;
+	param->start_block_tags_fn = yaffs_start_block_tags_callback;
+	param->wait_block_tags_fn = yaffs_wait_block_tags_callback;
+
 	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_init(&(yaffs_dev_to_lc(dev)->flash_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->erase_sem));
+	mutex_init(&(yaffs_dev_to_lc(dev)->ra_lock));
+	INIT_WORK(&(yaffs_dev_to_lc(dev)->tags_work), yaffs_block_tags_work);
+	init_completion(&(yaffs_dev_to_lc(dev)->tags_done));
 
 	yaffs_gross_lock(dev);
 
@@ -2444,8 +2776,25 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	return buf;
 }
 
+/*
+ * Write amplification: every chunk programmed per chunk the host asked
+ * for, in hundredths. Checkpoint writes count against it as well.
+ */
+static u32 yaffs_write_amp(struct yaffs_dev *dev)
+{
+	u32 host_writes = dev->n_page_writes - dev->n_gc_copies;
+	u64 amp = (u64) dev->n_page_writes * 100;
+
+	if (!host_writes)
+		return 100;
+	do_div(amp, host_writes);
+	return (u32) amp;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	u32 amp = yaffs_write_amp(dev);
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2464,6 +2813,9 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures............ %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies........... %u\n", dev->n_gc_copies);
+	buf +=
+	    sprintf(buf, "write_amplification... %u.%02u\n", amp / 100,
+		    amp % 100);
 	buf += sprintf(buf, "all_gcs............... %u\n", dev->all_gcs);
 	buf +=
 	    sprintf(buf, "passive_gc_count...... %u\n", dev->passive_gc_count);
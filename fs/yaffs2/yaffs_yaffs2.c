@@ -108,6 +108,12 @@ void yaffs2_update_oldest_dirty_seq(struct yaffs_dev *dev, unsigned block_no,
 	if (!dev->param.is_yaffs2)
 		return;
 
+	/* The cold allocation block can be older than full blocks and must
+	 * not be picked while it is still being written.
+	 */
+	if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING)
+		return;
+
 	if (dev->oldest_dirty_seq) {
 		if (dev->oldest_dirty_seq > bi->seq_number) {
 			dev->oldest_dirty_seq = bi->seq_number;
@@ -125,6 +131,14 @@ int yaffs_block_ok_for_gc(struct yaffs_dev *dev, struct yaffs_block_info *bi)
 	if (!bi->has_shrink_hdr)
 		return 1;	/* can gc */
 
+	/* The open cold block is not full so the oldest dirty tracking does
+	 * not see it, but it may hold chunks this shrink header hides.
+	 */
+	if (dev->cold_alloc_block > 0 &&
+	    yaffs_get_block_info(dev, dev->cold_alloc_block)->seq_number <
+	    bi->seq_number)
+		return 0;
+
 	yaffs2_find_oldest_dirty_seq(dev);
 
 	/* Can't do gc of this block if there are any blocks older than this one that have
@@ -343,6 +357,7 @@ static int yaffs2_wr_checkpt_dev(struct yaffs_dev *dev)
 static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 {
 	struct yaffs_checkpt_dev cp;
+	u32 i;
 	u32 n_bytes;
 	u32 n_blocks =
 	    (dev->internal_end_block - dev->internal_start_block + 1);
@@ -364,6 +379,18 @@ static int yaffs2_rd_checkpt_dev(struct yaffs_dev *dev)
 
 	if (!ok)
 		return 0;
+
+	/* The cold allocation block is not carried over, close it off the
+	 * way scanning closes a partially written block.
+	 */
+	for (i = 0; i < n_blocks; i++) {
+		if (dev->block_info[i].block_state ==
+		    YAFFS_BLOCK_STATE_ALLOCATING &&
+		    i + dev->internal_start_block != dev->alloc_block)
+			dev->block_info[i].block_state =
+			    YAFFS_BLOCK_STATE_FULL;
+	}
+
 	n_bytes = n_blocks * dev->chunk_bit_stride;
 
 	ok = (yaffs2_checkpt_rd(dev, dev->chunk_bits, n_bytes) == n_bytes);
@@ -954,6 +981,93 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Scan readahead.
+ * While the scan works through the chunks of one block, the OS glue reads the
+ * tags of the next block to scan with a single read_block_tags_fn call in the
+ * background (start_block_tags_fn). The flash is then kept busy while the
+ * scan creates objects and tnodes.
+ */
+struct yaffs2_scan_ra {
+	struct yaffs_dev *dev;
+	int blk;			/* block being read ahead, or -1 */
+	int result;
+	struct yaffs_ext_tags *tags;	/* being read ahead */
+	struct yaffs_ext_tags *cur;	/* handed to the scan */
+};
+
+static void yaffs2_scan_ra_start(struct yaffs2_scan_ra *ra, int blk)
+{
+	ra->blk = blk;
+	ra->dev->param.start_block_tags_fn(ra->dev, blk, ra->tags, &ra->result);
+}
+
+static struct yaffs2_scan_ra *yaffs2_scan_ra_alloc(struct yaffs_dev *dev)
+{
+	struct yaffs2_scan_ra *ra;
+	int n = dev->param.chunks_per_block;
+
+	if (!dev->param.read_block_tags_fn ||
+	    !dev->param.start_block_tags_fn ||
+	    !dev->param.wait_block_tags_fn)
+		return NULL;
+
+	ra = kmalloc(sizeof(*ra), GFP_NOFS);
+	if (!ra)
+		return NULL;
+	ra->tags = kmalloc(n * sizeof(struct yaffs_ext_tags), GFP_NOFS);
+	ra->cur = kmalloc(n * sizeof(struct yaffs_ext_tags), GFP_NOFS);
+	if (!ra->tags || !ra->cur) {
+		kfree(ra->tags);
+		kfree(ra->cur);
+		kfree(ra);
+		return NULL;
+	}
+
+	ra->dev = dev;
+	ra->blk = -1;
+	return ra;
+}
+
+static void yaffs2_scan_ra_free(struct yaffs2_scan_ra *ra)
+{
+	if (!ra)
+		return;
+	if (ra->blk >= 0)
+		ra->dev->param.wait_block_tags_fn(ra->dev);
+	kfree(ra->tags);
+	kfree(ra->cur);
+	kfree(ra);
+}
+
+/*
+ * Collect the tags of blk, which must be the block being read ahead, and
+ * start reading ahead next_blk (if >= 0). Returns NULL if blk has to be
+ * read chunk by chunk instead.
+ */
+static struct yaffs_ext_tags *yaffs2_scan_ra_get(struct yaffs2_scan_ra *ra,
+						 int blk, int next_blk)
+{
+	struct yaffs_ext_tags *tags;
+	int result;
+
+	if (!ra || ra->blk != blk)
+		return NULL;
+
+	ra->dev->param.wait_block_tags_fn(ra->dev);
+	result = ra->result;
+
+	tags = ra->tags;
+	ra->tags = ra->cur;
+	ra->cur = tags;
+	ra->blk = -1;
+
+	if (next_blk >= 0)
+		yaffs2_scan_ra_start(ra, next_blk);
+
+	return (result == YAFFS_OK) ? tags : NULL;
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -986,6 +1100,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs2_scan_ra *ra = NULL;
+	struct yaffs_ext_tags *block_tags;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1086,6 +1202,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	if (n_to_scan > 0) {
+		ra = yaffs2_scan_ra_alloc(dev);
+		if (ra)
+			yaffs2_scan_ra_start(ra, block_index[end_iter].block);
+	}
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1224,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		block_tags = yaffs2_scan_ra_get(ra, blk, (block_iter > start_iter) ?
+						block_index[block_iter - 1].block :
+						-1);
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1240,15 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (block_tags) {
+				tags = block_tags[c];
+				result = YAFFS_OK;
+				if (tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+					yaffs_handle_chunk_error(dev, bi);
+			} else {
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
+			}
 
 			/* Let's have a good look at this chunk... */
 
@@ -1573,6 +1706,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	}
 
+	yaffs2_scan_ra_free(ra);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -52,6 +52,20 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events passed to oom_adj notifiers along with the task_struct. They
+ * are only sent for whole processes, not for individual threads.
+ */
+enum oom_adj_event {
+	OOM_ADJ_FORK,		/* new process, not yet running */
+	OOM_ADJ_CHANGE,		/* oom_adj/oom_score_adj written */
+	OOM_ADJ_EXIT,		/* last thread of the process exiting */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *tsk);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
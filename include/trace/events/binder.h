@@ -0,0 +1,61 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction_enqueue,
+	TP_PROTO(int debug_id, int to_proc, int to_thread, int reply,
+		 unsigned int code),
+	TP_ARGS(debug_id, to_proc, to_thread, reply, code),
+
+	TP_STRUCT__entry(
+	    __field(int,          debug_id  )
+	    __field(int,          to_proc   )
+	    __field(int,          to_thread )
+	    __field(int,          reply     )
+	    __field(unsigned int, code      )
+	),
+
+	TP_fast_assign(
+	    __entry->debug_id = debug_id;
+	    __entry->to_proc = to_proc;
+	    __entry->to_thread = to_thread;
+	    __entry->reply = reply;
+	    __entry->code = code;
+	),
+
+	TP_printk("transaction=%d dest=%d:%d reply=%d code=0x%x",
+	      __entry->debug_id, __entry->to_proc, __entry->to_thread,
+	      __entry->reply, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_dequeue,
+	TP_PROTO(int debug_id, int proc, int thread, u64 latency_ns),
+	TP_ARGS(debug_id, proc, thread, latency_ns),
+
+	TP_STRUCT__entry(
+	    __field(int, debug_id   )
+	    __field(int, proc       )
+	    __field(int, thread     )
+	    __field(u64, latency_ns )
+	),
+
+	TP_fast_assign(
+	    __entry->debug_id = debug_id;
+	    __entry->proc = proc;
+	    __entry->thread = thread;
+	    __entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("transaction=%d thread=%d:%d latency=%llu ns",
+	      __entry->debug_id, __entry->proc, __entry->thread,
+	      __entry->latency_ns)
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,38 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+	TP_PROTO(int min_adj, int pid, int oom_adj, int tasksize,
+		 u64 latency_ns),
+	TP_ARGS(min_adj, pid, oom_adj, tasksize, latency_ns),
+
+	TP_STRUCT__entry(
+	    __field(int, min_adj    )
+	    __field(int, pid        )
+	    __field(int, oom_adj    )
+	    __field(int, tasksize   )
+	    __field(u64, latency_ns )
+	),
+
+	TP_fast_assign(
+	    __entry->min_adj = min_adj;
+	    __entry->pid = pid;
+	    __entry->oom_adj = oom_adj;
+	    __entry->tasksize = tasksize;
+	    __entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("min_adj=%d pid=%d adj=%d size=%d latency=%llu ns",
+	      __entry->min_adj, __entry->pid, __entry->oom_adj,
+	      __entry->tasksize, __entry->latency_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -973,6 +973,7 @@ NORET_TYPE void do_exit(long code)
 		exit_itimers(tsk->signal);
 		if (tsk->mm)
 			setmax_mm_hiwater_rss(&tsk->signal->maxrss, tsk->mm);
+		oom_adj_notify(OOM_ADJ_EXIT, tsk);
 	}
 	acct_collect(code, group_dead);
 	if (group_dead)
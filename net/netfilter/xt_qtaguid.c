@@ -15,10 +15,12 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
+#include <linux/rculist.h>
 #include <linux/skbuff.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
@@ -187,17 +189,22 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *     iface_stat_list_lock
  *
  * qtaguid_mt()
+ *   iface_stat_update_from_skb()
+ *     rcu_read_lock_bh()
+ *       (iface_stat_hash)
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       rcu_read_lock_bh()
+ *         (iface_stat_hash)
+ *         get_sock_stat()
+ *           (sock_tag_hash)
+ *         struct iface_stat->tag_stat_list_lock
+ *           tag_stat_update()
+ *             get_active_counter_set()
+ *               tag_counter_set_list_lock
+ *           tag_stat_update()
+ *             get_active_counter_set()
+ *               tag_counter_set_list_lock
  *
  *
  * qtaguid_ctrl_parse()
@@ -225,9 +232,21 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
 static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
+/*
+ * The per-packet path finds its iface_stat and sock_tag through these
+ * hashes under rcu_read_lock_bh() instead of taking the global locks.
+ * They are only modified with iface_stat_list_lock, respectively
+ * sock_tag_list_lock held, alongside iface_stat_list and sock_tag_tree.
+ */
+#define IFACE_STAT_HASH_BITS 4
+static struct hlist_head iface_stat_hash[1 << IFACE_STAT_HASH_BITS];
+
 static struct rb_root sock_tag_tree = RB_ROOT;
 static DEFINE_SPINLOCK(sock_tag_list_lock);
 
+#define SOCK_TAG_HASH_BITS 8
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
+
 static struct rb_root tag_counter_set_tree = RB_ROOT;
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
@@ -419,6 +438,45 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+static struct hlist_head *sock_tag_hash_head(const struct sock *sk)
+{
+	return &sock_tag_hash[hash_ptr((void *)sk, SOCK_TAG_HASH_BITS)];
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_link(struct sock_tag *st_entry)
+{
+	sock_tag_tree_insert(st_entry, &sock_tag_tree);
+	hlist_add_head_rcu(&st_entry->hash_node,
+			   sock_tag_hash_head(st_entry->sk));
+}
+
+/*
+ * Caller must hold sock_tag_list_lock.
+ * The entry can still be seen by the per-packet path until an RCU-bh
+ * grace period has elapsed, see sock_tag_tree_erase().
+ */
+static void sock_tag_unlink(struct sock_tag *st_entry)
+{
+	rb_erase(&st_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&st_entry->hash_node);
+}
+
+/* Caller must hold sock_tag_list_lock */
+static void sock_tag_replace(struct sock_tag *old, struct sock_tag *new)
+{
+	rb_replace_node(&old->sock_node, &new->sock_node, &sock_tag_tree);
+	hlist_replace_rcu(&old->hash_node, &new->hash_node);
+	/* See ctrl_cmd_delete() for sock_tags not on a pqd list */
+	if (old->list.next && old->list.prev)
+		list_replace(&old->list, &new->list);
+}
+
+static void sock_tag_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct sock_tag, rcu));
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -435,7 +493,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		call_rcu_bh(&st_entry->rcu, sock_tag_free_rcu);
 	}
 }
 
@@ -788,6 +846,50 @@ done:
 	return iface_entry;
 }
 
+/*
+ * Find the entry for tracking the specified device, for the per-packet path.
+ * Caller must be in an rcu_read_lock_bh() section.
+ * iface_entries are not deleted, so the result stays valid after it.
+ */
+static struct iface_stat *get_iface_entry_rcu(const struct net_device *dev)
+{
+	struct iface_stat *iface_entry;
+	struct hlist_node *pos;
+	int ifindex = dev->ifindex;
+
+	hlist_for_each_entry_rcu_bh(iface_entry, pos,
+			&iface_stat_hash[hash_32(ifindex, IFACE_STAT_HASH_BITS)],
+			hash_node) {
+		if (iface_entry->ifindex == ifindex
+		    && !strcmp(dev->name, iface_entry->ifname))
+			return iface_entry;
+	}
+	return NULL;
+}
+
+/*
+ * (Re)hash the entry under the ifindex of the net_dev it is now tracking.
+ * Caller must hold iface_stat_list_lock
+ */
+static void iface_stat_rehash(struct iface_stat *entry,
+			      const struct net_device *net_dev)
+{
+	if (!hlist_unhashed(&entry->hash_node)) {
+		if (entry->ifindex == net_dev->ifindex)
+			return;
+		/*
+		 * The device came back with a new ifindex. A lookup walking
+		 * past this entry right now can miss its own iface; that
+		 * packet just won't be accounted.
+		 */
+		hlist_del_rcu(&entry->hash_node);
+	}
+	entry->ifindex = net_dev->ifindex;
+	hlist_add_head_rcu(&entry->hash_node,
+			   &iface_stat_hash[hash_32(entry->ifindex,
+						    IFACE_STAT_HASH_BITS)]);
+}
+
 static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				    off_t items_to_skip, int char_count,
 				    int *eof, void *data)
@@ -799,6 +901,7 @@ static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 	struct iface_stat *iface_entry;
 	struct rtnl_link_stats64 dev_stats, *stats;
 	struct rtnl_link_stats64 no_dev_stats = {0};
+	struct byte_packet_counters skb_totals[IFS_MAX_DIRECTIONS];
 
 	if (unlikely(module_passive)) {
 		*eof = 1;
@@ -866,15 +969,16 @@ static int iface_stat_fmt_proc_read(char *page, char **num_items_returned,
 				stats->tx_bytes, stats->tx_packets
 				);
 		} else {
+			iface_stat_get_skb_totals(iface_entry, skb_totals);
 			len = snprintf(
 				outp, char_count,
 				"%s "
 				"%llu %llu %llu %llu\n",
 				iface_entry->ifname,
-				iface_entry->totals_via_skb[IFS_RX].bytes,
-				iface_entry->totals_via_skb[IFS_RX].packets,
-				iface_entry->totals_via_skb[IFS_TX].bytes,
-				iface_entry->totals_via_skb[IFS_TX].packets
+				skb_totals[IFS_RX].bytes,
+				skb_totals[IFS_RX].packets,
+				skb_totals[IFS_TX].bytes,
+				skb_totals[IFS_TX].packets
 				);
 		}
 		if (len >= char_count) {
@@ -961,7 +1065,8 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	struct iface_stat *new_iface;
 	struct iface_stat_work *isw;
 
-	new_iface = kzalloc(sizeof(*new_iface), GFP_ATOMIC);
+	new_iface = kzalloc(sizeof(*new_iface) + nr_cpu_ids *
+			    sizeof(new_iface->skb_counters[0]), GFP_ATOMIC);
 	if (new_iface == NULL) {
 		pr_err("qtaguid: iface_stat: create(%s): "
 		       "iface_stat alloc failed\n", net_dev->name);
@@ -995,6 +1100,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
 	list_add(&new_iface->list, &iface_stat_list);
+	iface_stat_rehash(new_iface, net_dev);
 	return new_iface;
 }
 
@@ -1097,6 +1203,8 @@ static void iface_stat_create(struct net_device *net_dev,
 			 ifname, entry);
 		iface_check_stats_reset_and_adjust(net_dev, entry);
 		_iface_stat_set_active(entry, net_dev, activate);
+		if (activate)
+			iface_stat_rehash(entry, net_dev);
 		IF_DEBUG("qtaguid: %s(%s): "
 			 "tracking now %d on ip=%pI4\n", __func__,
 			 entry->ifname, activate, &ipaddr);
@@ -1159,6 +1267,8 @@ static void iface_stat_create_ipv6(struct net_device *net_dev,
 			 ifname, entry);
 		iface_check_stats_reset_and_adjust(net_dev, entry);
 		_iface_stat_set_active(entry, net_dev, activate);
+		if (activate)
+			iface_stat_rehash(entry, net_dev);
 		IF_DEBUG("qtaguid: %s(%s): "
 			 "tracking now %d on ip=%pI6c\n", __func__,
 			 entry->ifname, activate, &ifa->addr);
@@ -1186,16 +1296,20 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
+/* Caller must be in an rcu_read_lock_bh() section */
 static struct sock_tag *get_sock_stat(const struct sock *sk)
 {
 	struct sock_tag *sock_tag_entry;
+	struct hlist_node *pos;
 	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
 	if (!sk)
 		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	hlist_for_each_entry_rcu_bh(sock_tag_entry, pos,
+				    sock_tag_hash_head(sk), hash_node) {
+		if (sock_tag_entry->sk == sk)
+			return sock_tag_entry;
+	}
+	return NULL;
 }
 
 static int ipx_proto(const struct sk_buff *skb,
@@ -1302,6 +1416,7 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 				       struct xt_action_param *par)
 {
 	struct iface_stat *entry;
+	struct iface_skb_counters *isc;
 	const struct net_device *el_dev;
 	enum ifs_tx_rx direction = par->in ? IFS_RX : IFS_TX;
 	int bytes = skb->len;
@@ -1336,21 +1451,25 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 			 par->family, proto);
 	}
 
-	spin_lock_bh(&iface_stat_list_lock);
-	entry = get_iface_entry(el_dev->name);
+	rcu_read_lock_bh();
+	entry = get_iface_entry_rcu(el_dev);
 	if (entry == NULL) {
 		IF_DEBUG("qtaguid: iface_stat: %s(%s): not tracked\n",
 			 __func__, el_dev->name);
-		spin_unlock_bh(&iface_stat_list_lock);
+		rcu_read_unlock_bh();
 		return;
 	}
 
 	IF_DEBUG("qtaguid: %s(%s): entry=%p\n", __func__,
 		 el_dev->name, entry);
 
-	entry->totals_via_skb[direction].bytes += bytes;
-	entry->totals_via_skb[direction].packets++;
-	spin_unlock_bh(&iface_stat_list_lock);
+	/* BHs are off, so this cpu's counters are ours. */
+	isc = &entry->skb_counters[smp_processor_id()];
+	u64_stats_update_begin(&isc->syncp);
+	isc->bpc[direction].bytes += bytes;
+	isc->bpc[direction].packets++;
+	u64_stats_update_end(&isc->syncp);
+	rcu_read_unlock_bh();
 }
 
 static void tag_stat_update(struct tag_stat *tag_entry,
@@ -1392,7 +1511,7 @@ done:
 	return new_tag_stat_entry;
 }
 
-static void if_tag_stat_update(const char *ifname, uid_t uid,
+static void if_tag_stat_update(const struct net_device *dev, uid_t uid,
 			       const struct sock *sk, enum ifs_tx_rx direction,
 			       int proto, int bytes)
 {
@@ -1405,19 +1524,20 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	struct tag_stat *new_tag_stat = NULL;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
-		 ifname, uid, sk, direction, proto, bytes);
-
+		 dev->name, uid, sk, direction, proto, bytes);
 
-	iface_entry = get_iface_entry(ifname);
+	rcu_read_lock_bh();
+	iface_entry = get_iface_entry_rcu(dev);
 	if (!iface_entry) {
 		pr_err("qtaguid: iface_stat: stat_update() %s not found\n",
-		       ifname);
+		       dev->name);
+		rcu_read_unlock_bh();
 		return;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
 	MT_DEBUG("qtaguid: iface_stat: stat_update() dev=%s entry=%p\n",
-		 ifname, iface_entry);
+		 dev->name, iface_entry);
 
 	/*
 	 * Look for a tagged sock.
@@ -1448,6 +1568,7 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		 */
 		tag_stat_update(tag_stat_entry, direction, proto, bytes);
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+		rcu_read_unlock_bh();
 		return;
 	}
 
@@ -1483,6 +1604,7 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	}
 	tag_stat_update(new_tag_stat, direction, proto, bytes);
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+	rcu_read_unlock_bh();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1729,7 +1851,7 @@ static void account_for_uid(const struct sk_buff *skb,
 			 par->hooknum, el_dev->name, el_dev->type,
 			 par->family, proto);
 
-		if_tag_stat_update(el_dev->name, uid,
+		if_tag_stat_update(el_dev, uid,
 				skb->sk ? skb->sk : alternate_sk,
 				par->in ? IFS_RX : IFS_TX,
 				proto, skb->len);
@@ -2094,7 +2216,7 @@ static int ctrl_cmd_delete(const char *input)
 			 input, st_entry->tag, entry_uid);
 
 		if (!acct_tag || st_entry->tag == tag) {
-			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			sock_tag_unlink(st_entry);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -2324,11 +2446,27 @@ static int ctrl_cmd_tag(const char *input)
 	tag_ref_entry->num_sock_tags++;
 	if (sock_tag_entry) {
 		struct tag_ref *prev_tag_ref_entry;
+		struct sock_tag *new_sock_tag_entry;
 
 		CT_DEBUG("qtaguid: ctrl_tag(%s): retag for sk=%p "
 			 "st@%p ...->f_count=%ld\n",
 			 input, el_socket->sk, sock_tag_entry,
 			 atomic_long_read(&el_socket->file->f_count));
+		/*
+		 * The per-packet path reads the tag without any lock, and a
+		 * 64bit store isn't atomic here. So publish a new sock_tag.
+		 */
+		new_sock_tag_entry = kmemdup(sock_tag_entry,
+					     sizeof(*new_sock_tag_entry),
+					     GFP_ATOMIC);
+		if (!new_sock_tag_entry) {
+			pr_err("qtaguid: ctrl_tag(%s): "
+			       "socket tag alloc failed\n",
+			       input);
+			spin_unlock_bh(&sock_tag_list_lock);
+			res = -ENOMEM;
+			goto err_tag_unref_put;
+		}
 		/*
 		 * This is a re-tagging, so release the sock_fd that was
 		 * locked at the time of the 1st tagging.
@@ -2341,7 +2479,10 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
-		sock_tag_entry->tag = full_tag;
+		new_sock_tag_entry->tag = full_tag;
+		sock_tag_replace(sock_tag_entry, new_sock_tag_entry);
+		call_rcu_bh(&sock_tag_entry->rcu, sock_tag_free_rcu);
+		sock_tag_entry = new_sock_tag_entry;
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2380,7 +2521,7 @@ static int ctrl_cmd_tag(const char *input)
 				 &pqd_entry->sock_tag_list);
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
-		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_link(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2446,7 +2587,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * The socket already belongs to the current process
 	 * so it can do whatever it wants to it.
 	 */
-	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	sock_tag_unlink(sock_tag_entry);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2483,7 +2624,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	call_rcu_bh(&sock_tag_entry->rcu, sock_tag_free_rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2848,7 +2989,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		tr->num_sock_tags--;
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
-		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		sock_tag_unlink(st_entry);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -11,8 +11,11 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -195,15 +198,29 @@ struct tag_stat {
 	struct data_counters *parent_counters;
 };
 
+/*
+ * Per-cpu slice of the skb based iface totals.
+ * Written with BHs off on the owning cpu, summed up by the readers.
+ */
+struct iface_skb_counters {
+	struct byte_packet_counters bpc[IFS_MAX_DIRECTIONS];
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
 struct iface_stat {
 	struct list_head list;  /* in iface_stat_list */
+	/*
+	 * In iface_stat_hash, keyed by the ifindex of the net_dev it was
+	 * last activated with. Only used by the per-packet lookups.
+	 */
+	struct hlist_node hash_node;
+	int ifindex;
 	char *ifname;
 	bool active;
 	/* net_dev is only valid for active iface_stat */
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
-	struct byte_packet_counters totals_via_skb[IFS_MAX_DIRECTIONS];
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -220,8 +237,38 @@ struct iface_stat {
 
 	struct rb_root tag_stat_tree;
 	spinlock_t tag_stat_list_lock;
+
+	/*
+	 * The iface_stat is allocated from atomic context, so the per-cpu
+	 * counters can't come from alloc_percpu(). nr_cpu_ids entries.
+	 */
+	struct iface_skb_counters skb_counters[0];
 };
 
+/* Fold the per-cpu skb counters into totals[IFS_MAX_DIRECTIONS] */
+static inline void iface_stat_get_skb_totals(const struct iface_stat *is,
+					     struct byte_packet_counters *totals)
+{
+	int cpu, dir;
+
+	memset(totals, 0, sizeof(*totals) * IFS_MAX_DIRECTIONS);
+	for_each_possible_cpu(cpu) {
+		const struct iface_skb_counters *isc = &is->skb_counters[cpu];
+		struct byte_packet_counters snap[IFS_MAX_DIRECTIONS];
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&isc->syncp);
+			memcpy(snap, isc->bpc, sizeof(snap));
+		} while (u64_stats_fetch_retry_bh(&isc->syncp, start));
+
+		for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++) {
+			totals[dir].bytes += snap[dir].bytes;
+			totals[dir].packets += snap[dir].packets;
+		}
+	}
+}
+
 /* This is needed to create proc_dir_entries from atomic context. */
 struct iface_stat_work {
 	struct work_struct iface_work;
@@ -236,6 +283,13 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	/*
+	 * In sock_tag_hash, for the lockless per-packet lookup.
+	 * Once hashed, the tag is never modified: a re-tag publishes a new
+	 * sock_tag, and the old one is freed after an RCU-bh grace period.
+	 */
+	struct hlist_node hash_node;
+	struct rcu_head rcu;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;